@@ -11,10 +11,13 @@ MD5SUM="md5sum"
 UNZIP="unzip"
 WGET="wget"
 OBJCOPY="arm-none-eabi-objcopy"
+ADDR2LINE="arm-none-eabi-addr2line"
 EMU="/usr/local/bin/qemu-system-arm"
 VNC="vinagre"
 GCC="arm-none-eabi-gcc"
 XZCAT="xzcat"
+AWK="awk"
+OD="od"
 # Files and folders
 BIN_DIR="bin"
 DIST_DIR="dist"
@@ -100,3 +103,56 @@ if [[ "${1}" == "deploy" ]]; then
   (cd "${BOOT_DIR}/" && ${MD5SUM} ${IMG_NAME}.img >${IMG_NAME}.img.md5)
   sync
 fi
+
+if [[ "${1}" == "trace" ]]; then
+  if [[ -z "${2}" || ! -f "${2}" ]]; then
+    ${ECHO} "Pass a raw UART capture containing the output of trace_dump()."
+    exit 5
+  fi
+  # Decode the last dump in the capture: "TRACEDUMP <count>\n" followed by 16 byte records
+  HEADER="$(grep -abo "TRACEDUMP [0-9]*" "${2}" | tail -n 1)"
+  if [[ -z "${HEADER}" ]]; then
+    ${ECHO} "No trace dump found in ${2}."
+    exit 6
+  fi
+  OFFSET="${HEADER%%:*}"
+  MARKER="${HEADER#*:}"
+  COUNT="${MARKER##* }"
+  tail -c +$(( OFFSET + ${#MARKER} + 2 )) "${2}" | head -c $(( COUNT * 16 )) | ${OD} -A n -t u4 -w16 -v |
+    ${AWK} 'BEGIN { split("schedule irq sd_command kmalloc gpio_irq thread_create thread_exit", names, " ") }
+      {
+        event = $2 % 65536; seq = int($2 / 65536)
+        name = (event in names) ? names[event] : sprintf("event_%d", event)
+        # A sequence gap means the record was still being written when the dump started
+        mark = (NR > 1 && seq != (last_seq + 1) % 65536) ? "?" : " "
+        delta = (NR > 1) ? $1 - last : 0
+        printf "%10u %+8d %s%-14s 0x%08x 0x%08x\n", $1, delta, mark, name, $3, $4
+        last = $1; last_seq = seq
+      }'
+fi
+
+if [[ "${1}" == "symbolize" ]]; then
+  if [[ -z "${2}" || ! -f "${2}" ]]; then
+    ${ECHO} "Pass a UART capture containing the output of sampler_dump()."
+    exit 7
+  fi
+  # Use the last dump in the capture: "SAMPLES BEGIN <total> <dropped>", "SAMPLE <pc> <pid> <count>" lines, "SAMPLES END"
+  SAMPLES="$(tr -d '\r' < "${2}" | ${AWK} '/^SAMPLES BEGIN/ { out = "" } /^SAMPLE / { out = out $2 " " $3 " " $4 "\n" } END { printf "%s", out }')"
+  TOTAL="$(tr -d '\r' < "${2}" | grep -a "^SAMPLES BEGIN" | tail -n 1 | cut -d ' ' -f 3)"
+  if [[ -z "${SAMPLES}" || -z "${TOTAL}" || "${TOTAL}" == "0" ]]; then
+    ${ECHO} "No samples found in ${2}."
+    exit 8
+  fi
+  SYMBOLS="$(cut -d ' ' -f 1 <<< "${SAMPLES}" | ${ADDR2LINE} -f -s -e ${IMG_NAME}.elf | paste - -)"
+  paste -d ' ' <(${ECHO} "${SAMPLES}") <(${ECHO} "${SYMBOLS}") | ${AWK} -v total="${TOTAL}" '
+    { by_function[$4] += $3; lines[NR] = sprintf("%6.2f%% %6d  %s  pid %-3d %-24s %s", 100 * $3 / total, $3, $1, $2, $4, $5) }
+    END {
+      print "By function:"
+      for (f in by_function)
+        printf "%6.2f%% %6d  %s\n", 100 * by_function[f] / total, by_function[f], f | "sort -rn"
+      close("sort -rn")
+      print "By address:"
+      for (i = 1; i <= NR; i++)
+        print lines[i]
+    }'
+fi
@@ -1,18 +1,61 @@
 #include <stdint.h>
+#include <stdarg.h>
 #ifndef STDLIB_H
 #define STDLIB_H
 
 #define MIN(x,y) ((x < y ? x : y))
 #define MAX(x,y) ((x < y ? y : x))
 
+// Size of the static buffer sprintf renders into
+#define SPRINTF_BUFFER_SIZE 256
+// vprintf_to renders on the stack up to this size and falls back to kmalloc for longer output
+#define PRINTF_BUFFER_SIZE 256
+
+// Where vprintf_to sends the rendered output, e.g. the UART or the framebuffer console
+typedef void (*printf_sink_f)(const char * buf, uint32_t len);
+
 typedef struct divmod_result {
     uint32_t div;
     uint32_t mod;
 } divmod_t;
 
+typedef struct divmod64_result {
+    uint64_t div;
+    uint64_t mod;
+} divmod64_t;
+
+// Precomputed reciprocal for repeated division by the same divisor, see div_const_init
+typedef struct div_const {
+    uint32_t divisor;
+    uint32_t multiplier;
+    uint8_t shift1;
+    uint8_t shift2;
+} div_const_t;
+
 divmod_t divmod(uint32_t dividend, uint32_t divisor);
 uint32_t div(uint32_t dividend, uint32_t divisor);
+divmod64_t divmod64(uint64_t dividend, uint64_t divisor);
+void div_const_init(div_const_t * dc, uint32_t divisor);
+
+static inline uint32_t div_const(uint32_t dividend, const div_const_t * dc) {
+    uint32_t t = (uint32_t)(((uint64_t)dc->multiplier * dividend) >> 32);
+    return (t + ((dividend - t) >> dc->shift1)) >> dc->shift2;
+}
+
+static inline divmod_t divmod_const(uint32_t dividend, const div_const_t * dc) {
+    divmod_t res;
+    res.div = div_const(dividend, dc);
+    res.mod = dividend - res.div * dc->divisor;
+    return res;
+}
+
+// Exact for every 32 bit dividend: 0xCCCCCCCD / 2^35 is slightly above 1/10
+static inline uint32_t div10(uint32_t dividend) {
+    return (uint32_t)(((uint64_t)dividend * 0xCCCCCCCD) >> 35);
+}
+
 void memcpy(void * dest, const void * src, int bytes);
+void memmove(void * dest, const void * src, int bytes);
 
 void bzero(void * dest, int bytes);
 void memset(void * dest, uint8_t c, int bytes);
@@ -24,6 +67,9 @@ uint32_t strlen(const char * str);
 char * itoa(int i, int base);
 int atoi(char * num);
 uint32_t ob_puts(char ** ob, uint32_t obCur, char * str);
+int vsnprintf(char * buf, uint32_t size, const char * fmt, va_list args);
+int snprintf(char * buf, uint32_t size, const char * fmt, ...);
+int vprintf_to(printf_sink_f sink, const char * fmt, va_list args);
 char * sprintf(const char * fmt, ...);
 int strcmp(const char * s1, const char * s2);
 int strncmp(const char * s1, const char * s2, uint32_t n);
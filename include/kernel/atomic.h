@@ -0,0 +1,98 @@
+#include <stdint.h>
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+/**
+ * Atomic operations on 32 bit words built on ldrex/strex.
+ * The IRQ return path and switch_to_thread execute clrex, so an interrupt or thread switch between the
+ * ldrex and the strex makes the strex fail and the operation retries. This makes them safe against
+ * interrupts without disabling them.
+ * The read-modify-write operations are full barriers.
+ */
+
+// ARMv6 barriers are CP15 operations, ARM1176 TRM 3.2.22
+static inline void dmb(void) {
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c10, 5" : : [zero] "r" (0) : "memory");
+}
+
+static inline void dsb(void) {
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c10, 4" : : [zero] "r" (0) : "memory");
+}
+
+static inline void isb(void) {
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c5, 4" : : [zero] "r" (0) : "memory");
+}
+
+static inline uint32_t atomic_load(volatile uint32_t * ptr) {
+    uint32_t val = *ptr;
+    dmb();
+    return val;
+}
+
+static inline void atomic_store(volatile uint32_t * ptr, uint32_t val) {
+    dmb();
+    *ptr = val;
+}
+
+/**
+ * Stores desired if the word still holds expected
+ * @return The previous value, equal to expected if the swap happened
+ */
+static inline uint32_t atomic_cas(volatile uint32_t * ptr, uint32_t expected, uint32_t desired) {
+    uint32_t old, failed;
+    dmb();
+    __asm__ __volatile__(
+        "1: ldrex   %[old], [%[ptr]]\n"
+        "   cmp     %[old], %[expected]\n"
+        "   bne     2f\n"
+        "   strex   %[failed], %[desired], [%[ptr]]\n"
+        "   cmp     %[failed], #0\n"
+        "   bne     1b\n"
+        "2:\n"
+        : [old] "=&r" (old), [failed] "=&r" (failed)
+        : [ptr] "r" (ptr), [expected] "r" (expected), [desired] "r" (desired)
+        : "cc", "memory");
+    dmb();
+    return old;
+}
+
+/**
+ * Adds to the word
+ * @return The value before the addition
+ */
+static inline uint32_t atomic_fetch_add(volatile uint32_t * ptr, uint32_t val) {
+    uint32_t old, new, failed;
+    dmb();
+    __asm__ __volatile__(
+        "1: ldrex   %[old], [%[ptr]]\n"
+        "   add     %[new], %[old], %[val]\n"
+        "   strex   %[failed], %[new], [%[ptr]]\n"
+        "   cmp     %[failed], #0\n"
+        "   bne     1b\n"
+        : [old] "=&r" (old), [new] "=&r" (new), [failed] "=&r" (failed)
+        : [ptr] "r" (ptr), [val] "r" (val)
+        : "cc", "memory");
+    dmb();
+    return old;
+}
+
+/**
+ * Replaces the word
+ * @return The previous value
+ */
+static inline uint32_t atomic_exchange(volatile uint32_t * ptr, uint32_t val) {
+    uint32_t old, failed;
+    dmb();
+    __asm__ __volatile__(
+        "1: ldrex   %[old], [%[ptr]]\n"
+        "   strex   %[failed], %[val], [%[ptr]]\n"
+        "   cmp     %[failed], #0\n"
+        "   bne     1b\n"
+        : [old] "=&r" (old), [failed] "=&r" (failed)
+        : [ptr] "r" (ptr), [val] "r" (val)
+        : "cc", "memory");
+    dmb();
+    return old;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include <kernel/block.h>
+#ifndef BENCH_H
+#define BENCH_H
+
+/**
+ * Micro benchmarks for kernel subsystems.
+ * Each benchmark prints its results to UART. Call them from setup() when needed, building with -D KERNEL_BENCH
+ * additionally runs the cache benchmark during boot.
+ */
+
+void bench_kmalloc(void);
+void bench_caches(void);
+void bench_memcpy(void);
+void bench_div(void);
+void bench_printf(void);
+void bench_sched_latency(void);
+void bench_lock_stress(void);
+void bench_sync(void);
+void bench_msgqueue(void);
+void bench_irq_latency(void);
+void bench_block_iops(struct block_device *dev);
+void bench_block_seq(struct block_device *dev);
+void bench_block_async(struct block_device *dev);
+void bench_block_write(struct block_device *dev);
+void bench_block_cache(struct block_device *dev);
+
+#endif
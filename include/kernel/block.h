@@ -23,9 +23,90 @@
 #define BLOCK_H
 
 #include <kernel/fs.h>
+#include <kernel/sync.h>
+#include <kernel/mutex.h>
 #include <stdint.h>
 #include <stddef.h>
 
+// Priority of the threads servicing the device request queues, below the work queue
+#define BLOCK_QUEUE_PRIORITY (PRIORITY_HIGHEST - 2)
+// Largest transfer the queue builds by merging requests
+#define BLOCK_MERGE_MAX (1 << 20)
+
+// One contiguous piece of a scatter-gather transfer
+struct block_sg {
+    uint8_t *buf;
+    uint32_t len;
+};
+
+struct block_request;
+typedef void (*block_done_f)(struct block_request *req);
+
+/**
+ * A read or write queued with block_submit. On completion result holds the bytes transferred or a negative error.
+ * Either done is called on the queue thread or, if it is NULL, block_wait returns
+ */
+struct block_request {
+    struct block_device *dev;
+    int is_write;
+    uint8_t *buf;
+    uint64_t buf_size;
+    const struct block_sg *sg;      // If not NULL, a read with read_sg into sg_entries pieces instead of buf
+    uint32_t sg_entries;
+    uint32_t block_num;
+    int result;
+    block_done_f done;
+    void *data;                     // For the submitter, e.g. to find its context in done
+
+    semaphore_t complete;
+    struct block_request *next;
+};
+
+// Requests of one device in submission order, executed one after another by the queue thread
+struct block_queue {
+    struct block_device *dev;
+    struct block_request *head;
+    struct block_request *tail;
+    semaphore_t pending;
+    process_control_block_t *thread;
+    uint32_t submitted;
+    uint32_t completed;
+    uint32_t merged;                // Requests that were done as part of an earlier request's command
+};
+
+// One cached device block. Buffers are on a hash chain by block number and on the LRU list while not pinned
+struct block_buf {
+    uint32_t block_num;
+    int valid;
+    int dirty;
+    uint32_t pins;
+    uint8_t *data;
+    struct block_buf *hash_next;
+    struct block_buf *lru_prev;
+    struct block_buf *lru_next;
+};
+
+typedef struct {
+    uint32_t hits;                  // Blocks served from the cache
+    uint32_t misses;                // Blocks read from the device
+    uint32_t evictions;             // Valid buffers reused for another block
+    uint32_t writebacks;            // Dirty buffers written to the device
+    uint32_t bypassed;              // Requests too large for the cache
+} block_cache_stats_t;
+
+// Write-back cache of single blocks in front of a device, most recently used at the head of the LRU list
+struct block_cache {
+    struct block_buf *bufs;
+    uint32_t count;
+    struct block_buf **hash;
+    uint32_t hash_mask;
+    struct block_buf *lru_head;
+    struct block_buf *lru_tail;
+    uint32_t max_blocks;            // Larger requests go to the device directly
+    mutex_t lock;
+    block_cache_stats_t stats;
+};
+
 struct block_device {
     char *driver_name;
     char *device_name;
@@ -37,13 +118,31 @@ struct block_device {
 
     int (*read)(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t block_num);
     int (*write)(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t block_num);
+    // Optional, reads consecutive blocks into several buffers in one command. Each len is a multiple of block_size
+    int (*read_sg)(struct block_device *dev, const struct block_sg *sg, uint32_t entries, uint32_t block_num);
     size_t block_size;
     size_t num_blocks;
 
     struct fs * fs;
+    struct block_queue * queue;     // NULL until block_queue_start, requests then run synchronously
+    struct block_cache * cache;     // NULL until block_cache_init
 };
 
 size_t block_read(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block);
 size_t block_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block);
+int block_queue_start(struct block_device *dev);
+void block_submit(struct block_request *req);
+int block_wait(struct block_request *req);
+size_t block_transfer(struct block_device *dev, int is_write, uint8_t *buf, uint64_t buf_size, uint32_t starting_block);
+size_t block_transfer_sg(struct block_device *dev, const struct block_sg *sg, uint32_t entries, uint32_t starting_block);
+
+int block_cache_init(struct block_device *dev, uint32_t bytes);
+size_t block_cache_read(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block);
+size_t block_cache_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block);
+uint8_t * block_pin(struct block_device *dev, uint32_t block_num);
+void block_unpin(struct block_device *dev, uint32_t block_num, int dirty);
+int block_sync(struct block_device *dev);
+void block_cache_stats(struct block_device *dev, block_cache_stats_t *stats);
+void block_cache_report(struct block_device *dev);
 
 #endif
@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include <kernel/peripheral.h>
+#include <kernel/timer.h>
+#ifndef DMA_H
+#define DMA_H
+
+// BCM2835 DMA controller, ARM peripherals manual chapter 4
+#define DMA_BASE            (PERIPHERAL_BASE + DMA_OFFSET)
+#define DMA_CHANNEL(n)      (DMA_BASE + ((n) << 8))
+#define DMA_ENABLE          (DMA_BASE + 0xff0)
+#define DMA_CS              0x00
+#define DMA_CONBLK_AD       0x04
+#define DMA_DEBUG           0x20
+
+// Channel control and status
+#define DMA_CS_ACTIVE       (1 << 0)
+#define DMA_CS_END          (1 << 1)
+#define DMA_CS_INT          (1 << 2)
+#define DMA_CS_ERROR        (1 << 8)
+#define DMA_CS_PRIORITY(p)  ((p) << 16)
+#define DMA_CS_PANIC(p)     ((p) << 20)
+#define DMA_CS_WAIT_WRITES  (1 << 28)
+#define DMA_CS_ABORT        (1 << 30)
+#define DMA_CS_RESET        (1 << 31)
+
+// Transfer information of a control block
+#define DMA_TI_INTEN        (1 << 0)
+#define DMA_TI_WAIT_RESP    (1 << 3)
+#define DMA_TI_DEST_INC     (1 << 4)
+#define DMA_TI_DEST_DREQ    (1 << 6)
+#define DMA_TI_SRC_INC      (1 << 8)
+#define DMA_TI_SRC_DREQ     (1 << 10)
+#define DMA_TI_PERMAP(p)    ((p) << 16)
+
+// Peripherals pacing a transfer through DREQ
+#define DMA_PERMAP_EMMC     11
+
+// Channel the EMMC driver uses, the firmware leaves it to the ARM
+#define DMA_CHANNEL_EMMC    4
+
+// Addresses as the DMA engine sees them. Memory goes through the VideoCore L2 cache alias like the framebuffer
+#define DMA_BUS_ADDRESS(p)              ((uint32_t)(p) | 0x40000000)
+#define DMA_PERIPHERAL_BUS_ADDRESS(a)   ((uint32_t)(a) - PERIPHERAL_BASE + 0x7E000000)
+
+// Control block, chained through nextconbk. The engine requires 32 byte alignment
+typedef struct {
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t reserved[2];
+} __attribute__ ((aligned (32))) dma_cb_t;
+
+void dma_start(uint32_t channel, dma_cb_t * cb, uint32_t count);
+int dma_wait(uint32_t channel, useconds_t timeout);
+void dma_abort(uint32_t channel);
+
+#endif
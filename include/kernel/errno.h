@@ -32,5 +32,6 @@ int errno;
 #define EROFS		-6
 #define ERANGE		-7
 #define ENOSPC		-8
+#define EIO		-9
 
 #endif
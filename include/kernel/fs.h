@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include <kernel/block.h>
+#include <common/stdlib.h>
 
 struct fs;
 struct dirent {
@@ -57,6 +58,7 @@ struct fs {
     const char *fs_name;
     uint32_t flags;
     uint64_t block_size;
+    div_const_t block_size_div;     // Reciprocal of block_size for fs_fread/fs_fwrite, set up by the driver
 
     FILE *(*fopen)(struct fs *, struct dirent *, const char *mode);
     uint64_t (*fread)(struct fs *, void *ptr, uint64_t byte_size, FILE *stream);
@@ -25,5 +25,6 @@ void write_pixel(uint32_t x, uint32_t y, const pixel_t * pixel);
 void draw_image(image_t *img, uint16_t x, uint16_t y);
 
 void gpu_putc(char c);
+void gpu_write(const char * buf, uint32_t len);
 
 #endif
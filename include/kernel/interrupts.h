@@ -11,6 +11,11 @@
 #define IRQ_IS_GPU1(x) ((x < 32 ))
 #define IRQ_IS_PENDING(regs, num) ((IRQ_IS_BASIC(num) && ((1 << (num-64)) & regs->irq_basic_pending)) || (IRQ_IS_GPU2(num) && ((1 << (num-32)) & regs->irq_gpu_pending2)) || (IRQ_IS_GPU1(num) && ((1 << (num)) & regs->irq_gpu_pending1)))
 #define NUM_IRQS 72
+// Basic pending bits 0 to 7 are the ARM peripheral IRQs 64 to 71
+#define IRQ_BASIC_MASK 0xff
+// FIQ control register: the enable bit and the IRQ number of the one source routed to FIQ
+#define FIQ_CONTROL_ENABLE (1 << 7)
+#define FIQ_STACK_SIZE 1024
 
 __inline__ int INTERRUPTS_ENABLED(void) {
     int res;
@@ -30,14 +35,31 @@ __inline__ void DISABLE_INTERRUPTS(void) {
     }
 }
 
+// Masks the FIQ as well, for data a FIQ handler writes
+__inline__ uint32_t DISABLE_IRQ_FIQ(void) {
+    uint32_t cpsr;
+    __asm__ __volatile__("mrs %[cpsr], CPSR\n\tcpsid if" : [cpsr] "=r" (cpsr) :: "memory");
+    return cpsr;
+}
+
+// Puts back the masks DISABLE_IRQ_FIQ returned
+__inline__ void RESTORE_IRQ_FIQ(uint32_t cpsr) {
+    __asm__ __volatile__("msr CPSR_c, %[cpsr]" :: [cpsr] "r" (cpsr) : "memory");
+}
+
 typedef void (*interrupt_handler_f)(void);
 typedef void (*interrupt_clearer_f)(void);
+// Entered straight from the vector: an __attribute__ ((interrupt ("FIQ"))) function or assembly ending in subs pc, lr, #4
+typedef void (*fiq_handler_f)(void);
 
 
 typedef enum {
     SYSTEM_TIMER_1 = 1,
+    SYSTEM_TIMER_3 = 3,
     USB_CONTROLER = 9,
     GPIO_IRQ = 49,
+    UART_IRQ = 57,
+    EMMC_IRQ = 62,
     ARM_TIMER = 64
 } irq_number_t;
 
@@ -54,10 +76,21 @@ typedef struct {
     uint32_t irq_basic_disable;
 } interrupt_registers_t;
 
+typedef struct {
+    uint32_t count;
+    uint32_t max_cycles;        // Longest clearer plus handler, including other threads if the handler switched to them
+    uint64_t total_cycles;
+} irq_stats_t;
+
 void interrupts_init(void);
 
 void register_irq_handler(irq_number_t irq_num, interrupt_handler_f handler, interrupt_clearer_f clearer);
 void unregister_irq_handler(irq_number_t irq_num);
+void register_fiq_handler(irq_number_t irq_num, fiq_handler_f handler, const uint32_t * banked);
+void unregister_fiq_handler(void);
+void irq_stats(irq_number_t irq_num, irq_stats_t * stats);
+uint32_t irq_spurious_count(void);
+void irq_report(void);
 
 
 #endif
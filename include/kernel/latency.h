@@ -0,0 +1,33 @@
+#include <stdint.h>
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/**
+ * Min/avg/max accumulator for latencies and intervals, in whatever unit the samples are taken:
+ *
+ *     static latency_stats_t wakeup = LATENCY_STATS_INIT;
+ *     ...
+ *     latency_record(&wakeup, pmu_cycles() - woken_at);
+ *     ...
+ *     latency_get(&wakeup, &copy);
+ *     uart_printf("min %u avg %u max %u\n", copy.min, latency_avg(&copy), copy.max);
+ *
+ * Recording is safe from IRQ handlers. min is 0xffffffff until the first sample.
+ */
+
+// total comes first so the 32 bit fields need no padding, the motor FIQ handler depends on the field offsets
+typedef struct {
+    uint64_t total;
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+} latency_stats_t;
+
+#define LATENCY_STATS_INIT {.total = 0, .count = 0, .min = 0xffffffff, .max = 0}
+
+void latency_init(latency_stats_t * stats);
+void latency_record(latency_stats_t * stats, uint32_t sample);
+void latency_get(const latency_stats_t * stats, latency_stats_t * copy);
+uint32_t latency_avg(const latency_stats_t * stats);
+
+#endif
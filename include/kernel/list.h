@@ -23,7 +23,7 @@
  *      gets the first element from the list without removing it
  *
  * struct nodeType * pop_nodeType_list(nodeType_list_t * list)
- *      gets the first element from the list and removes it
+ *      gets the first element from the list and removes it, null if the list is empty
  *
  * uint32_t size_nodeType_list(nodeType_list_t * list)
  *      returns the number of elements in the list
@@ -33,6 +33,9 @@
  *
  * void remove_nodeType(nodeType_list_t * list, struct nodeType * node)
  *      removes the given element from the list
+ *
+ * void insert_nodeType_list(nodeType_list_t * list, struct nodeType * node, struct nodeType * before)
+ *      adds node in front of before, which must be in the list, or to the back of the list if before is null
  */
 #include <stddef.h>
 #include <stdint.h>
@@ -94,16 +97,39 @@ struct nodeType * peek_##nodeType##_list(nodeType##_list_t * list) {         \
 struct nodeType * pop_##nodeType##_list(nodeType##_list_t * list) {          \
     spin_lock(&list->lock);                                                  \
     struct nodeType * res = list->head;                                      \
-    list->head = list->head->next##nodeType;                                 \
-    list->head->prev##nodeType = NULL;                                       \
+    if (res == NULL) {                                                       \
+        spin_unlock(&list->lock);                                            \
+        return NULL;                                                         \
+    }                                                                        \
+    list->head = res->next##nodeType;                                        \
     list->size -= 1;                                                         \
     if (list->head == NULL) {                                                \
         list->tail = NULL;                                                   \
+    } else {                                                                 \
+        list->head->prev##nodeType = NULL;                                   \
     }                                                                        \
     spin_unlock(&list->lock);                                                \
     return res;                                                              \
 }                                                                            \
                                                                              \
+void insert_##nodeType##_list(nodeType##_list_t * list, struct nodeType * node, struct nodeType * before) { \
+    if (before == NULL) {                                                    \
+        append_##nodeType##_list(list, node);                                \
+        return;                                                              \
+    }                                                                        \
+    spin_lock(&list->lock);                                                  \
+    node->next##nodeType = before;                                           \
+    node->prev##nodeType = before->prev##nodeType;                           \
+    if (before->prev##nodeType == NULL) {                                    \
+        list->head = node;                                                   \
+    } else {                                                                 \
+        before->prev##nodeType->next##nodeType = node;                       \
+    }                                                                        \
+    before->prev##nodeType = node;                                           \
+    list->size += 1;                                                         \
+    spin_unlock(&list->lock);                                                \
+}                                                                            \
+                                                                             \
 uint32_t size_##nodeType##_list(nodeType##_list_t * list) {                  \
     return list->size;                                                       \
 }                                                                            \
@@ -114,18 +140,21 @@ struct nodeType * next_##nodeType##_list(struct nodeType * node) {           \
                                                                              \
 void remove_##nodeType (nodeType##_list_t * list, struct nodeType * node) {  \
     spin_lock(&list->lock);                                                  \
-    struct nodeType * cur = list->tail;                                      \
+    struct nodeType * cur = list->head;                                      \
     while (cur != NULL && cur != node) {                                     \
         cur = cur->next##nodeType;                                           \
-        if (cur == NULL) return spin_unlock(&list->lock);                    \
+    }                                                                        \
+    if (cur == NULL) {                                                       \
+        spin_unlock(&list->lock);                                            \
+        return;                                                              \
     }                                                                        \
     if (node->prev##nodeType == NULL) {                                      \
-        list->tail = node->next##nodeType;                                   \
+        list->head = node->next##nodeType;                                   \
     } else {                                                                 \
         node->prev##nodeType->next##nodeType = node->next##nodeType;         \
     }                                                                        \
     if (node->next##nodeType == NULL) {                                      \
-        list->head = node->prev##nodeType;                                   \
+        list->tail = node->prev##nodeType;                                   \
     } else {                                                                 \
         node->next##nodeType->prev##nodeType = node->prev##nodeType;         \
     }                                                                        \
@@ -7,12 +7,18 @@
 #define PAGE_SIZE 4096
 #define KERNEL_HEAP_SIZE (1024*1024)
 #define KERNEL_STACK_SIZE PAGE_SIZE
+#define PAGE_MAX_ORDER 10       // Largest contiguous block is 2^10 pages (4 MB)
+#define ZERO_POOL_SIZE 16       // Number of pages kept zeroed in advance for alloc_page
 
 typedef struct {
 	uint8_t allocated: 1;			// This page is allocated to something
 	uint8_t kernel_page: 1;			// This page is a part of the kernel
 	uint8_t kernel_heap_page: 1;	// This page is a part of the kernel
-	uint32_t reserved: 29;
+	uint8_t slab_page: 1;			// This page is carved into kmalloc size class objects
+	uint8_t slab_class: 3;			// The size class of the objects in this page
+	uint8_t buddy_head: 1;			// This page is the first page of a free block
+	uint8_t order: 4;				// The order of the free block this page is the head of
+	uint32_t reserved: 20;
 } page_flags_t;
 
 DEFINE_LIST(page);
@@ -23,11 +29,22 @@ typedef struct page {
 	DEFINE_LINK(page);
 } page_t;
 
+typedef struct {
+	uint32_t size;		// Pages currently waiting in the pool
+	uint32_t hits;		// alloc_page calls served from the pool
+	uint32_t misses;	// alloc_page calls that had to zero a page on demand
+} zero_pool_stats_t;
 
 void mem_init(atag_t * atags);
 
 void * alloc_page(void);
+void * alloc_page_nozero(void);
 void free_page(void * ptr);
+void * alloc_pages(uint32_t order);
+void free_pages(void * ptr, uint32_t order);
+void page_stats(uint32_t free_blocks[PAGE_MAX_ORDER + 1]);
+uint32_t zero_pool_refill(uint32_t max_pages);
+void zero_pool_stats(zero_pool_stats_t * stats);
 
 void * kmalloc(uint32_t bytes);
 void kfree(void *ptr);
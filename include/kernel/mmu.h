@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <kernel/peripheral.h>
+#ifndef MMU_H
+#define MMU_H
+
+#define CACHE_LINE_SIZE 32
+#define MMU_SECTION_SIZE 0x100000
+#define MMU_NUM_SECTIONS 4096
+
+// Section descriptor bits (ARMv6 format, subpages disabled)
+#define MMU_SECTION             0x2
+#define MMU_SECTION_B           (1 << 2)
+#define MMU_SECTION_C           (1 << 3)
+#define MMU_SECTION_XN          (1 << 4)
+#define MMU_SECTION_DOMAIN(d)   ((d) << 5)
+#define MMU_SECTION_AP_RW       (3 << 10)
+#define MMU_SECTION_TEX(t)      ((t) << 12)
+
+// Memory types used for the identity mapping
+#define MMU_NORMAL_CACHED       (MMU_SECTION | MMU_SECTION_AP_RW | MMU_SECTION_C | MMU_SECTION_B)
+#define MMU_NORMAL_UNCACHED     (MMU_SECTION | MMU_SECTION_AP_RW | MMU_SECTION_TEX(1))
+#define MMU_DEVICE              (MMU_SECTION | MMU_SECTION_AP_RW | MMU_SECTION_B | MMU_SECTION_XN)
+
+// Control register bits
+#define SCTLR_MMU               (1 << 0)
+#define SCTLR_DCACHE            (1 << 2)
+#define SCTLR_BRANCH_PREDICT    (1 << 11)
+#define SCTLR_ICACHE            (1 << 12)
+#define SCTLR_XP                (1 << 23)
+
+void mmu_init(void);
+
+void caches_enable(void);
+void caches_disable(void);
+
+// Cache maintenance for memory shared with the GPU or DMA engines.
+// Buffers should be CACHE_LINE_SIZE aligned so neighbouring data is not affected.
+void dcache_clean_range(const void * start, uint32_t len);
+void dcache_invalidate_range(const void * start, uint32_t len);
+void dcache_clean_invalidate_range(const void * start, uint32_t len);
+// After writing instructions: clean them out of the data cache first, the instruction side does not look there
+void icache_invalidate(void);
+
+#endif
@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <kernel/process.h>
+#ifndef MSGQUEUE_H
+#define MSGQUEUE_H
+
+/**
+ * Fixed capacity message queue with any number of producers and a single consumer.
+ * Sending never blocks, so IRQ handlers can post to a thread. It only masks interrupts briefly to wake a
+ * receiver that is waiting.
+ * Messages are written and read in place: msgq_reserve/msgq_commit on the sending side and
+ * msgq_receive/msgq_release on the receiving side, msgq_send/msgq_recv copy for convenience.
+ */
+
+typedef struct {
+    uint8_t * slots;
+    uint32_t slot_shift;            // log2 of the slot size, header included
+    uint32_t mask;                  // Capacity - 1
+    uint32_t msg_size;
+    volatile uint32_t reserved;     // Next sequence number producers hand out
+    volatile uint32_t tail;         // Sequence number of the next message the consumer reads
+    pcb_list_t wait_queue;          // The consumer while it waits for a message
+    volatile uint32_t dropped;      // Sends that found the queue full
+} msgqueue_t;
+
+int msgq_init(msgqueue_t * queue, uint32_t msg_size, uint32_t capacity);
+void * msgq_reserve(msgqueue_t * queue);
+void msgq_commit(msgqueue_t * queue, void * msg);
+int msgq_send(msgqueue_t * queue, const void * msg);
+void * msgq_receive(msgqueue_t * queue, uint32_t timeout_us);
+void msgq_release(msgqueue_t * queue);
+int msgq_recv(msgqueue_t * queue, void * msg, uint32_t timeout_us);
+uint32_t msgq_count(msgqueue_t * queue);
+
+#endif
@@ -2,13 +2,18 @@
 #ifndef MUTEX_H
 #define MUTEX_H
 
+/**
+ * Sleeping lock. Waiters queue by priority and an unlock hands the mutex directly to the first of them,
+ * so a thread that keeps relocking cannot starve the waiters
+ */
 typedef struct {
-    int lock;
-    process_control_block_t * locker;
-    pcb_list_t wait_queue;
+    int lock;                           // 1 while free, taken with try_lock
+    process_control_block_t * owner;    // The holding thread, NULL while free
+    pcb_list_t wait_queue;              // Highest priority first
 } mutex_t;
 
 void mutex_init(mutex_t * lock);
 void mutex_lock(mutex_t * lock);
+int mutex_try_lock(mutex_t * lock);
 void mutex_unlock(mutex_t * lock);
 #endif
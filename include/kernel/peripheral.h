@@ -17,6 +17,7 @@
 #define UART0_OFFSET 0x201000
 #define PWM_OFFSET   0x20C000
 #define EMMC_OFFSET  0x300000
+#define DMA_OFFSET   0x7000
 
 void mmio_write(uint32_t reg, uint32_t data);
 uint32_t mmio_read(uint32_t reg);
@@ -0,0 +1,53 @@
+#include <stdint.h>
+#ifndef PMU_H
+#define PMU_H
+
+// Performance monitor control register (PMNC) bits, ARM1176 TRM 3.2.51
+#define PMNC_ENABLE             (1 << 0)
+#define PMNC_RESET_COUNTERS     (1 << 1)
+#define PMNC_RESET_CCNT         (1 << 2)
+#define PMNC_OVERFLOW_FLAGS     (7 << 8)
+#define PMNC_EVENT1(e)          ((e) << 12)
+#define PMNC_EVENT0(e)          ((e) << 20)
+
+// Events the two configurable counters can count
+typedef enum {
+    PMU_EVENT_ICACHE_MISS = 0x00,
+    PMU_EVENT_ITLB_MISS = 0x03,             // Instruction micro TLB
+    PMU_EVENT_DTLB_MISS = 0x04,             // Data micro TLB
+    PMU_EVENT_BRANCH = 0x05,
+    PMU_EVENT_BRANCH_MISPREDICT = 0x06,
+    PMU_EVENT_INSTRUCTION = 0x07,
+    PMU_EVENT_DCACHE_ACCESS = 0x09,
+    PMU_EVENT_DCACHE_MISS = 0x0B,
+    PMU_EVENT_DCACHE_WRITEBACK = 0x0C,
+    PMU_EVENT_MAIN_TLB_MISS = 0x0F,
+    PMU_EVENT_CYCLES = 0xFF
+} pmu_event_t;
+
+static inline uint32_t pmu_cycles(void) {
+    uint32_t val;
+    __asm__ __volatile__("mrc p15, 0, %[val], c15, c12, 1" : [val] "=r" (val));
+    return val;
+}
+
+static inline uint32_t pmu_counter0(void) {
+    uint32_t val;
+    __asm__ __volatile__("mrc p15, 0, %[val], c15, c12, 2" : [val] "=r" (val));
+    return val;
+}
+
+static inline uint32_t pmu_counter1(void) {
+    uint32_t val;
+    __asm__ __volatile__("mrc p15, 0, %[val], c15, c12, 3" : [val] "=r" (val));
+    return val;
+}
+
+void pmu_init(pmu_event_t event0, pmu_event_t event1);
+void pmu_select(pmu_event_t event0, pmu_event_t event1);
+void pmu_reset(void);
+pmu_event_t pmu_event0(void);
+pmu_event_t pmu_event1(void);
+const char * pmu_event_name(pmu_event_t event);
+
+#endif
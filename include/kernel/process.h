@@ -5,8 +5,33 @@
 #define PROCESS_H
 
 
+// Fixed priorities, higher numbers run first. Threads of the same priority share the CPU round-robin
+#define PRIORITY_LEVELS 32
+#define PRIORITY_LOWEST 0
+#define PRIORITY_DEFAULT 8
+#define PRIORITY_HIGHEST (PRIORITY_LEVELS - 1)
+
+// Time slice for round-robin within a priority. The timer only runs while a thread has to be preempted
+#define SCHEDULER_QUANTUM 10000
+
+// Timeout for waits that only end when they are signalled
+#define WAIT_FOREVER 0xffffffff
+
 typedef void (*kthread_function_f)(void);
 
+typedef struct scheduler_stats {
+    uint32_t uptime_us;
+    uint32_t idle_us;                 // Time the CPU slept in wfi because no thread was ready
+    uint32_t timer_irqs;
+    uint32_t context_switches;
+} scheduler_stats_t;
+
+typedef enum {
+    THREAD_RUNNING,
+    THREAD_READY,                     // Waiting in the run queue of its priority
+    THREAD_BLOCKED                    // Waiting for wake_thread or its wake_time
+} thread_state_t;
+
 typedef struct {
     uint32_t r0;
     uint32_t r1; 
@@ -31,15 +56,39 @@ typedef struct pcb {
     proc_saved_state_t * saved_state; // Pointer to where on the stack this process's state is saved. Becomes invalid once the process is running
     void * stack_page;                // The stack for this proces.  The stack starts at the end of this page
     uint32_t pid;                     // The process ID number
-    DEFINE_LINK(pcb);
+    uint32_t priority;                // PRIORITY_LOWEST to PRIORITY_HIGHEST
+    thread_state_t state;
+    DEFINE_LINK(pcb);                 // Links the process into a run queue or a wait queue
+    struct pcb * next_proc;           // Links all processes
+    struct pcb * next_sleeper;        // Links the sleep queue
+    int sleeping;                     // Whether the process is in the sleep queue
+    pcb_list_t * waiting_on;          // The wait queue the process is in, NULL if none
+    int timed_out;                    // Whether the last wait ended by its timeout
+    uint32_t wait_mask;               // What the process waits for, meaning depends on the wait queue
+    uint32_t wait_options;
+    uint32_t wake_time;               // Timer value at which a sleeping process becomes ready
     char proc_name[20];               // The process's name
 } process_control_block_t;
 
 
 
+extern process_control_block_t * current_process;
+
 void process_init(void);
 
-void create_kernel_thread(kthread_function_f thread_func, char * name, int name_len);
+process_control_block_t * create_kernel_thread(kthread_function_f thread_func, char * name, int name_len, uint32_t priority);
+void set_thread_priority(process_control_block_t * pcb, uint32_t priority);
 void schedule(void);
+void block_current_thread(void);
+void wake_thread(process_control_block_t * pcb);
+void wait_queue_add(pcb_list_t * queue, uint32_t timeout_us);
+int wait_queue_block(void);
+void wait_queue_remove(pcb_list_t * queue, process_control_block_t * pcb);
+process_control_block_t * wait_queue_pop(pcb_list_t * queue);
+void ksleep_us(uint32_t usecs);
+void ksleep_until(uint32_t deadline);
+void scheduler_require_tick(int enable);
+void scheduler_stats(scheduler_stats_t * stats);
+void scheduler_report(void);
 
 #endif
@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <kernel/pmu.h>
+#ifndef PROF_H
+#define PROF_H
+
+/**
+ * Cycle accurate probes around hot paths:
+ *
+ *     PROF_DEFINE(read_probe, "block_read");
+ *     ...
+ *     PROF_BEGIN(read_probe);
+ *     do_work();
+ *     PROF_END(read_probe);
+ *
+ * Each probe accumulates count and min/avg/max cycles plus both PMU event counters.
+ * A probe shows up in prof_report after its first PROF_END.
+ */
+
+typedef struct prof_probe {
+    const char * name;
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+    uint64_t total_event0;
+    uint64_t total_event1;
+    int registered;
+    struct prof_probe * next;
+} prof_probe_t;
+
+typedef struct prof_scope {
+    uint32_t cycles;
+    uint32_t event0;
+    uint32_t event1;
+} prof_scope_t;
+
+#define PROF_DEFINE(probe, probe_name) static prof_probe_t probe = {.name = probe_name, .min_cycles = 0xffffffff}
+#define PROF_BEGIN(probe) prof_scope_t probe##_scope; prof_begin(&probe##_scope)
+#define PROF_END(probe) prof_end(&probe, &probe##_scope)
+
+static inline void prof_begin(prof_scope_t * scope) {
+    scope->event0 = pmu_counter0();
+    scope->event1 = pmu_counter1();
+    scope->cycles = pmu_cycles();
+}
+
+void prof_end(prof_probe_t * probe, const prof_scope_t * scope);
+void prof_reset(void);
+void prof_report(void);
+
+#endif
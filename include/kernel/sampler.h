@@ -0,0 +1,23 @@
+#include <stdint.h>
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// Number of distinct (pc, pid) pairs the histogram holds
+#define SAMPLER_BUCKET_BITS 9
+#define SAMPLER_BUCKETS (1 << SAMPLER_BUCKET_BITS)
+// Buckets tried before a sample is dropped
+#define SAMPLER_MAX_PROBES 8
+
+typedef struct sampler_bucket {
+    uint32_t pc;
+    uint32_t pid;
+    uint32_t count;
+} sampler_bucket_t;
+
+void sampler_start(void);
+void sampler_stop(void);
+void sampler_reset(void);
+void sampler_record(uint32_t pc);
+void sampler_dump(uint32_t top_n);
+
+#endif
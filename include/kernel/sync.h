@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include <kernel/process.h>
+#include <kernel/mutex.h>
+#ifndef SYNC_H
+#define SYNC_H
+
+/**
+ * Blocking synchronization for kernel threads.
+ * Waiters queue by priority. Posting, signalling and setting flags never block, so IRQ handlers
+ * may do it. Waiting needs a thread context.
+ */
+
+// Counting semaphore
+typedef struct {
+    uint32_t count;
+    pcb_list_t wait_queue;
+} semaphore_t;
+
+// Condition variable, used together with a mutex_t
+typedef struct {
+    pcb_list_t wait_queue;
+} cond_t;
+
+// Group of 32 event flags
+typedef struct {
+    uint32_t flags;
+    pcb_list_t wait_queue;
+} event_flags_t;
+
+// Options for event_wait
+#define EVENT_WAIT_ANY 0            // Any of the requested flags ends the wait
+#define EVENT_WAIT_ALL (1 << 0)     // All of the requested flags have to be set
+#define EVENT_CLEAR (1 << 1)        // Clear the requested flags that ended the wait
+
+void sem_init(semaphore_t * sem, uint32_t count);
+void sem_wait(semaphore_t * sem);
+int sem_wait_timeout(semaphore_t * sem, uint32_t timeout_us);
+int sem_try_wait(semaphore_t * sem);
+void sem_post(semaphore_t * sem);
+
+void cond_init(cond_t * cond);
+void cond_wait(cond_t * cond, mutex_t * mutex);
+int cond_wait_timeout(cond_t * cond, mutex_t * mutex, uint32_t timeout_us);
+void cond_signal(cond_t * cond);
+void cond_broadcast(cond_t * cond);
+
+void event_init(event_flags_t * event);
+uint32_t event_wait(event_flags_t * event, uint32_t mask, uint32_t options, uint32_t timeout_us);
+void event_set(event_flags_t * event, uint32_t flags);
+void event_clear(event_flags_t * event, uint32_t flags);
+
+#endif
@@ -4,7 +4,11 @@
 #define TIMER_H
 
 #define SYSTEM_TIMER_BASE (SYSTEM_TIMER_OFFSET + PERIPHERAL_BASE)
+#define TIMER_CS          0x0
 #define TIMER_CLO         0x4
+#define TIMER_C3          0x18
+// Deadlines closer than this are moved out so the counter cannot pass them before they are written
+#define TIMER_MIN_DELAY   10
 
 typedef unsigned int useconds_t;
 struct timer_wait {
@@ -16,6 +20,9 @@ struct timer_wait {
 void timer_init(void);
 
 void timer_set(useconds_t usecs);
+void timer_set_deadline(uint32_t deadline);
+void timer_cancel(void);
+uint32_t timer_irq_count(void);
 void udelay(useconds_t usecs);
 struct timer_wait register_timer(useconds_t usec);
 int compare_timer(struct timer_wait tw);
@@ -0,0 +1,35 @@
+#include <stdint.h>
+#ifndef TRACE_H
+#define TRACE_H
+
+// Number of records kept, must be a power of two. Older records are overwritten
+#define TRACE_BUFFER_SIZE 1024
+
+// Marks the start of a binary dump on UART, followed by the record count and the records
+#define TRACE_DUMP_MAGIC "TRACEDUMP"
+
+typedef enum {
+    TRACE_SCHEDULE = 1,         // arg0: pid switched from, arg1: pid switched to
+    TRACE_IRQ = 2,              // arg0: irq number
+    TRACE_SD_COMMAND = 3,       // arg0: command register, arg1: argument
+    TRACE_KMALLOC = 4,          // arg0: requested bytes, arg1: returned pointer
+    TRACE_GPIO_IRQ = 5,         // arg0: pending gpio event mask
+    TRACE_THREAD_CREATE = 6,    // arg0: pid, arg1: pcb address
+    TRACE_THREAD_EXIT = 7,      // arg0: pid of the reaped thread, arg1: pid switched to
+    TRACE_USER = 0x100          // First id free for ad hoc tracepoints
+} trace_event_t;
+
+typedef struct trace_record {
+    uint32_t timestamp;         // System timer in microseconds
+    uint16_t event;
+    uint16_t seq;               // Low bits of the record number, tells a finished record from a stale one
+    uint32_t arg0;
+    uint32_t arg1;
+} trace_record_t;
+
+void trace_event(uint16_t event, uint32_t arg0, uint32_t arg1);
+void trace_enable(int enabled);
+void trace_reset(void);
+void trace_dump(void);
+
+#endif
@@ -6,6 +6,18 @@
 #ifndef UART_H
 #define UART_H
 
+// Default ring buffer sizes for interrupt driven mode, rounded up to a power of two
+#define UART_TX_BUFFER_SIZE 4096
+#define UART_RX_BUFFER_SIZE 256
+
+// Interrupt mask/status bits (IMSC, RIS, MIS, ICR)
+#define UART_INT_RX (1 << 4)
+#define UART_INT_TX (1 << 5)
+#define UART_INT_RT (1 << 6)
+#define UART_INT_OE (1 << 10)
+
+// Overrun error bit of a received character in UART0_DR
+#define UART_DR_OE (1 << 11)
 
 typedef union uart_flags {
     struct {
@@ -43,6 +55,22 @@ typedef union uart_control {
     uint32_t as_int;
 } uart_control_t;
 
+// FIFO fill level at which the TX/RX interrupts trigger (UART0_IFLS)
+typedef enum {
+    UART_FIFO_1_8 = 0,
+    UART_FIFO_1_4 = 1,
+    UART_FIFO_1_2 = 2,
+    UART_FIFO_3_4 = 3,
+    UART_FIFO_7_8 = 4
+} uart_fifo_level_t;
+
+typedef struct uart_stats {
+    uint32_t tx_overflows;      // Bytes uart_write could not queue because the TX ring was full
+    uint32_t rx_overflows;      // Received bytes dropped because the RX ring was full
+    uint32_t rx_overruns;       // Bytes lost in hardware because the RX FIFO was not drained in time
+    uint32_t interrupts;
+} uart_stats_t;
+
 enum
 {
     // The base address for UART.
@@ -73,7 +101,18 @@ uart_flags_t read_flags(void);
 void uart_putc(unsigned char c);
 unsigned char uart_getc();
 void uart_puts(const char* str);
+void uart_putn(const char * buf, size_t len);
 void uart_println(const char * str);
 void uart_printf(const char * fmt, ...);
 
+void uart_irq_init(uint32_t tx_size, uint32_t rx_size, uart_fifo_level_t tx_level, uart_fifo_level_t rx_level);
+size_t uart_write(const char * buf, size_t len);
+size_t uart_read(char * buf, size_t len);
+void uart_flush(void);
+void uart_stats(uart_stats_t * stats);
+
+void uart_polled_putc(unsigned char c);
+void uart_polled_puts(const char * str);
+void uart_panic_mode(void);
+
 #endif
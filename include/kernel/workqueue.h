@@ -0,0 +1,32 @@
+#include <stdint.h>
+#include <kernel/process.h>
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+/**
+ * Deferred work for interrupt handlers.
+ * An IRQ handler acknowledges its device and queues a work item, one of a pool of kernel threads created
+ * at boot runs it. Work functions run in thread context and may block, take mutexes and allocate
+ * (kmalloc and the page allocator are interrupt safe).
+ */
+
+#define WORKQUEUE_THREADS 2
+#define WORKQUEUE_CAPACITY 64
+// Above everything but threads that explicitly run at PRIORITY_HIGHEST
+#define WORKQUEUE_PRIORITY (PRIORITY_HIGHEST - 1)
+
+typedef void (*work_func_f)(uint32_t arg);
+
+typedef struct {
+    uint32_t queued;
+    uint32_t executed;
+    uint32_t dropped;           // work_queue calls that found the queue full
+    uint32_t latency_max;       // Cycles from work_queue until the work function starts
+    uint32_t latency_avg;
+} workqueue_stats_t;
+
+void workqueue_init(void);
+int work_queue(work_func_f func, uint32_t arg);
+void workqueue_stats(workqueue_stats_t * stats);
+
+#endif
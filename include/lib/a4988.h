@@ -1,3 +1,4 @@
+#include <kernel/latency.h>
 #ifndef RABAMOS_A4988_H
 #define RABAMOS_A4988_H
 
@@ -30,6 +31,18 @@ typedef struct {
     motor_config_t * config;
 } motor_t;
 
+// Edge timing of a motor_timed_steps job. motor_fiq_handler depends on the field offsets
+typedef struct {
+    latency_stats_t intervals;      // Edge to edge times in cycles
+    volatile uint32_t remaining;    // Step pin edges still to generate
+    uint32_t last_edge;             // Cycle counter at the previous edge
+    uint32_t edges;                 // Edges generated so far
+} motor_timing_t;
+
+// How motor_timed_steps times the step pulses
+#define MOTOR_TIMED_IRQ 0
+#define MOTOR_TIMED_FIQ 1
+
 motor_t * init_motor(uint8_t pin_step, uint8_t pin_dir, uint8_t pin_sleep, uint16_t resolution);
 void motor_step(motor_t *motor);
 void motor_pause(motor_t *motor);
@@ -38,5 +51,10 @@ void motor_set_dir(motor_t *motor, uint8_t dir);
 void motor_switch_dir(motor_t *motor);
 void motor_turn_steps(motor_t *motor, uint64_t steps);
 void motor_turn_steps_in_usec(motor_t *motor, uint64_t steps, uint32_t usec);
+int motor_timed_steps(motor_t *motor, uint32_t steps, uint32_t step_usec, int mode);
+int motor_timed_busy(void);
+void motor_timed_wait(void);
+void motor_timed_timing(motor_timing_t *result);
+void motor_jitter_bench(motor_t *motor);
 
 #endif
\ No newline at end of file
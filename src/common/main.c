@@ -66,7 +66,7 @@ void setup() {
     }
 
     uart_printf("Mounted SD card '%s' with driver '%s' [%d blocks a %d]\n", get_device()->device_name, get_device()->driver_name, get_device()->num_blocks, get_device()->block_size);
-    uart_printf("Root folder starting at '%x'\n", sdcard.dirbase);
+    uart_printf("Root folder starting at '%#x'\n", sdcard.dirbase);
 
     char * cfgfn = "config.txt";
     rc = pf_open(cfgfn);
@@ -194,7 +194,7 @@ void home() {
 
 void loop() {
     putc('.');
-    udelay(100000);
+    ksleep_us(100000);
 }
 
 // Realtime ticks
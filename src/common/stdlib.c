@@ -3,27 +3,32 @@
 #include <stdint.h>
 #include <stdarg.h>
 
-__inline__ uint32_t div(uint32_t dividend, uint32_t divisor) {
-    uint32_t denom=divisor;
-    uint32_t current = 1;
-    uint32_t answer=0;
-
-    if ( denom > dividend)
+/**
+ * There is no hardware divider on the ARM1176, so division is done in software.
+ * Powers of two are shifts, 10 is a reciprocal multiply and everything else is a shift-subtract loop
+ * that starts at the highest set bit of the dividend instead of bit 31.
+ */
+uint32_t div(uint32_t dividend, uint32_t divisor) {
+    uint32_t denom, current, answer = 0;
+    int shift;
+
+    if (divisor > dividend || divisor == 0)
         return 0;
 
-    if ( denom == dividend)
-        return 1;
+    // Powers of two
+    if ((divisor & (divisor - 1)) == 0)
+        return dividend >> __builtin_ctz(divisor);
 
-    while (denom <= dividend) {
-        denom <<= 1;
-        current <<= 1;
-    }
+    if (divisor == 10)
+        return div10(dividend);
 
-    denom >>= 1;
-    current >>= 1;
+    // Line the highest bit of the divisor up with the highest bit of the dividend
+    shift = __builtin_clz(divisor) - __builtin_clz(dividend);
+    denom = divisor << shift;
+    current = 1 << shift;
 
-    while (current!=0) {
-        if ( dividend >= denom) {
+    while (current != 0) {
+        if (dividend >= denom) {
             dividend -= denom;
             answer |= current;
         }
@@ -33,28 +38,214 @@ __inline__ uint32_t div(uint32_t dividend, uint32_t divisor) {
     return answer;
 }
 
-__inline__ divmod_t divmod(uint32_t dividend, uint32_t divisor) {
+divmod_t divmod(uint32_t dividend, uint32_t divisor) {
     divmod_t res;
     res.div = div(dividend, divisor);
     res.mod = dividend - res.div*divisor;
     return res;
 }
 
+/**
+ * 64 bit division. Falls back to the 32 bit routine if both operands fit into 32 bits.
+ * Like divmod, dividing by zero gives a quotient of 0 and the dividend as remainder.
+ */
+divmod64_t divmod64(uint64_t dividend, uint64_t divisor) {
+    divmod64_t res;
+    divmod_t res32;
+    uint64_t rem = 0, quot = 0;
+    uint32_t bits = 64;
+
+    if ((dividend >> 32) == 0 && (divisor >> 32) == 0) {
+        res32 = divmod((uint32_t)dividend, (uint32_t)divisor);
+        res.div = res32.div;
+        res.mod = res32.mod;
+        return res;
+    }
+
+    if (divisor > dividend || divisor == 0) {
+        res.div = 0;
+        res.mod = dividend;
+        return res;
+    }
+
+    // Skip the leading zeros, the high word is known to be non zero
+    while ((dividend >> 63) == 0) {
+        dividend <<= 1;
+        bits--;
+    }
+
+    while (bits--) {
+        rem = (rem << 1) | (dividend >> 63);
+        dividend <<= 1;
+        quot <<= 1;
+        if (rem >= divisor) {
+            rem -= divisor;
+            quot |= 1;
+        }
+    }
+
+    res.div = quot;
+    res.mod = rem;
+    return res;
+}
+
+/**
+ * Prepares the multiply-and-shift replacement for dividing by a divisor that is used over and over again
+ * (Granlund/Montgomery: m = 2^32 * (2^l - d) / d + 1 with l = ceil(log2(d))).
+ * This costs one 64 bit division, every div_const afterwards is a multiply, an add and two shifts.
+ */
+void div_const_init(div_const_t * dc, uint32_t divisor) {
+    uint32_t l = divisor > 1 ? 32 - __builtin_clz(divisor - 1) : 0;
+    uint32_t distance = (l < 32 ? (1u << l) : 0) - divisor; // 2^l - d, which always fits into 32 bits
+
+    dc->divisor = divisor;
+    dc->multiplier = (uint32_t)divmod64((uint64_t)distance << 32, divisor).div + 1;
+    dc->shift1 = l > 0 ? 1 : 0;
+    dc->shift2 = l > 0 ? l - 1 : 0;
+}
+
+/**
+ * Copies 32 bytes per iteration with ldm/stm bursts once both pointers are word aligned.
+ * If source and destination can not be aligned to each other, the destination is aligned and every word
+ * is put together from the two aligned source words it straddles.
+ */
 void memcpy(void * dest, const void * src, int bytes) {
-    char * d = dest;
-    const char * s = src;
-    while (bytes--) {
+    uint8_t * d = dest;
+    const uint8_t * s = src;
+    const uint32_t * ws;
+    uint32_t blocks, shift, prev, next;
+
+    if ((((uint32_t)d ^ (uint32_t)s) & 3) == 0) {
+        // Align the head
+        while (bytes > 0 && ((uint32_t)d & 3)) {
+            *d++ = *s++;
+            bytes--;
+        }
+
+        blocks = bytes >> 5;
+        if (blocks) {
+            __asm__ __volatile__(
+                "1:\n\t"
+                "ldmia %[s]!, {r3-r6}\n\t"
+                "stmia %[d]!, {r3-r6}\n\t"
+                "ldmia %[s]!, {r3-r6}\n\t"
+                "stmia %[d]!, {r3-r6}\n\t"
+                "subs %[n], %[n], #1\n\t"
+                "bne 1b"
+                : [d] "+r" (d), [s] "+r" (s), [n] "+r" (blocks)
+                :
+                : "r3", "r4", "r5", "r6", "cc", "memory");
+            bytes &= 31;
+        }
+
+        while (bytes >= 4) {
+            *(uint32_t *)d = *(const uint32_t *)s;
+            d += 4;
+            s += 4;
+            bytes -= 4;
+        }
+    } else if (bytes >= 8) {
+        while ((uint32_t)d & 3) {
+            *d++ = *s++;
+            bytes--;
+        }
+
+        // Little endian: the low bytes of a destination word come from the top of the earlier source word.
+        // Only aligned words holding at least one byte to be copied are read
+        shift = ((uint32_t)s & 3) << 3;
+        ws = (const uint32_t *)((uint32_t)s & ~3);
+        prev = *ws++;
+        while (bytes >= 4) {
+            next = *ws++;
+            *(uint32_t *)d = (prev >> shift) | (next << (32 - shift));
+            prev = next;
+            d += 4;
+            s += 4;
+            bytes -= 4;
+        }
+    }
+
+    while (bytes-- > 0) {
         *d++ = *s++;
     }
 }
 
+/**
+ * Like memcpy, but the areas may overlap
+ */
+void memmove(void * dest, const void * src, int bytes) {
+    uint8_t * d = dest;
+    const uint8_t * s = src;
+
+    // Copying forward is safe unless the destination starts inside the source
+    if (d <= s || d >= s + bytes) {
+        memcpy(dest, src, bytes);
+        return;
+    }
+
+    // Copy backwards, word wise if the tails can be aligned
+    d += bytes;
+    s += bytes;
+    if ((((uint32_t)d ^ (uint32_t)s) & 3) == 0) {
+        while (bytes > 0 && ((uint32_t)d & 3)) {
+            *--d = *--s;
+            bytes--;
+        }
+        while (bytes >= 4) {
+            d -= 4;
+            s -= 4;
+            *(uint32_t *)d = *(const uint32_t *)s;
+            bytes -= 4;
+        }
+    }
+    while (bytes-- > 0) {
+        *--d = *--s;
+    }
+}
+
 void bzero(void * dest, int bytes) {
     memset(dest, 0, bytes);
 }
 
+/**
+ * Fills 32 bytes per iteration with stm bursts once the destination is word aligned.
+ */
 void memset(void * dest, uint8_t c, int bytes) {
     uint8_t * d = dest;
-    while (bytes--) {
+    uint32_t pattern = c * 0x01010101;
+    uint32_t blocks;
+
+    // Align the head
+    while (bytes > 0 && ((uint32_t)d & 3)) {
+        *d++ = c;
+        bytes--;
+    }
+
+    blocks = bytes >> 5;
+    if (blocks) {
+        __asm__ __volatile__(
+            "mov r3, %[v]\n\t"
+            "mov r4, %[v]\n\t"
+            "mov r5, %[v]\n\t"
+            "mov r6, %[v]\n"
+            "1:\n\t"
+            "stmia %[d]!, {r3-r6}\n\t"
+            "stmia %[d]!, {r3-r6}\n\t"
+            "subs %[n], %[n], #1\n\t"
+            "bne 1b"
+            : [d] "+r" (d), [n] "+r" (blocks)
+            : [v] "r" (pattern)
+            : "r3", "r4", "r5", "r6", "cc", "memory");
+        bytes &= 31;
+    }
+
+    while (bytes >= 4) {
+        *(uint32_t *)d = pattern;
+        d += 4;
+        bytes -= 4;
+    }
+
+    while (bytes-- > 0) {
         *d++ = c;
     }
 }
@@ -170,31 +361,303 @@ uint32_t ob_puts(char ** ob, uint32_t obCur, char * str) {
     return obCur;
 }
 
-char * sprintf(const char * fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
+/**
+ * Formatter state for vsnprintf: counts every character, but only stores what fits
+ */
+#define FMT_LEFT    1
+#define FMT_ZERO    2
+#define FMT_ALT     4
+#define FMT_PLUS    8
+#define FMT_SPACE   16
+#define FMT_UPPER   32
+
+typedef struct fmt_out {
+    char * buf;
+    uint32_t size;
+    uint32_t len;
+} fmt_out_t;
+
+static void fmt_write(fmt_out_t * out, const char * str, uint32_t len) {
+    uint32_t room = out->len + 1 < out->size ? out->size - 1 - out->len : 0;
+    memcpy(out->buf + out->len, str, MIN(len, room));
+    out->len += len;
+}
+
+static void fmt_pad(fmt_out_t * out, char c, int count) {
+    for (; count > 0; count--) {
+        if (out->len + 1 < out->size)
+            out->buf[out->len] = c;
+        out->len++;
+    }
+}
+
+/**
+ * Writes the digits of value backwards, ending right before end
+ * @return Number of digits written
+ */
+static uint32_t fmt_digits(char * end, uint64_t value, uint32_t base, int upper) {
+    const char * digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char * pos = end;
+    uint32_t value32, quot;
+    divmod64_t dm;
+
+    // Only the upper digits of 64 bit values take the slow path
+    while (value >> 32) {
+        if (base == 10) {
+            dm = divmod64(value, 10);
+            *--pos = digits[dm.mod];
+            value = dm.div;
+        } else if (base == 16) {
+            *--pos = digits[value & 0xf];
+            value >>= 4;
+        } else {
+            *--pos = digits[value & 0x7];
+            value >>= 3;
+        }
+    }
+
+    value32 = (uint32_t)value;
+    do {
+        if (base == 10) {
+            quot = div10(value32);
+            *--pos = digits[value32 - quot * 10];
+            value32 = quot;
+        } else if (base == 16) {
+            *--pos = digits[value32 & 0xf];
+            value32 >>= 4;
+        } else {
+            *--pos = digits[value32 & 0x7];
+            value32 >>= 3;
+        }
+    } while (value32 != 0);
+
+    return end - pos;
+}
+
+static void fmt_number(fmt_out_t * out, uint64_t value, int negative, uint32_t base, int flags, int width, int precision) {
+    char digits[24];
+    char prefix[2];
+    int ndigits = 0, nprefix = 0, zeros, pad;
+
+    // An explicit precision of 0 prints nothing for 0
+    if (value != 0 || precision != 0)
+        ndigits = fmt_digits(digits + sizeof(digits), value, base, flags & FMT_UPPER);
+
+    if (negative)
+        prefix[nprefix++] = '-';
+    else if (flags & FMT_PLUS)
+        prefix[nprefix++] = '+';
+    else if (flags & FMT_SPACE)
+        prefix[nprefix++] = ' ';
+
+    if ((flags & FMT_ALT) && value != 0) {
+        if (base == 16) {
+            prefix[nprefix++] = '0';
+            prefix[nprefix++] = flags & FMT_UPPER ? 'X' : 'x';
+        } else if (base == 8 && precision <= ndigits) {
+            precision = ndigits + 1;
+        }
+    }
+
+    zeros = precision > ndigits ? precision - ndigits : 0;
+    if (precision < 0 && (flags & FMT_ZERO) && !(flags & FMT_LEFT))
+        zeros = width - nprefix - ndigits;
+    if (zeros < 0)
+        zeros = 0;
+    pad = width - nprefix - zeros - ndigits;
+
+    if (!(flags & FMT_LEFT))
+        fmt_pad(out, ' ', pad);
+    fmt_write(out, prefix, nprefix);
+    fmt_pad(out, '0', zeros);
+    fmt_write(out, digits + sizeof(digits) - ndigits, ndigits);
+    if (flags & FMT_LEFT)
+        fmt_pad(out, ' ', pad);
+}
+
+/**
+ * Renders a format string into a buffer in a single pass
+ * @param buf The output buffer, always null terminated if size is not 0
+ * @param size Size of the output buffer
+ * @param fmt Supports %d %i %u %x %X %o %p %c %s %% with the flags - 0 # + space,
+ *        width, precision (also as *) and the length modifiers h, l, ll and z
+ * @param args values to be rendered
+ * @return Length of the complete output, which was truncated if it is size or more
+ */
+int vsnprintf(char * buf, uint32_t size, const char * fmt, va_list args) {
+    fmt_out_t out = {buf, size, 0};
+    const char * literal, * str;
+    int flags, width, precision, longs, len;
+    uint64_t value;
+    int64_t svalue;
+    char c;
+
+    while (*fmt != '\0') {
+        // Copy the text up to the next conversion in one go
+        for (literal = fmt; *fmt != '\0' && *fmt != '%'; fmt++);
+        if (fmt != literal)
+            fmt_write(&out, literal, fmt - literal);
+        if (*fmt == '\0')
+            break;
+        // Unknown conversions are printed as written, from the %
+        literal = fmt++;
+
+        flags = 0;
+        for (;; fmt++) {
+            if (*fmt == '-')
+                flags |= FMT_LEFT;
+            else if (*fmt == '0')
+                flags |= FMT_ZERO;
+            else if (*fmt == '#')
+                flags |= FMT_ALT;
+            else if (*fmt == '+')
+                flags |= FMT_PLUS;
+            else if (*fmt == ' ')
+                flags |= FMT_SPACE;
+            else
+                break;
+        }
+
+        width = 0;
+        if (*fmt == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                flags |= FMT_LEFT;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+                width = width * 10 + (*fmt - '0');
+        }
 
-    char * out = "";
-
-    for (; *fmt != '\0'; fmt++) {
-        if (*fmt == '%') {
-            switch (*(++fmt)) {
-                case '%':
-                    strcat(out, "%");
-                    break;
-                case 'd':
-                    strcat(out, itoa(va_arg(args, int), 10));
-                    break;
-                case 'x':
-                    strcat(out, itoa(va_arg(args, int), 16));
-                    break;
-                case 's':
-                    strcat(out, va_arg(args, char *));
-                    break;
+        precision = -1;
+        if (*fmt == '.') {
+            fmt++;
+            precision = 0;
+            if (*fmt == '*') {
+                precision = va_arg(args, int);
+                fmt++;
+            } else {
+                for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+                    precision = precision * 10 + (*fmt - '0');
             }
-        } else strncat(out, fmt, 1);
+        }
+
+        // long and size_t are 32 bits wide, only ll changes the argument size
+        longs = 0;
+        for (; *fmt == 'l' || *fmt == 'h' || *fmt == 'z'; fmt++) {
+            if (*fmt == 'l')
+                longs++;
+        }
+
+        switch (c = *fmt) {
+            case 'd':
+            case 'i':
+                svalue = longs >= 2 ? va_arg(args, int64_t) : va_arg(args, int32_t);
+                value = svalue < 0 ? 0 - (uint64_t)svalue : (uint64_t)svalue;
+                fmt_number(&out, value, svalue < 0, 10, flags, width, precision);
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                value = longs >= 2 ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+                if (c == 'X')
+                    flags |= FMT_UPPER;
+                fmt_number(&out, value, 0, c == 'u' ? 10 : (c == 'o' ? 8 : 16), flags & ~(FMT_PLUS | FMT_SPACE), width, precision);
+                break;
+            case 'p':
+                value = (uint32_t)va_arg(args, void *);
+                fmt_number(&out, value, 0, 16, (flags | FMT_ALT) & ~(FMT_PLUS | FMT_SPACE), width, precision);
+                break;
+            case 'c':
+                c = (char)va_arg(args, int);
+                if (!(flags & FMT_LEFT))
+                    fmt_pad(&out, ' ', width - 1);
+                fmt_write(&out, &c, 1);
+                if (flags & FMT_LEFT)
+                    fmt_pad(&out, ' ', width - 1);
+                break;
+            case 's':
+                str = va_arg(args, const char *);
+                if (str == 0)
+                    str = "(null)";
+                for (len = 0; str[len] != '\0' && (precision < 0 || len < precision); len++);
+                if (!(flags & FMT_LEFT))
+                    fmt_pad(&out, ' ', width - len);
+                fmt_write(&out, str, len);
+                if (flags & FMT_LEFT)
+                    fmt_pad(&out, ' ', width - len);
+                break;
+            case '%':
+                fmt_write(&out, "%", 1);
+                break;
+            case '\0':
+                // An unfinished conversion at the end of the string is printed as is
+                fmt_write(&out, literal, fmt - literal);
+                fmt--;
+                break;
+            default:
+                fmt_write(&out, literal, fmt + 1 - literal);
+                break;
+        }
+        fmt++;
+    }
+
+    if (size != 0)
+        buf[MIN(out.len, size - 1)] = '\0';
+    return out.len;
+}
+
+/**
+ * Renders a format string and passes the result to sink in one piece. Output longer than PRINTF_BUFFER_SIZE
+ * is rendered again into a buffer of the right size, or passed on truncated if that cannot be allocated
+ * @return The number of characters passed to sink
+ */
+int vprintf_to(printf_sink_f sink, const char * fmt, va_list args) {
+    char buf[PRINTF_BUFFER_SIZE];
+    char * out = buf;
+    va_list retry;
+    int len;
+
+    va_copy(retry, args);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    if (len >= (int)sizeof(buf)) {
+        out = kmalloc(len + 1);
+        if (out != 0) {
+            vsnprintf(out, len + 1, fmt, retry);
+        } else {
+            out = buf;
+            len = sizeof(buf) - 1;
+        }
     }
+    va_end(retry);
+
+    sink(out, len);
+    if (out != buf)
+        kfree(out);
+    return len;
+}
 
+int snprintf(char * buf, uint32_t size, const char * fmt, ...) {
+    va_list args;
+    int len;
+    va_start(args, fmt);
+    len = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return len;
+}
+
+/**
+ * Renders a format string into a static buffer, see vsnprintf
+ * @return The rendered string, valid until the next call
+ */
+char * sprintf(const char * fmt, ...) {
+    static char out[SPRINTF_BUFFER_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(out, sizeof(out), fmt, args);
     va_end(args);
     return out;
 }
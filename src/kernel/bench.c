@@ -0,0 +1,906 @@
+#include <kernel/bench.h>
+#include <kernel/mem.h>
+#include <kernel/mmu.h>
+#include <kernel/timer.h>
+#include <kernel/uart.h>
+#include <kernel/process.h>
+#include <kernel/pmu.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/atomic.h>
+#include <kernel/msgqueue.h>
+#include <kernel/sync.h>
+#include <kernel/workqueue.h>
+#include <kernel/interrupts.h>
+#include <kernel/peripheral.h>
+#include <kernel/block.h>
+#include <kernel/emmc.h>
+#include <kernel/latency.h>
+#include <common/stdlib.h>
+#include <stdarg.h>
+
+/**
+ * Simulates the allocation pattern of walking a FAT directory tree:
+ * For every cluster a sector sized FAT buffer and a cluster buffer are allocated, and for each
+ * directory entry in the cluster a dirent plus its 8.3 name, which are freed after the walk.
+ */
+#define BENCH_KMALLOC_CLUSTERS 64
+#define BENCH_KMALLOC_ENTRIES 32
+#define BENCH_KMALLOC_CLUSTER_SIZE 4096
+#define BENCH_KMALLOC_DIRENT_SIZE 24
+
+void bench_kmalloc(void) {
+    void * dirents[BENCH_KMALLOC_ENTRIES];
+    void * names[BENCH_KMALLOC_ENTRIES];
+    void * fat_buf, * cluster_buf;
+    uint32_t cluster, entry, ops = 0;
+    useconds_t start, elapsed;
+
+    start = uuptime();
+    for (cluster = 0; cluster < BENCH_KMALLOC_CLUSTERS; cluster++) {
+        fat_buf = kmalloc(512);
+        cluster_buf = kmalloc(BENCH_KMALLOC_CLUSTER_SIZE);
+        for (entry = 0; entry < BENCH_KMALLOC_ENTRIES; entry++) {
+            dirents[entry] = kmalloc(BENCH_KMALLOC_DIRENT_SIZE);
+            names[entry] = kmalloc(13);
+        }
+        kfree(cluster_buf);
+        kfree(fat_buf);
+        for (entry = 0; entry < BENCH_KMALLOC_ENTRIES; entry++) {
+            kfree(names[entry]);
+            kfree(dirents[entry]);
+        }
+        ops += 2 + 2 * BENCH_KMALLOC_ENTRIES;
+    }
+    elapsed = uuptime() - start;
+
+    uart_printf("bench_kmalloc: %d alloc/free pairs in %dus (%d ns per pair)\n", ops, elapsed, div(elapsed * 1000, ops));
+}
+
+/**
+ * Runs a fixed memcpy and compute loop once with caches disabled and once with them enabled.
+ */
+#define BENCH_CACHES_COPY_ORDER 4
+#define BENCH_CACHES_ROUNDS 8
+
+static useconds_t bench_caches_run(uint8_t * buf, uint32_t len) {
+    volatile uint32_t acc = 0;
+    uint32_t round, i;
+    useconds_t start = uuptime();
+
+    for (round = 0; round < BENCH_CACHES_ROUNDS; round++) {
+        memcpy(buf + len / 2, buf, len / 2);
+        for (i = 0; i < 100000; i++)
+            acc = acc * 31 + i;
+    }
+    return uuptime() - start;
+}
+
+void bench_caches(void) {
+    uint32_t len = PAGE_SIZE << BENCH_CACHES_COPY_ORDER;
+    uint8_t * buf = alloc_pages(BENCH_CACHES_COPY_ORDER);
+    useconds_t uncached, cached;
+
+    if (buf == NULL) {
+        uart_puts("bench_caches: out of memory\n");
+        return;
+    }
+
+    caches_disable();
+    uncached = bench_caches_run(buf, len);
+    caches_enable();
+    cached = bench_caches_run(buf, len);
+    free_pages(buf, BENCH_CACHES_COPY_ORDER);
+
+    uart_printf("bench_caches: caches off %dus, caches on %dus\n", uncached, cached);
+}
+
+/**
+ * Reports memcpy and memset throughput for aligned and unaligned buffers from 16 B to 1 MB.
+ * Every size moves roughly the same total amount of data.
+ */
+#define BENCH_MEMCPY_ORDER 8 // 1 MB copies, the buffers are twice that so the unaligned ones fit
+#define BENCH_MEMCPY_TOTAL (4 * 1024 * 1024)
+
+static uint32_t bench_mbps(uint32_t bytes, useconds_t elapsed) {
+    // Bytes per microsecond equals MB/s
+    return elapsed ? div(bytes, elapsed) : 0;
+}
+
+void bench_memcpy(void) {
+    uint8_t * src = alloc_pages(BENCH_MEMCPY_ORDER + 1);
+    uint8_t * dst = alloc_pages(BENCH_MEMCPY_ORDER + 1);
+    uint32_t size, iterations, i, offset;
+    useconds_t start, copy_time, set_time;
+
+    if (src == NULL || dst == NULL) {
+        uart_puts("bench_memcpy: out of memory\n");
+        if (src != NULL)
+            free_pages(src, BENCH_MEMCPY_ORDER + 1);
+        if (dst != NULL)
+            free_pages(dst, BENCH_MEMCPY_ORDER + 1);
+        return;
+    }
+
+    for (offset = 0; offset < 2; offset++) {
+        for (size = 16; size <= PAGE_SIZE << BENCH_MEMCPY_ORDER; size <<= 1) {
+            iterations = div(BENCH_MEMCPY_TOTAL, size);
+
+            start = uuptime();
+            for (i = 0; i < iterations; i++)
+                memcpy(dst, src + offset, size);
+            copy_time = uuptime() - start;
+
+            start = uuptime();
+            for (i = 0; i < iterations; i++)
+                memset(dst + offset, (uint8_t)i, size);
+            set_time = uuptime() - start;
+
+            uart_printf("bench_memcpy: %s %d bytes: memcpy %d MB/s, memset %d MB/s\n", offset ? "unaligned" : "aligned",
+                        size, bench_mbps(iterations * size, copy_time), bench_mbps(iterations * size, set_time));
+        }
+    }
+
+    free_pages(src, BENCH_MEMCPY_ORDER + 1);
+    free_pages(dst, BENCH_MEMCPY_ORDER + 1);
+}
+
+/**
+ * Compares the cost of a division between the original bit-by-bit routine and the current div(),
+ * a precomputed reciprocal and the base 10 fast path.
+ */
+#define BENCH_DIV_ROUNDS 100000
+
+// The shift-subtract loop div() used to be, starting at bit 31 for every call
+static uint32_t __attribute__((noinline)) bench_div_reference(uint32_t dividend, uint32_t divisor) {
+    uint32_t denom = divisor, current = 1, answer = 0;
+
+    if (denom > dividend)
+        return 0;
+    if (denom == dividend)
+        return 1;
+    while (denom <= dividend) {
+        denom <<= 1;
+        current <<= 1;
+    }
+    denom >>= 1;
+    current >>= 1;
+    while (current != 0) {
+        if (dividend >= denom) {
+            dividend -= denom;
+            answer |= current;
+        }
+        current >>= 1;
+        denom >>= 1;
+    }
+    return answer;
+}
+
+static void bench_div_report(const char * name, useconds_t elapsed) {
+    uart_printf("bench_div: %s %d ns per divide\n", name, div(elapsed * 1000, BENCH_DIV_ROUNDS));
+}
+
+void bench_div(void) {
+    volatile uint32_t sink = 0;
+    uint32_t i, divisor = 1000;
+    div_const_t dc;
+    useconds_t start;
+
+    div_const_init(&dc, divisor);
+
+    start = uuptime();
+    for (i = 0; i < BENCH_DIV_ROUNDS; i++)
+        sink += bench_div_reference(i * 7919, divisor);
+    bench_div_report("reference", uuptime() - start);
+
+    start = uuptime();
+    for (i = 0; i < BENCH_DIV_ROUNDS; i++)
+        sink += div(i * 7919, divisor);
+    bench_div_report("div", uuptime() - start);
+
+    start = uuptime();
+    for (i = 0; i < BENCH_DIV_ROUNDS; i++)
+        sink += div_const(i * 7919, &dc);
+    bench_div_report("div_const", uuptime() - start);
+
+    start = uuptime();
+    for (i = 0; i < BENCH_DIV_ROUNDS; i++)
+        sink += div(i * 7919, 512);
+    bench_div_report("power of two", uuptime() - start);
+
+    start = uuptime();
+    for (i = 0; i < BENCH_DIV_ROUNDS; i++)
+        sink += div(i * 7919, 10);
+    bench_div_report("base 10", uuptime() - start);
+}
+
+/**
+ * Compares characters per second for rendering a typical log line the old way, one sink call per
+ * character through itoa, against vsnprintf rendering into a buffer that is handed over in one call.
+ * Both write to a sink that only counts, so the UART wire time is not part of the result.
+ */
+#define BENCH_PRINTF_ROUNDS 2000
+
+static volatile uint32_t bench_printf_sunk;
+
+static void __attribute__((noinline)) bench_printf_sink_c(char c) {
+    bench_printf_sunk += c;
+}
+
+static void __attribute__((noinline)) bench_printf_sink_buf(const char * buf, uint32_t len) {
+    bench_printf_sunk += buf[0] + len;
+}
+
+// The character at a time formatter uart_printf used to be
+static uint32_t bench_printf_reference(const char * fmt, ...) {
+    va_list args;
+    const char * str;
+    uint32_t len = 0;
+    va_start(args, fmt);
+
+    for (; *fmt != '\0'; fmt++) {
+        if (*fmt == '%') {
+            switch (*(++fmt)) {
+                case '%':
+                    bench_printf_sink_c('%');
+                    len++;
+                    break;
+                case 'd':
+                case 'x':
+                case 's':
+                    if (*fmt == 's')
+                        str = va_arg(args, char *);
+                    else
+                        str = itoa(va_arg(args, int), *fmt == 'd' ? 10 : 16);
+                    for (; *str != '\0'; str++, len++)
+                        bench_printf_sink_c(*str);
+                    break;
+            }
+        } else {
+            bench_printf_sink_c(*fmt);
+            len++;
+        }
+    }
+
+    va_end(args);
+    return len;
+}
+
+static uint32_t bench_printf_buffered(const char * fmt, ...) {
+    va_list args;
+    int len;
+    va_start(args, fmt);
+    len = vprintf_to(bench_printf_sink_buf, fmt, args);
+    va_end(args);
+    return len;
+}
+
+static void bench_printf_report(const char * name, uint32_t chars, useconds_t elapsed) {
+    uart_printf("bench_printf: %s %u chars in %uus, %u chars/s\n", name, chars, elapsed,
+            (uint32_t)divmod64((uint64_t)chars * 1000000, elapsed ? elapsed : 1).div);
+}
+
+void bench_printf(void) {
+    uint32_t i, chars;
+    useconds_t start;
+
+    chars = 0;
+    start = uuptime();
+    for (i = 0; i < BENCH_PRINTF_ROUNDS; i++)
+        chars += bench_printf_reference("FAT: reading cluster %d (sector %d) of %s at %x\n", i, i * 8 + 2048, "KERNEL.IMG", i << 12);
+    bench_printf_report("per character", chars, uuptime() - start);
+
+    chars = 0;
+    start = uuptime();
+    for (i = 0; i < BENCH_PRINTF_ROUNDS; i++)
+        chars += bench_printf_buffered("FAT: reading cluster %d (sector %d) of %s at %#x\n", i, i * 8 + 2048, "KERNEL.IMG", i << 12);
+    bench_printf_report("buffered", chars, uuptime() - start);
+}
+
+/**
+ * Measures the time from wake_thread until a high priority thread runs, while threads of the caller's
+ * priority keep the CPU busy. The high priority thread blocks, the caller wakes it and it takes the
+ * cycle counter as soon as it is back on the CPU.
+ */
+#define BENCH_LATENCY_ROUNDS 1000
+#define BENCH_LATENCY_LOAD_THREADS 2
+
+static volatile int bench_latency_running;
+static volatile uint32_t bench_latency_woken_at;
+static latency_stats_t bench_latency;
+
+static void bench_latency_waiter(void) {
+    while (1) {
+        block_current_thread();
+        if (!bench_latency_running)
+            return;
+        latency_record(&bench_latency, pmu_cycles() - bench_latency_woken_at);
+    }
+}
+
+static void bench_latency_load(void) {
+    volatile uint32_t spin = 0;
+    while (bench_latency_running)
+        spin++;
+}
+
+void bench_sched_latency(void) {
+    process_control_block_t * waiter;
+    uint32_t i;
+
+    bench_latency_running = 1;
+    latency_init(&bench_latency);
+
+    for (i = 0; i < BENCH_LATENCY_LOAD_THREADS; i++)
+        create_kernel_thread(bench_latency_load, "LOAD", 4, current_process->priority);
+    // Runs right away up to its first block_current_thread
+    waiter = create_kernel_thread(bench_latency_waiter, "WAITER", 6, PRIORITY_HIGHEST);
+
+    for (i = 0; i < BENCH_LATENCY_ROUNDS; i++) {
+        // Let the load threads have the CPU every now and then
+        if ((i & 0xf) == 0)
+            schedule();
+        bench_latency_woken_at = pmu_cycles();
+        wake_thread(waiter);
+    }
+
+    bench_latency_running = 0;
+    wake_thread(waiter);
+
+    uart_printf("bench_sched_latency: %u wakeups, min %u avg %u max %u cycles\n", bench_latency.count,
+            bench_latency.min, latency_avg(&bench_latency), bench_latency.max);
+}
+
+/**
+ * Several threads of the same priority increment shared counters while the scheduler preempts them.
+ * The counters guarded by a mutex, a spin lock and atomic_fetch_add must come out exact, the unguarded
+ * one shows how many updates the interleaving loses without protection.
+ */
+#define BENCH_STRESS_THREADS 4
+#define BENCH_STRESS_ROUNDS 100000
+
+static mutex_t bench_stress_mutex;
+static spin_lock_t bench_stress_spin;
+static volatile uint32_t bench_stress_plain, bench_stress_mutexed, bench_stress_spinned, bench_stress_atomic;
+static volatile uint32_t bench_stress_done;
+
+static void bench_stress_worker(void) {
+    uint32_t i;
+    for (i = 0; i < BENCH_STRESS_ROUNDS; i++) {
+        bench_stress_plain++;
+
+        mutex_lock(&bench_stress_mutex);
+        bench_stress_mutexed++;
+        mutex_unlock(&bench_stress_mutex);
+
+        spin_lock(&bench_stress_spin);
+        bench_stress_spinned++;
+        spin_unlock(&bench_stress_spin);
+
+        atomic_fetch_add(&bench_stress_atomic, 1);
+    }
+    atomic_fetch_add(&bench_stress_done, 1);
+}
+
+void bench_lock_stress(void) {
+    uint32_t i, expected = BENCH_STRESS_THREADS * BENCH_STRESS_ROUNDS, start;
+
+    mutex_init(&bench_stress_mutex);
+    spin_init(&bench_stress_spin);
+    bench_stress_plain = bench_stress_mutexed = bench_stress_spinned = bench_stress_atomic = 0;
+    bench_stress_done = 0;
+
+    start = uuptime();
+    for (i = 0; i < BENCH_STRESS_THREADS; i++)
+        create_kernel_thread(bench_stress_worker, "STRESS", 6, current_process->priority);
+    while (atomic_load(&bench_stress_done) < BENCH_STRESS_THREADS)
+        ksleep_us(10000);
+
+    uart_printf("bench_lock_stress: %u threads x %u increments in %u us, lost updates: mutex %u spin %u atomic %u "
+            "(unguarded %u) %s\n", BENCH_STRESS_THREADS, BENCH_STRESS_ROUNDS, uuptime() - start,
+            expected - bench_stress_mutexed, expected - bench_stress_spinned, expected - bench_stress_atomic,
+            expected - bench_stress_plain,
+            bench_stress_mutexed == expected && bench_stress_spinned == expected && bench_stress_atomic == expected ?
+            "PASS" : "FAIL");
+}
+
+/**
+ * Checks the primitives of sync.h and times a wakeup through them: producers hand numbered items to the
+ * calling thread through a ring guarded by two semaphores, a condition variable passes a turn back and forth
+ * between two threads, and the producers report completion with event flags. Timeouts and the non blocking
+ * variants are checked on the way.
+ */
+#define BENCH_SYNC_PRODUCERS 3
+#define BENCH_SYNC_ITEMS 10000      // Per producer
+#define BENCH_SYNC_SLOTS 8
+#define BENCH_SYNC_ROUNDS 10000
+#define BENCH_SYNC_TIMEOUT 2000
+#define BENCH_SYNC_ALL_DONE ((1 << BENCH_SYNC_PRODUCERS) - 1)
+
+static semaphore_t bench_sync_free, bench_sync_used;
+static mutex_t bench_sync_mutex;
+static cond_t bench_sync_cond;
+static event_flags_t bench_sync_events;
+static uint32_t bench_sync_ring[BENCH_SYNC_SLOTS], bench_sync_head;
+static volatile uint32_t bench_sync_producer_id, bench_sync_turn;
+
+static void bench_sync_producer(void) {
+    uint32_t id = atomic_fetch_add(&bench_sync_producer_id, 1), i;
+
+    for (i = 1; i <= BENCH_SYNC_ITEMS; i++) {
+        sem_wait(&bench_sync_free);
+        mutex_lock(&bench_sync_mutex);
+        bench_sync_ring[bench_sync_head] = i;
+        bench_sync_head = (bench_sync_head + 1) & (BENCH_SYNC_SLOTS - 1);
+        mutex_unlock(&bench_sync_mutex);
+        sem_post(&bench_sync_used);
+    }
+    event_set(&bench_sync_events, 1 << id);
+}
+
+static void bench_sync_partner(void) {
+    uint32_t i;
+
+    mutex_lock(&bench_sync_mutex);
+    for (i = 0; i < BENCH_SYNC_ROUNDS; i++) {
+        while (!bench_sync_turn)
+            cond_wait(&bench_sync_cond, &bench_sync_mutex);
+        bench_sync_turn = 0;
+        cond_signal(&bench_sync_cond);
+    }
+    mutex_unlock(&bench_sync_mutex);
+}
+
+void bench_sync(void) {
+    uint32_t i, tail = 0, sum = 0, expected, start, sem_time, cond_cycles, failures = 0;
+
+    sem_init(&bench_sync_free, BENCH_SYNC_SLOTS);
+    sem_init(&bench_sync_used, 0);
+    mutex_init(&bench_sync_mutex);
+    cond_init(&bench_sync_cond);
+    event_init(&bench_sync_events);
+    bench_sync_head = 0;
+    bench_sync_producer_id = 0;
+    bench_sync_turn = 0;
+
+    // Every item reaches the consumer exactly once
+    start = uuptime();
+    for (i = 0; i < BENCH_SYNC_PRODUCERS; i++)
+        create_kernel_thread(bench_sync_producer, "PRODUCER", 8, current_process->priority);
+    for (i = 0; i < BENCH_SYNC_PRODUCERS * BENCH_SYNC_ITEMS; i++) {
+        sem_wait(&bench_sync_used);
+        sum += bench_sync_ring[tail];
+        tail = (tail + 1) & (BENCH_SYNC_SLOTS - 1);
+        sem_post(&bench_sync_free);
+    }
+    sem_time = uuptime() - start;
+    expected = BENCH_SYNC_PRODUCERS * (BENCH_SYNC_ITEMS * (BENCH_SYNC_ITEMS + 1) / 2);
+    if (sum != expected || sem_try_wait(&bench_sync_used) || sem_wait_timeout(&bench_sync_used, BENCH_SYNC_TIMEOUT))
+        failures |= 1;
+
+    // All producers report, the flags are consumed, nothing else is set and a mask of 0 does not block
+    if (event_wait(&bench_sync_events, BENCH_SYNC_ALL_DONE, EVENT_WAIT_ALL | EVENT_CLEAR, WAIT_FOREVER) != BENCH_SYNC_ALL_DONE ||
+            event_wait(&bench_sync_events, BENCH_SYNC_ALL_DONE, EVENT_WAIT_ANY, 0) != 0 ||
+            event_wait(&bench_sync_events, 0, EVENT_WAIT_ALL, WAIT_FOREVER) != 0)
+        failures |= 2;
+    start = uuptime();
+    if (event_wait(&bench_sync_events, 1u << 31, EVENT_WAIT_ANY, BENCH_SYNC_TIMEOUT) != 0 ||
+            uuptime() - start < BENCH_SYNC_TIMEOUT)
+        failures |= 2;
+
+    // Every round is a signal and a wakeup in each direction
+    create_kernel_thread(bench_sync_partner, "PARTNER", 7, current_process->priority);
+    start = pmu_cycles();
+    mutex_lock(&bench_sync_mutex);
+    for (i = 0; i < BENCH_SYNC_ROUNDS; i++) {
+        bench_sync_turn = 1;
+        cond_signal(&bench_sync_cond);
+        while (bench_sync_turn)
+            cond_wait(&bench_sync_cond, &bench_sync_mutex);
+    }
+    cond_cycles = pmu_cycles() - start;
+    // Nobody signals any more, the wait times out with the mutex held again
+    if (cond_wait_timeout(&bench_sync_cond, &bench_sync_mutex, BENCH_SYNC_TIMEOUT) != 0 ||
+            bench_sync_mutex.owner != current_process)
+        failures |= 4;
+    mutex_unlock(&bench_sync_mutex);
+
+    uart_printf("bench_sync: %u items through semaphores in %u us, condvar round trip %u cycles, "
+            "failures: semaphore %u event %u condvar %u %s\n", BENCH_SYNC_PRODUCERS * BENCH_SYNC_ITEMS, sem_time,
+            div(cond_cycles, BENCH_SYNC_ROUNDS), failures & 1, (failures >> 1) & 1, (failures >> 2) & 1,
+            failures ? "FAIL" : "PASS");
+}
+
+/**
+ * Cost of passing messages through a msgqueue_t: a send and receive within one thread, then a producer
+ * thread feeding the blocked caller so every message costs a wakeup and two context switches
+ */
+#define BENCH_MSGQ_MESSAGES 10000
+#define BENCH_MSGQ_CAPACITY 64
+
+typedef struct {
+    uint32_t seq;
+    uint32_t timestamp;
+} bench_msg_t;
+
+static msgqueue_t bench_msgq;
+
+static void bench_msgq_producer(void) {
+    bench_msg_t msg;
+    for (msg.seq = 0; msg.seq < BENCH_MSGQ_MESSAGES; msg.seq++) {
+        msg.timestamp = pmu_cycles();
+        while (msgq_send(&bench_msgq, &msg) != 0)
+            schedule();
+    }
+}
+
+void bench_msgqueue(void) {
+    bench_msg_t msg, * slot;
+    uint32_t i, start, local_cycles, errors = 0;
+    latency_stats_t latency = LATENCY_STATS_INIT;
+
+    if (msgq_init(&bench_msgq, sizeof(bench_msg_t), BENCH_MSGQ_CAPACITY) != 0) {
+        uart_puts("bench_msgqueue: cannot allocate queue\n");
+        return;
+    }
+
+    start = pmu_cycles();
+    for (i = 0; i < BENCH_MSGQ_MESSAGES; i++) {
+        slot = msgq_reserve(&bench_msgq);
+        slot->seq = i;
+        msgq_commit(&bench_msgq, slot);
+        slot = msgq_receive(&bench_msgq, 0);
+        if (slot == NULL || slot->seq != i)
+            errors++;
+        msgq_release(&bench_msgq);
+    }
+    local_cycles = pmu_cycles() - start;
+
+    // Less important, so it only runs while the receiver is blocked
+    create_kernel_thread(bench_msgq_producer, "MSGQ", 4, MAX(current_process->priority, PRIORITY_LOWEST + 1) - 1);
+    start = uuptime();
+    for (i = 0; i < BENCH_MSGQ_MESSAGES; i++) {
+        msgq_recv(&bench_msgq, &msg, WAIT_FOREVER);
+        latency_record(&latency, pmu_cycles() - msg.timestamp);
+        if (msg.seq != i)
+            errors++;
+    }
+
+    uart_printf("bench_msgqueue: %u cycles per send+receive, cross thread %u us for %u messages, "
+            "latency avg %u max %u cycles, %u errors\n", div(local_cycles, BENCH_MSGQ_MESSAGES), uuptime() - start,
+            BENCH_MSGQ_MESSAGES, latency_avg(&latency), latency.max, errors);
+    kfree(bench_msgq.slots);
+}
+
+/**
+ * Interrupt to handler latency with and without deferral. System timer channel 3 fires a few hundred
+ * microseconds ahead, its top half acknowledges and takes a cycle stamp. The handler either measures right
+ * away in IRQ context or queues the measurement as work for the work queue threads.
+ */
+#define BENCH_IRQ_ROUNDS 200
+#define BENCH_IRQ_DELAY 200
+
+static volatile uint32_t bench_irq_at;
+static latency_stats_t bench_irq;
+static semaphore_t bench_irq_done;
+
+static void bench_irq_clearer(void) {
+    bench_irq_at = pmu_cycles();
+    mmio_write(SYSTEM_TIMER_BASE + TIMER_CS, 1 << 3);
+}
+
+static void bench_irq_measure(uint32_t irq_at) {
+    latency_record(&bench_irq, pmu_cycles() - irq_at);
+    sem_post(&bench_irq_done);
+}
+
+static void bench_irq_direct(void) {
+    bench_irq_measure(bench_irq_at);
+}
+
+static void bench_irq_deferred(void) {
+    work_queue(bench_irq_measure, bench_irq_at);
+}
+
+static void bench_irq_run(const char * mode, interrupt_handler_f handler) {
+    uint32_t i;
+
+    latency_init(&bench_irq);
+    register_irq_handler(SYSTEM_TIMER_3, handler, bench_irq_clearer);
+    for (i = 0; i < BENCH_IRQ_ROUNDS; i++) {
+        mmio_write(SYSTEM_TIMER_BASE + TIMER_C3, uuptime() + BENCH_IRQ_DELAY);
+        sem_wait_timeout(&bench_irq_done, 10 * BENCH_IRQ_DELAY);
+    }
+    unregister_irq_handler(SYSTEM_TIMER_3);
+
+    uart_printf("bench_irq_latency %s: %u samples, min %u avg %u max %u cycles\n", mode, bench_irq.count, bench_irq.min,
+            latency_avg(&bench_irq), bench_irq.max);
+}
+
+void bench_irq_latency(void) {
+    sem_init(&bench_irq_done, 0);
+    bench_irq_run("direct", bench_irq_direct);
+    bench_irq_run("deferred", bench_irq_deferred);
+}
+
+/**
+ * Random 512 byte reads spread over the first BENCH_IOPS_SPAN blocks of a device, or all of it if it is smaller.
+ * Prints reads per second and the command latency histogram of the SD driver
+ */
+#define BENCH_IOPS_READS 1000
+#define BENCH_IOPS_SPAN (1 << 17)
+
+void bench_block_iops(struct block_device *dev) {
+    uint8_t buf[512];
+    uint32_t i, block, mask = BENCH_IOPS_SPAN - 1, seed = 0x12345678, start, elapsed, errors = 0;
+
+    if (dev == NULL || dev->block_size != sizeof(buf)) {
+        uart_puts("bench_block_iops: needs a device with 512 byte blocks\n");
+        return;
+    }
+    while (dev->num_blocks != 0 && mask >= dev->num_blocks)
+        mask >>= 1;
+
+    sd_latency_reset();
+    start = uuptime();
+    for (i = 0; i < BENCH_IOPS_READS; i++) {
+        // xorshift32, the hardware RNG is too slow to not show up in the numbers
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        block = seed & mask;
+        if (block_transfer(dev, 0, buf, sizeof(buf), block) != sizeof(buf))
+            errors++;
+    }
+    elapsed = uuptime() - start;
+
+    uart_printf("bench_block_iops: %u random reads in %u us, %u IOPS, %u errors\n", BENCH_IOPS_READS, elapsed,
+            (uint32_t)divmod64((uint64_t)BENCH_IOPS_READS * 1000000, elapsed ? elapsed : 1).div, errors);
+    sd_latency_report();
+}
+
+/**
+ * Sequential reads of BENCH_SEQ_CHUNK bytes from the start of a device, through the CPU, through the DMA engine into
+ * one contiguous buffer and scattered over separate pages. Prints the throughput of each
+ */
+#define BENCH_SEQ_BYTES (4 << 20)
+#define BENCH_SEQ_ORDER 4
+#define BENCH_SEQ_PAGES (1 << BENCH_SEQ_ORDER)
+#define BENCH_SEQ_CHUNK (BENCH_SEQ_PAGES * PAGE_SIZE)
+
+static void bench_block_seq_run(const char * name, struct block_device *dev, uint8_t * buf, struct block_sg * sg) {
+    uint32_t offset, block = 0, blocks = div(BENCH_SEQ_CHUNK, dev->block_size), start, elapsed, errors = 0;
+
+    start = uuptime();
+    for (offset = 0; offset < BENCH_SEQ_BYTES; offset += BENCH_SEQ_CHUNK, block += blocks) {
+        if (sg != NULL) {
+            if (block_transfer_sg(dev, sg, BENCH_SEQ_PAGES, block) != BENCH_SEQ_CHUNK)
+                errors++;
+        } else if (block_transfer(dev, 0, buf, BENCH_SEQ_CHUNK, block) != BENCH_SEQ_CHUNK)
+            errors++;
+    }
+    elapsed = uuptime() - start;
+
+    uart_printf("bench_block_seq: %s %u KiB in %u us, %u KiB/s, %u errors\n", name, BENCH_SEQ_BYTES >> 10, elapsed,
+            (uint32_t)divmod64((uint64_t)(BENCH_SEQ_BYTES >> 10) * 1000000, elapsed ? elapsed : 1).div, errors);
+}
+
+void bench_block_seq(struct block_device *dev) {
+    struct block_sg sg[BENCH_SEQ_PAGES];
+    uint8_t * buf;
+    uint32_t i;
+
+    if (dev == NULL || dev->read_sg == NULL || dev->num_blocks < div(BENCH_SEQ_BYTES, dev->block_size)) {
+        uart_puts("bench_block_seq: needs an SD card of at least 4 MiB\n");
+        return;
+    }
+
+    buf = alloc_pages(BENCH_SEQ_ORDER);
+    if (buf == NULL) {
+        uart_puts("bench_block_seq: out of memory\n");
+        return;
+    }
+    for (i = 0; i < BENCH_SEQ_PAGES; i++) {
+        sg[i].buf = alloc_page_nozero();
+        sg[i].len = PAGE_SIZE;
+        if (sg[i].buf == NULL) {
+            uart_puts("bench_block_seq: out of memory\n");
+            while (i-- > 0)
+                free_page(sg[i].buf);
+            free_pages(buf, BENCH_SEQ_ORDER);
+            return;
+        }
+    }
+
+    sd_set_dma(0);
+    bench_block_seq_run("pio", dev, buf, NULL);
+    sd_set_dma(1);
+    bench_block_seq_run("dma", dev, buf, NULL);
+    bench_block_seq_run("dma sg", dev, NULL, sg);
+
+    for (i = 0; i < BENCH_SEQ_PAGES; i++)
+        free_page(sg[i].buf);
+    free_pages(buf, BENCH_SEQ_ORDER);
+}
+
+/**
+ * Reads BENCH_ASYNC_REQUESTS queued 4 KiB requests at once while a thread below the caller's priority counts.
+ * Comparing its count with one over the same time of the caller sleeping shows how much of the transfer time
+ * the CPU was left to other threads
+ */
+#define BENCH_ASYNC_ORDER 3
+#define BENCH_ASYNC_REQUESTS (1 << BENCH_ASYNC_ORDER)
+#define BENCH_ASYNC_ROUNDS 16
+
+static volatile int bench_async_running;
+static volatile uint32_t bench_async_count;
+
+static void bench_async_counter(void) {
+    while (bench_async_running)
+        bench_async_count++;
+}
+
+void bench_block_async(struct block_device *dev) {
+    struct block_request req[BENCH_ASYNC_REQUESTS];
+    uint8_t * buf;
+    uint32_t i, round, start, elapsed, busy_count, errors = 0;
+
+    if (dev == NULL || dev->queue == NULL || current_process->priority == PRIORITY_LOWEST) {
+        uart_puts("bench_block_async: needs a device with a request queue\n");
+        return;
+    }
+    buf = alloc_pages(BENCH_ASYNC_ORDER);
+    if (buf == NULL) {
+        uart_puts("bench_block_async: out of memory\n");
+        return;
+    }
+
+    bench_async_running = 1;
+    bench_async_count = 0;
+    create_kernel_thread(bench_async_counter, "COUNTER", 7, current_process->priority - 1);
+
+    start = uuptime();
+    for (round = 0; round < BENCH_ASYNC_ROUNDS; round++) {
+        for (i = 0; i < BENCH_ASYNC_REQUESTS; i++) {
+            req[i].dev = dev;
+            req[i].is_write = 0;
+            req[i].buf = buf + i * PAGE_SIZE;
+            req[i].buf_size = PAGE_SIZE;
+            req[i].sg = NULL;
+            req[i].block_num = (round * BENCH_ASYNC_REQUESTS + i) * (PAGE_SIZE >> 9);
+            req[i].done = NULL;
+            block_submit(&req[i]);
+        }
+        for (i = 0; i < BENCH_ASYNC_REQUESTS; i++)
+            if (block_wait(&req[i]) < 0)
+                errors++;
+    }
+    elapsed = uuptime() - start;
+    busy_count = bench_async_count;
+
+    // The same time with nothing but the counter running
+    bench_async_count = 0;
+    ksleep_us(elapsed);
+    bench_async_running = 0;
+
+    uart_printf("bench_block_async: %u requests in %u us, %u errors, other threads had %u%% of the CPU\n",
+            BENCH_ASYNC_ROUNDS * BENCH_ASYNC_REQUESTS, elapsed, errors,
+            (uint32_t)divmod64((uint64_t)busy_count * 100, bench_async_count ? bench_async_count : 1).div);
+    free_pages(buf, BENCH_ASYNC_ORDER);
+}
+
+/**
+ * Sequential write throughput in 4 KiB, 64 KiB and 1 MiB writes, and in 4 KiB requests queued all at once so the
+ * request queue merges them. Works on the last MiB of the device and writes back what it read from there,
+ * so the card's contents stay the same
+ */
+#define BENCH_WRITE_ORDER 8
+#define BENCH_WRITE_SPAN (PAGE_SIZE << BENCH_WRITE_ORDER)
+#define BENCH_WRITE_QUEUED 4096
+
+static void bench_block_write_run(struct block_device *dev, uint8_t * buf, uint32_t first, uint32_t chunk) {
+    uint32_t offset, start, elapsed, errors = 0;
+
+    start = uuptime();
+    for (offset = 0; offset < BENCH_WRITE_SPAN; offset += chunk)
+        if (block_transfer(dev, 1, buf + offset, chunk, first + div(offset, dev->block_size)) != chunk)
+            errors++;
+    elapsed = uuptime() - start;
+
+    uart_printf("bench_block_write: %u KiB writes, %u KiB/s, %u errors\n", chunk >> 10,
+            (uint32_t)divmod64((uint64_t)(BENCH_WRITE_SPAN >> 10) * 1000000, elapsed ? elapsed : 1).div, errors);
+}
+
+void bench_block_write(struct block_device *dev) {
+    struct block_request * req;
+    uint8_t * buf;
+    uint32_t first, i, requests = BENCH_WRITE_SPAN / BENCH_WRITE_QUEUED, start, elapsed, merged, errors = 0;
+
+    if (dev == NULL || dev->num_blocks < div(BENCH_WRITE_SPAN, dev->block_size)) {
+        uart_puts("bench_block_write: needs a device of at least 1 MiB\n");
+        return;
+    }
+    buf = alloc_pages(BENCH_WRITE_ORDER);
+    req = kmalloc(requests * sizeof(struct block_request));
+    if (buf == NULL || req == NULL) {
+        uart_puts("bench_block_write: out of memory\n");
+        if (req != NULL)
+            kfree(req);
+        if (buf != NULL)
+            free_pages(buf, BENCH_WRITE_ORDER);
+        return;
+    }
+
+    first = dev->num_blocks - div(BENCH_WRITE_SPAN, dev->block_size);
+    // The cache would hide the device, and must not hold newer data for the test area
+    block_sync(dev);
+    if (block_transfer(dev, 0, buf, BENCH_WRITE_SPAN, first) != BENCH_WRITE_SPAN) {
+        uart_puts("bench_block_write: cannot read the test area\n");
+        kfree(req);
+        free_pages(buf, BENCH_WRITE_ORDER);
+        return;
+    }
+
+    bench_block_write_run(dev, buf, first, 4 << 10);
+    bench_block_write_run(dev, buf, first, 64 << 10);
+    bench_block_write_run(dev, buf, first, 1 << 20);
+
+    if (dev->queue != NULL) {
+        merged = dev->queue->merged;
+        start = uuptime();
+        for (i = 0; i < requests; i++) {
+            req[i].dev = dev;
+            req[i].is_write = 1;
+            req[i].buf = buf + i * BENCH_WRITE_QUEUED;
+            req[i].buf_size = BENCH_WRITE_QUEUED;
+            req[i].sg = NULL;
+            req[i].block_num = first + div(i * BENCH_WRITE_QUEUED, dev->block_size);
+            req[i].done = NULL;
+            block_submit(&req[i]);
+        }
+        for (i = 0; i < requests; i++)
+            if (block_wait(&req[i]) != BENCH_WRITE_QUEUED)
+                errors++;
+        elapsed = uuptime() - start;
+        uart_printf("bench_block_write: 4 KiB queued, %u KiB/s, %u of %u requests merged, %u errors\n",
+                (uint32_t)divmod64((uint64_t)(BENCH_WRITE_SPAN >> 10) * 1000000, elapsed ? elapsed : 1).div,
+                dev->queue->merged - merged, requests, errors);
+    }
+
+    kfree(req);
+    free_pages(buf, BENCH_WRITE_ORDER);
+}
+
+/**
+ * Random 512 byte block_reads over working sets half and twice the size of the block cache.
+ * Prints the time per read and the cache counters of each run
+ */
+#define BENCH_CACHE_READS 2000
+
+void bench_block_cache(struct block_device *dev) {
+    uint8_t buf[512];
+    block_cache_stats_t before, after;
+    uint32_t set, i, seed = 0x9e3779b9, start, elapsed;
+
+    if (dev == NULL || dev->cache == NULL || dev->block_size != sizeof(buf)) {
+        uart_puts("bench_block_cache: needs a device with 512 byte blocks and a cache\n");
+        return;
+    }
+
+    for (set = dev->cache->count >> 1; set <= dev->cache->count << 1; set <<= 2) {
+        block_cache_stats(dev, &before);
+        start = uuptime();
+        for (i = 0; i < BENCH_CACHE_READS; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            block_read(dev, buf, sizeof(buf), divmod(seed, set).mod);
+        }
+        elapsed = uuptime() - start;
+        block_cache_stats(dev, &after);
+
+        uart_printf("bench_block_cache: %u block working set, %u us per read, %u hits, %u misses, %u evictions\n",
+                set, div(elapsed, BENCH_CACHE_READS), after.hits - before.hits, after.misses - before.misses,
+                after.evictions - before.evictions);
+    }
+}
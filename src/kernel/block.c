@@ -21,6 +21,10 @@
 
 #include <stdint.h>
 #include <kernel/block.h>
+#include <kernel/prof.h>
+#include <kernel/process.h>
+#include <kernel/interrupts.h>
+#include <kernel/mem.h>
 #include <common/stdlib.h>
 #ifdef BLOCK_DEBUG
 #include <kernel/uart.h>
@@ -28,7 +32,9 @@
 
 #define MAX_TRIES		1
 
-size_t block_read(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
+PROF_DEFINE(block_read_probe, "block_read");
+
+static size_t block_read_blocks(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
     // Read the required number of blocks to satisfy the request
     int buf_offset = 0;
     uint32_t block_offset = 0;
@@ -42,7 +48,8 @@ size_t block_read(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uin
         uart_printf("block_read: performing multi block read (%i blocks) from block %i on %s\n",
 			div(buf_size, dev->block_size), starting_block, dev->device_name);
 #endif
-        return dev->read(dev, buf, buf_size, starting_block);
+        int ret = dev->read(dev, buf, buf_size, starting_block);
+        return ret == 0 ? (size_t)buf_size : (size_t)(ret < 0 ? ret : -ret);
     }
 
     do {
@@ -79,7 +86,7 @@ size_t block_read(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uin
     return (size_t)buf_offset;
 }
 
-size_t block_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
+static size_t block_write_blocks(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
     // Write the required number of blocks to satisfy the request
     int buf_offset = 0;
     uint32_t block_offset = 0;
@@ -87,6 +94,16 @@ size_t block_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, ui
     if(!dev->write)
         return 0;
 
+    // Perform a multi-block write if the device supports it
+    if(dev->supports_multiple_block_write && (div(buf_size, dev->block_size) > 1)) {
+#ifdef BLOCK_DEBUG
+        uart_printf("block_write: performing multi block write (%i blocks) to block %i on %s\n",
+			div(buf_size, dev->block_size), starting_block, dev->device_name);
+#endif
+        int ret = dev->write(dev, buf, buf_size, starting_block);
+        return ret == 0 ? (size_t)buf_size : (size_t)(ret < 0 ? ret : -ret);
+    }
+
     do {
         size_t to_write = buf_size;
         if(to_write > dev->block_size)
@@ -120,4 +137,241 @@ size_t block_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, ui
     } while(buf_size > 0);
 
     return (size_t)buf_offset;
-}
\ No newline at end of file
+}
+
+static size_t block_read_sg_blocks(struct block_device *dev, const struct block_sg *sg, uint32_t entries,
+        uint64_t buf_size, uint32_t starting_block) {
+    if(!dev->read_sg)
+        return 0;
+
+    int ret = dev->read_sg(dev, sg, entries, starting_block);
+    return ret == 0 ? (size_t)buf_size : (size_t)(ret < 0 ? ret : -ret);
+}
+
+static void block_perform(struct block_request *req) {
+    if(req->sg != NULL)
+        req->result = (int)block_read_sg_blocks(req->dev, req->sg, req->sg_entries, req->buf_size, req->block_num);
+    else if(req->is_write)
+        req->result = (int)block_write_blocks(req->dev, req->buf, req->buf_size, req->block_num);
+    else
+        req->result = (int)block_read_blocks(req->dev, req->buf, req->buf_size, req->block_num);
+}
+
+static void block_complete(struct block_request *req) {
+    if(req->done != NULL)
+        req->done(req);
+    else
+        sem_post(&req->complete);
+}
+
+static void block_execute(struct block_request *req) {
+    block_perform(req);
+    block_complete(req);
+}
+
+// Runs a request the caller waits for. The queue thread itself and callers before the scheduler runs do it directly
+static size_t block_run(struct block_request *req) {
+    struct block_queue *q = req->dev->queue;
+
+    req->done = NULL;
+    if(q == NULL || current_process == NULL || current_process == q->thread) {
+        block_perform(req);
+        return (size_t)req->result;
+    }
+    block_submit(req);
+    return (size_t)block_wait(req);
+}
+
+/**
+ * Reads or writes the device without the cache. Queued requests go through the queue thread,
+ * the caller sleeps until it is done
+ */
+size_t block_transfer(struct block_device *dev, int is_write, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
+    struct block_request req;
+
+    req.dev = dev;
+    req.is_write = is_write;
+    req.buf = buf;
+    req.buf_size = buf_size;
+    req.sg = NULL;
+    req.block_num = starting_block;
+    return block_run(&req);
+}
+
+/**
+ * Reads consecutive blocks into several buffers with the device's read_sg, without the cache and through the
+ * queue like block_transfer
+ * @return The sum of the lengths on success, otherwise a negative error or 0 if the device has no read_sg
+ */
+size_t block_transfer_sg(struct block_device *dev, const struct block_sg *sg, uint32_t entries, uint32_t starting_block) {
+    struct block_request req;
+    uint32_t i;
+
+    req.dev = dev;
+    req.is_write = 0;
+    req.buf = NULL;
+    req.buf_size = 0;
+    for(i = 0; i < entries; i++)
+        req.buf_size += sg[i].len;
+    req.sg = sg;
+    req.sg_entries = entries;
+    req.block_num = starting_block;
+    return block_run(&req);
+}
+
+size_t block_read(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
+    size_t ret;
+    PROF_BEGIN(block_read_probe);
+    if(dev->cache != NULL)
+        ret = block_cache_read(dev, buf, buf_size, starting_block);
+    else
+        ret = block_transfer(dev, 0, buf, buf_size, starting_block);
+    PROF_END(block_read_probe);
+    return ret;
+}
+
+size_t block_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
+    if(dev->cache != NULL)
+        return block_cache_write(dev, buf, buf_size, starting_block);
+    return block_transfer(dev, 1, buf, buf_size, starting_block);
+}
+
+/**
+ * Whether next continues req on the device and in memory, so both can be done by one command.
+ * Only whole blocks merge: partial ones would end up as a full block transfer the driver reports as done
+ */
+static int block_mergeable(struct block_request *req, uint64_t size, struct block_request *next) {
+    struct block_device *dev = req->dev;
+
+    return next->is_write == req->is_write &&
+            req->sg == NULL && next->sg == NULL &&
+            size + next->buf_size <= BLOCK_MERGE_MAX &&
+            divmod((uint32_t)size, dev->block_size).mod == 0 &&
+            divmod((uint32_t)next->buf_size, dev->block_size).mod == 0 &&
+            next->buf == req->buf + size &&
+            next->block_num == req->block_num + div((uint32_t)size, dev->block_size) &&
+            (req->is_write ? dev->supports_multiple_block_write : dev->supports_multiple_block_read);
+}
+
+/**
+ * Takes the request at the head of the queue together with the ones directly behind it that continue it,
+ * and runs them as one transfer. Only consecutive requests are merged, so the order of overlapping requests is kept
+ */
+static void block_queue_run(struct block_queue *q) {
+    struct block_request *first, *req, *last;
+    uint64_t size;
+    uint32_t merged = 1;
+
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+    first = last = q->head;
+    size = first->buf_size;
+    while(last->next != NULL && block_mergeable(first, size, last->next)) {
+        last = last->next;
+        size += last->buf_size;
+        merged++;
+    }
+    q->head = last->next;
+    if(q->head == NULL)
+        q->tail = NULL;
+    if(enabled)
+        ENABLE_INTERRUPTS();
+
+    // Every merged request had posted pending once
+    for(uint32_t i = 1; i < merged; i++)
+        sem_wait(&q->pending);
+    last->next = NULL;
+
+    if(merged == 1) {
+        block_execute(first);
+    } else {
+        int result = first->is_write ? (int)block_write_blocks(q->dev, first->buf, size, first->block_num) :
+                (int)block_read_blocks(q->dev, first->buf, size, first->block_num);
+        q->merged += merged - 1;
+        for(req = first; req != NULL; req = last) {
+            last = req->next;
+            req->result = result < 0 ? result : (int)req->buf_size;
+            block_complete(req);
+        }
+    }
+    q->completed += merged;
+}
+
+// Handed from block_queue_start to the thread it creates, threads do not take arguments
+static struct block_queue *block_queue_starting;
+static semaphore_t block_queue_started;
+
+static void block_queue_thread(void) {
+    struct block_queue *q = block_queue_starting;
+
+    q->thread = current_process;
+    sem_post(&block_queue_started);
+    while(1) {
+        sem_wait(&q->pending);
+        block_queue_run(q);
+    }
+}
+
+/**
+ * Creates the request queue of a device and the thread servicing it. Drivers that wait for their interrupts
+ * instead of polling let other threads run while a request is in flight. Needs the scheduler
+ * @return 0 on success, -1 if out of memory
+ */
+int block_queue_start(struct block_device *dev) {
+    struct block_queue *q;
+
+    if(dev->queue != NULL)
+        return 0;
+    q = (struct block_queue *)kmalloc(sizeof(struct block_queue));
+    if(q == NULL)
+        return -1;
+    memset(q, 0, sizeof(struct block_queue));
+    q->dev = dev;
+    sem_init(&q->pending, 0);
+
+    sem_init(&block_queue_started, 0);
+    block_queue_starting = q;
+    create_kernel_thread(block_queue_thread, dev->device_name, strlen(dev->device_name), BLOCK_QUEUE_PRIORITY);
+    sem_wait(&block_queue_started);
+    dev->queue = q;
+    return 0;
+}
+
+/**
+ * Queues a request on its device and returns. Without a request queue it runs right away. Safe from IRQ handlers
+ * if the device has a queue
+ */
+void block_submit(struct block_request *req) {
+    struct block_queue *q = req->dev->queue;
+
+    req->next = NULL;
+    req->result = 0;
+    if(req->done == NULL)
+        sem_init(&req->complete, 0);
+
+    if(q == NULL) {
+        block_execute(req);
+        return;
+    }
+
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+    if(q->tail == NULL)
+        q->head = req;
+    else
+        q->tail->next = req;
+    q->tail = req;
+    q->submitted++;
+    if(enabled)
+        ENABLE_INTERRUPTS();
+    sem_post(&q->pending);
+}
+
+/**
+ * Sleeps until a request without a done callback completed
+ * @return The result of the request
+ */
+int block_wait(struct block_request *req) {
+    sem_wait(&req->complete);
+    return req->result;
+}
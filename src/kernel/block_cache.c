@@ -0,0 +1,336 @@
+#include <stdint.h>
+#include <kernel/block.h>
+#include <kernel/mem.h>
+#include <kernel/uart.h>
+#include <common/stdlib.h>
+
+/**
+ * Write-back LRU cache of device blocks between block_read/block_write and the drivers.
+ * Requests of up to max_blocks whole blocks are served from the cache, writes only reach the device when their
+ * buffer is evicted or on block_sync. Larger requests go to the device directly and are kept coherent with the
+ * cached copies. Requests submitted with block_submit bypass the cache, call block_sync before mixing them.
+ */
+
+static struct block_buf * cache_lookup(struct block_cache *c, uint32_t block_num) {
+    struct block_buf *b;
+
+    for(b = c->hash[block_num & c->hash_mask]; b != NULL; b = b->hash_next)
+        if(b->block_num == block_num)
+            return b;
+    return NULL;
+}
+
+static void cache_hash_insert(struct block_cache *c, struct block_buf *b) {
+    b->hash_next = c->hash[b->block_num & c->hash_mask];
+    c->hash[b->block_num & c->hash_mask] = b;
+}
+
+static void cache_hash_remove(struct block_cache *c, struct block_buf *b) {
+    struct block_buf **link = &c->hash[b->block_num & c->hash_mask];
+
+    while(*link != b)
+        link = &(*link)->hash_next;
+    *link = b->hash_next;
+}
+
+static void cache_lru_remove(struct block_cache *c, struct block_buf *b) {
+    if(b->lru_prev != NULL)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        c->lru_head = b->lru_next;
+    if(b->lru_next != NULL)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        c->lru_tail = b->lru_prev;
+}
+
+static void cache_lru_push(struct block_cache *c, struct block_buf *b) {
+    b->lru_prev = NULL;
+    b->lru_next = c->lru_head;
+    if(c->lru_head != NULL)
+        c->lru_head->lru_prev = b;
+    else
+        c->lru_tail = b;
+    c->lru_head = b;
+}
+
+// Marks a buffer most recently used. Pinned buffers are not on the LRU list
+static void cache_touch(struct block_cache *c, struct block_buf *b) {
+    if(b->pins == 0) {
+        cache_lru_remove(c, b);
+        cache_lru_push(c, b);
+    }
+}
+
+static int cache_writeback(struct block_device *dev, struct block_buf *b) {
+    if(!b->dirty)
+        return 0;
+    if(block_transfer(dev, 1, b->data, dev->block_size, b->block_num) != dev->block_size)
+        return -1;
+    b->dirty = 0;
+    dev->cache->stats.writebacks++;
+    return 0;
+}
+
+/**
+ * Takes the least recently used unpinned buffer and gives it to block_num, writing its old block back if dirty.
+ * The caller fills in the data and calls cache_install
+ * @return The buffer, or NULL if every buffer is pinned or the write back failed
+ */
+static struct block_buf * cache_alloc(struct block_device *dev, uint32_t block_num) {
+    struct block_cache *c = dev->cache;
+    struct block_buf *b = c->lru_tail;
+
+    if(b == NULL || cache_writeback(dev, b) != 0)
+        return NULL;
+    if(b->valid) {
+        cache_hash_remove(c, b);
+        c->stats.evictions++;
+    }
+    b->valid = 0;
+    b->block_num = block_num;
+    cache_touch(c, b);
+    return b;
+}
+
+// Makes a buffer from cache_alloc findable once its data is there
+static void cache_install(struct block_cache *c, struct block_buf *b) {
+    b->valid = 1;
+    cache_hash_insert(c, b);
+}
+
+/**
+ * Sets up a cache of bytes / block_size buffers for a device. block_read and block_write use it from then on
+ * @return 0 on success, -1 if out of memory
+ */
+int block_cache_init(struct block_device *dev, uint32_t bytes) {
+    struct block_cache *c;
+    uint32_t count = div(bytes, dev->block_size), hash_size = 1, order = 0, i;
+    uint8_t *data;
+
+    if(dev->cache != NULL)
+        return 0;
+    if(count == 0)
+        return -1;
+    while(hash_size < count)
+        hash_size <<= 1;
+    while((uint32_t)(PAGE_SIZE << order) < count * dev->block_size)
+        order++;
+
+    c = (struct block_cache *)kmalloc(sizeof(struct block_cache));
+    if(c == NULL)
+        return -1;
+    memset(c, 0, sizeof(struct block_cache));
+    c->bufs = (struct block_buf *)kmalloc(count * sizeof(struct block_buf));
+    c->hash = (struct block_buf **)kmalloc(hash_size * sizeof(struct block_buf *));
+    // Page aligned so the driver can use DMA on single buffers
+    data = (uint8_t *)alloc_pages(order);
+    if(c->bufs == NULL || c->hash == NULL || data == NULL) {
+        uart_puts("ERROR: CANNOT ALLOCATE BLOCK CACHE\n");
+        if(c->bufs != NULL)
+            kfree(c->bufs);
+        if(c->hash != NULL)
+            kfree(c->hash);
+        if(data != NULL)
+            free_pages(data, order);
+        kfree(c);
+        return -1;
+    }
+
+    memset(c->bufs, 0, count * sizeof(struct block_buf));
+    memset(c->hash, 0, hash_size * sizeof(struct block_buf *));
+    c->count = count;
+    c->hash_mask = hash_size - 1;
+    // One request must not push out more than a quarter of the cache
+    c->max_blocks = count >> 2 ? count >> 2 : 1;
+    mutex_init(&c->lock);
+    for(i = 0; i < count; i++) {
+        c->bufs[i].data = data + i * dev->block_size;
+        cache_lru_push(c, &c->bufs[i]);
+    }
+
+    dev->cache = c;
+    return 0;
+}
+
+size_t block_cache_read(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
+    struct block_cache *c = dev->cache;
+    struct block_buf *b;
+    divmod_t blocks = divmod(buf_size, dev->block_size);
+    uint32_t i, missing = 0;
+    size_t ret;
+
+    mutex_lock(&c->lock);
+    if(blocks.mod != 0 || blocks.div == 0 || blocks.div > c->max_blocks) {
+        c->stats.bypassed++;
+        ret = block_transfer(dev, 0, buf, buf_size, starting_block);
+        // Blocks written to the cache but not yet to the device are newer than what was just read
+        if(ret == buf_size)
+            for(i = 0; i < blocks.div; i++)
+                if((b = cache_lookup(c, starting_block + i)) != NULL && b->dirty)
+                    memcpy(buf + i * dev->block_size, b->data, dev->block_size);
+        mutex_unlock(&c->lock);
+        return ret;
+    }
+
+    // Moving the cached blocks to the front first keeps the buffers taken for the missing ones from evicting them
+    for(i = 0; i < blocks.div; i++) {
+        if((b = cache_lookup(c, starting_block + i)) == NULL)
+            missing++;
+        else
+            cache_touch(c, b);
+    }
+
+    // A request with any block missing is read with one command, the blocks that were cached are taken from there
+    if(missing != 0) {
+        ret = block_transfer(dev, 0, buf, buf_size, starting_block);
+        if(ret != buf_size) {
+            mutex_unlock(&c->lock);
+            return ret;
+        }
+    }
+
+    for(i = 0; i < blocks.div; i++) {
+        uint8_t *block_buf = buf + i * dev->block_size;
+        if((b = cache_lookup(c, starting_block + i)) != NULL) {
+            if(missing == 0 || b->dirty)
+                memcpy(block_buf, b->data, dev->block_size);
+            c->stats.hits++;
+        } else {
+            c->stats.misses++;
+            if((b = cache_alloc(dev, starting_block + i)) != NULL) {
+                memcpy(b->data, block_buf, dev->block_size);
+                cache_install(c, b);
+            }
+        }
+    }
+    mutex_unlock(&c->lock);
+    return buf_size;
+}
+
+size_t block_cache_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t starting_block) {
+    struct block_cache *c = dev->cache;
+    struct block_buf *b;
+    divmod_t blocks = divmod(buf_size, dev->block_size);
+    uint32_t i;
+    size_t ret;
+
+    mutex_lock(&c->lock);
+    if(blocks.mod != 0 || blocks.div == 0 || blocks.div > c->max_blocks) {
+        c->stats.bypassed++;
+        ret = block_transfer(dev, 1, buf, buf_size, starting_block);
+        // Cached copies take the new data, which is on the device now
+        if(ret == buf_size)
+            for(i = 0; i < blocks.div; i++)
+                if((b = cache_lookup(c, starting_block + i)) != NULL) {
+                    memcpy(b->data, buf + i * dev->block_size, dev->block_size);
+                    b->dirty = 0;
+                }
+        mutex_unlock(&c->lock);
+        return ret;
+    }
+
+    for(i = 0; i < blocks.div; i++) {
+        uint8_t *block_buf = buf + i * dev->block_size;
+        if((b = cache_lookup(c, starting_block + i)) == NULL && (b = cache_alloc(dev, starting_block + i)) != NULL)
+            cache_install(c, b);
+        if(b == NULL) {
+            // No buffer to spare, write this block through
+            ret = block_transfer(dev, 1, block_buf, dev->block_size, starting_block + i);
+            if(ret != dev->block_size) {
+                mutex_unlock(&c->lock);
+                return ret;
+            }
+            continue;
+        }
+        memcpy(b->data, block_buf, dev->block_size);
+        b->dirty = 1;
+        cache_touch(c, b);
+    }
+    mutex_unlock(&c->lock);
+    return buf_size;
+}
+
+/**
+ * Keeps a block in the cache and returns its data, reading it if necessary. The data stays valid and in place
+ * until block_unpin
+ * @return The block's data, or NULL if it cannot be read or every buffer is pinned
+ */
+uint8_t * block_pin(struct block_device *dev, uint32_t block_num) {
+    struct block_cache *c = dev->cache;
+    struct block_buf *b;
+
+    if(c == NULL)
+        return NULL;
+    mutex_lock(&c->lock);
+    if((b = cache_lookup(c, block_num)) != NULL)
+        c->stats.hits++;
+    else {
+        c->stats.misses++;
+        b = cache_alloc(dev, block_num);
+        if(b == NULL || block_transfer(dev, 0, b->data, dev->block_size, block_num) != dev->block_size) {
+            mutex_unlock(&c->lock);
+            return NULL;
+        }
+        cache_install(c, b);
+    }
+    if(b->pins++ == 0)
+        cache_lru_remove(c, b);
+    mutex_unlock(&c->lock);
+    return b->data;
+}
+
+/**
+ * Releases a block_pin
+ * @param dirty Non zero if the data was changed, it is written back like data from block_write
+ */
+void block_unpin(struct block_device *dev, uint32_t block_num, int dirty) {
+    struct block_cache *c = dev->cache;
+    struct block_buf *b;
+
+    if(c == NULL)
+        return;
+    mutex_lock(&c->lock);
+    b = cache_lookup(c, block_num);
+    if(b != NULL && b->pins != 0) {
+        if(dirty)
+            b->dirty = 1;
+        if(--b->pins == 0)
+            cache_lru_push(c, b);
+    }
+    mutex_unlock(&c->lock);
+}
+
+/**
+ * Writes every dirty block in the cache to the device
+ * @return 0 on success, -1 if a block could not be written, it stays dirty
+ */
+int block_sync(struct block_device *dev) {
+    struct block_cache *c = dev->cache;
+    uint32_t i;
+    int ret = 0;
+
+    if(c == NULL)
+        return 0;
+    mutex_lock(&c->lock);
+    for(i = 0; i < c->count; i++)
+        if(c->bufs[i].valid && cache_writeback(dev, &c->bufs[i]) != 0)
+            ret = -1;
+    mutex_unlock(&c->lock);
+    return ret;
+}
+
+void block_cache_report(struct block_device *dev) {
+    block_cache_stats_t stats;
+
+    block_cache_stats(dev, &stats);
+    uart_printf("%s cache: %u hits, %u misses, %u evictions, %u writebacks, %u bypassed\n", dev->device_name,
+            stats.hits, stats.misses, stats.evictions, stats.writebacks, stats.bypassed);
+}
+
+void block_cache_stats(struct block_device *dev, block_cache_stats_t *stats) {
+    if(dev->cache == NULL)
+        memset(stats, 0, sizeof(block_cache_stats_t));
+    else
+        memcpy(stats, &dev->cache->stats, sizeof(block_cache_stats_t));
+}
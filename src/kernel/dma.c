@@ -0,0 +1,50 @@
+#include <kernel/dma.h>
+#include <kernel/mmu.h>
+#include <kernel/atomic.h>
+
+/**
+ * Links count control blocks into a chain and starts the channel on it. The blocks must stay untouched until
+ * dma_wait returns
+ * @param channel Channel 0 to 14
+ * @param cb First of count consecutive control blocks, all fields but nextconbk filled in
+ */
+void dma_start(uint32_t channel, dma_cb_t * cb, uint32_t count) {
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+        cb[i].nextconbk = i + 1 < count ? DMA_BUS_ADDRESS(&cb[i + 1]) : 0;
+    // The engine reads the chain from memory, not from the cache
+    dcache_clean_range(cb, count * sizeof(dma_cb_t));
+
+    mmio_write(DMA_ENABLE, mmio_read(DMA_ENABLE) | (1 << channel));
+    mmio_write(DMA_CHANNEL(channel) + DMA_CS, DMA_CS_RESET);
+    mmio_write(DMA_CHANNEL(channel) + DMA_DEBUG, 7);     // Clear the error flags
+    mmio_write(DMA_CHANNEL(channel) + DMA_CONBLK_AD, DMA_BUS_ADDRESS(cb));
+    dsb();
+    mmio_write(DMA_CHANNEL(channel) + DMA_CS, DMA_CS_ACTIVE | DMA_CS_END | DMA_CS_WAIT_WRITES |
+            DMA_CS_PRIORITY(8) | DMA_CS_PANIC(15));
+}
+
+/**
+ * Waits until the channel ran through its chain
+ * @return 0 when done, -1 on a DMA error or timeout, in which case the channel is aborted
+ */
+int dma_wait(uint32_t channel, useconds_t timeout) {
+    uint32_t cs;
+
+    TIMEOUT_WAIT((mmio_read(DMA_CHANNEL(channel) + DMA_CS) & (DMA_CS_ACTIVE | DMA_CS_ERROR)) != DMA_CS_ACTIVE,
+            timeout);
+    cs = mmio_read(DMA_CHANNEL(channel) + DMA_CS);
+    if ((cs & DMA_CS_ERROR) || (cs & DMA_CS_ACTIVE)) {
+        dma_abort(channel);
+        return -1;
+    }
+    mmio_write(DMA_CHANNEL(channel) + DMA_CS, DMA_CS_END | DMA_CS_INT);
+    dsb();
+    return 0;
+}
+
+void dma_abort(uint32_t channel) {
+    mmio_write(DMA_CHANNEL(channel) + DMA_CS, DMA_CS_ABORT);
+    mmio_write(DMA_CHANNEL(channel) + DMA_CS, DMA_CS_RESET);
+}
@@ -4,9 +4,193 @@
 #include <kernel/mailbox.h>
 #include <kernel/uart.h>
 #include <kernel/mem.h>
+#include <kernel/mmu.h>
+#include <kernel/trace.h>
+#include <kernel/process.h>
+#include <kernel/dma.h>
+#include <kernel/interrupts.h>
+#include <kernel/sync.h>
 #include <common/util.h>
 #include <common/stdlib.h>
 
+static char driver_name[] = "emmc";
+static char device_name[] = "emmc0";	// We use a single device name as there is only one card slot in the RPi
+
+static uint32_t hci_ver = 0;
+static uint32_t capabilities_0 = 0;
+static uint32_t capabilities_1 = 0;
+
+static char *sd_versions[] = { "unknown", "1.0 and 1.01", "1.10",
+                               "2.00", "3.0x", "4.xx" };
+
+#ifdef EMMC_DEBUG
+static char *err_irpts[] = { "CMD_TIMEOUT", "CMD_CRC", "CMD_END_BIT", "CMD_INDEX",
+                             "DATA_TIMEOUT", "DATA_CRC", "DATA_END_BIT", "CURRENT_LIMIT",
+                             "AUTO_CMD12", "ADMA", "TUNING", "RSVD" };
+#endif
+static uint32_t sd_commands[] = {
+        SD_CMD_INDEX(0),
+        SD_CMD_RESERVED(1),
+        SD_CMD_INDEX(2) | SD_RESP_R2,
+        SD_CMD_INDEX(3) | SD_RESP_R6,
+        SD_CMD_INDEX(4),
+        SD_CMD_INDEX(5) | SD_RESP_R4,
+        SD_CMD_INDEX(6) | SD_RESP_R1,
+        SD_CMD_INDEX(7) | SD_RESP_R1b,
+        SD_CMD_INDEX(8) | SD_RESP_R7,
+        SD_CMD_INDEX(9) | SD_RESP_R2,
+        SD_CMD_INDEX(10) | SD_RESP_R2,
+        SD_CMD_INDEX(11) | SD_RESP_R1,
+        SD_CMD_INDEX(12) | SD_RESP_R1b | SD_CMD_TYPE_ABORT,
+        SD_CMD_INDEX(13) | SD_RESP_R1,
+        SD_CMD_RESERVED(14),
+        SD_CMD_INDEX(15),
+        SD_CMD_INDEX(16) | SD_RESP_R1,
+        SD_CMD_INDEX(17) | SD_RESP_R1 | SD_DATA_READ,
+        SD_CMD_INDEX(18) | SD_RESP_R1 | SD_DATA_READ | SD_CMD_MULTI_BLOCK | SD_CMD_BLKCNT_EN | SD_CMD_AUTO_CMD_EN_CMD12,
+        SD_CMD_INDEX(19) | SD_RESP_R1 | SD_DATA_READ,
+        SD_CMD_INDEX(20) | SD_RESP_R1b,
+        SD_CMD_RESERVED(21),
+        SD_CMD_RESERVED(22),
+        SD_CMD_INDEX(23) | SD_RESP_R1,
+        SD_CMD_INDEX(24) | SD_RESP_R1 | SD_DATA_WRITE,
+        SD_CMD_INDEX(25) | SD_RESP_R1 | SD_DATA_WRITE | SD_CMD_MULTI_BLOCK | SD_CMD_BLKCNT_EN | SD_CMD_AUTO_CMD_EN_CMD12,
+        SD_CMD_RESERVED(26),
+        SD_CMD_INDEX(27) | SD_RESP_R1 | SD_DATA_WRITE,
+        SD_CMD_INDEX(28) | SD_RESP_R1b,
+        SD_CMD_INDEX(29) | SD_RESP_R1b,
+        SD_CMD_INDEX(30) | SD_RESP_R1 | SD_DATA_READ,
+        SD_CMD_RESERVED(31),
+        SD_CMD_INDEX(32) | SD_RESP_R1,
+        SD_CMD_INDEX(33) | SD_RESP_R1,
+        SD_CMD_RESERVED(34),
+        SD_CMD_RESERVED(35),
+        SD_CMD_RESERVED(36),
+        SD_CMD_RESERVED(37),
+        SD_CMD_INDEX(38) | SD_RESP_R1b,
+        SD_CMD_RESERVED(39),
+        SD_CMD_RESERVED(40),
+        SD_CMD_RESERVED(41),
+        SD_CMD_RESERVED(42) | SD_RESP_R1,
+        SD_CMD_RESERVED(43),
+        SD_CMD_RESERVED(44),
+        SD_CMD_RESERVED(45),
+        SD_CMD_RESERVED(46),
+        SD_CMD_RESERVED(47),
+        SD_CMD_RESERVED(48),
+        SD_CMD_RESERVED(49),
+        SD_CMD_RESERVED(50),
+        SD_CMD_RESERVED(51),
+        SD_CMD_RESERVED(52),
+        SD_CMD_RESERVED(53),
+        SD_CMD_RESERVED(54),
+        SD_CMD_INDEX(55) | SD_RESP_R1,
+        SD_CMD_INDEX(56) | SD_RESP_R1 | SD_CMD_ISDATA,
+        SD_CMD_RESERVED(57),
+        SD_CMD_RESERVED(58),
+        SD_CMD_RESERVED(59),
+        SD_CMD_RESERVED(60),
+        SD_CMD_RESERVED(61),
+        SD_CMD_RESERVED(62),
+        SD_CMD_RESERVED(63)
+};
+
+static uint32_t sd_acommands[] = {
+        SD_CMD_RESERVED(0),
+        SD_CMD_RESERVED(1),
+        SD_CMD_RESERVED(2),
+        SD_CMD_RESERVED(3),
+        SD_CMD_RESERVED(4),
+        SD_CMD_RESERVED(5),
+        SD_CMD_INDEX(6) | SD_RESP_R1,
+        SD_CMD_RESERVED(7),
+        SD_CMD_RESERVED(8),
+        SD_CMD_RESERVED(9),
+        SD_CMD_RESERVED(10),
+        SD_CMD_RESERVED(11),
+        SD_CMD_RESERVED(12),
+        SD_CMD_INDEX(13) | SD_RESP_R1,
+        SD_CMD_RESERVED(14),
+        SD_CMD_RESERVED(15),
+        SD_CMD_RESERVED(16),
+        SD_CMD_RESERVED(17),
+        SD_CMD_RESERVED(18),
+        SD_CMD_RESERVED(19),
+        SD_CMD_RESERVED(20),
+        SD_CMD_RESERVED(21),
+        SD_CMD_INDEX(22) | SD_RESP_R1 | SD_DATA_READ,
+        SD_CMD_INDEX(23) | SD_RESP_R1,
+        SD_CMD_RESERVED(24),
+        SD_CMD_RESERVED(25),
+        SD_CMD_RESERVED(26),
+        SD_CMD_RESERVED(27),
+        SD_CMD_RESERVED(28),
+        SD_CMD_RESERVED(29),
+        SD_CMD_RESERVED(30),
+        SD_CMD_RESERVED(31),
+        SD_CMD_RESERVED(32),
+        SD_CMD_RESERVED(33),
+        SD_CMD_RESERVED(34),
+        SD_CMD_RESERVED(35),
+        SD_CMD_RESERVED(36),
+        SD_CMD_RESERVED(37),
+        SD_CMD_RESERVED(38),
+        SD_CMD_RESERVED(39),
+        SD_CMD_RESERVED(40),
+        SD_CMD_INDEX(41) | SD_RESP_R3,
+        SD_CMD_INDEX(42) | SD_RESP_R1,
+        SD_CMD_RESERVED(43),
+        SD_CMD_RESERVED(44),
+        SD_CMD_RESERVED(45),
+        SD_CMD_RESERVED(46),
+        SD_CMD_RESERVED(47),
+        SD_CMD_RESERVED(48),
+        SD_CMD_RESERVED(49),
+        SD_CMD_RESERVED(50),
+        SD_CMD_INDEX(51) | SD_RESP_R1 | SD_DATA_READ,
+        SD_CMD_RESERVED(52),
+        SD_CMD_RESERVED(53),
+        SD_CMD_RESERVED(54),
+        SD_CMD_RESERVED(55),
+        SD_CMD_RESERVED(56),
+        SD_CMD_RESERVED(57),
+        SD_CMD_RESERVED(58),
+        SD_CMD_RESERVED(59),
+        SD_CMD_RESERVED(60),
+        SD_CMD_RESERVED(61),
+        SD_CMD_RESERVED(62),
+        SD_CMD_RESERVED(63)
+};
+
+// The controller can lose a register write that follows another one within two SD clock cycles
+static uint32_t sd_write_delay_us = 6;
+
+// Command latency histogram, bucket i counts commands that took [2^(i-1), 2^i) microseconds
+#define SD_LATENCY_BUCKETS 24
+static uint32_t sd_latency_hist[SD_LATENCY_BUCKETS];
+static uint32_t sd_latency_max = 0;
+
+// Data transfers go through the DMA engine unless sd_set_dma turned it off
+static int sd_dma_enabled = 1;
+static dma_cb_t sd_dma_cbs[SD_DMA_MAX_SEGMENTS];
+
+// Once the EMMC interrupt is registered, threads wait for data and busy phases asleep
+static int sd_irq_registered = 0;
+static event_flags_t sd_irq_event;
+
+static void sd_reg_write(uint32_t reg, uint32_t value) {
+    mmio_write(EMMC_BASE + reg, value);
+    udelay(sd_write_delay_us);
+}
+
+/**
+ * Sets the delay sd_reg_write leaves after each write for an SD clock of rate Hz.
+ * One microsecond extra covers the divider rounding the clock down and the granularity of udelay
+ */
+static void sd_set_write_delay(uint32_t rate) {
+    sd_write_delay_us = div(2000000 + rate - 1, rate) + 1;
+}
+
 static void sd_power_off() {
     /* Power off the SD card */
     uint32_t control0 = mmio_read(EMMC_BASE + EMMC_CONTROL0);
@@ -16,7 +200,7 @@ static void sd_power_off() {
 
 static uint32_t sd_get_base_clock_hz() {
     mail_message_t msg;
-    uint32_t mailbuffer[8];
+    uint32_t mailbuffer[8] __attribute__((aligned(CACHE_LINE_SIZE)));
 
     /* Get the base clock rate */
     // set up the buffer
@@ -35,10 +219,12 @@ static uint32_t sd_get_base_clock_hz() {
 
     // send the message
     msg.data = (uint32_t)mailbuffer;
+    dcache_clean_invalidate_range(mailbuffer, sizeof(mailbuffer));
     mailbox_send(msg, PROPERTY_CHANNEL);
 
     // read the response
     msg = mailbox_read(PROPERTY_CHANNEL);
+    dcache_invalidate_range(mailbuffer, sizeof(mailbuffer));
 
     if (!msg.data)
         return -1;
@@ -60,7 +246,7 @@ static uint32_t sd_get_base_clock_hz() {
 
 static int bcm_2708_power_off() {
     mail_message_t msg;
-    uint32_t mailbuffer[8];
+    uint32_t mailbuffer[8] __attribute__((aligned(CACHE_LINE_SIZE)));
 
     /* Power off the SD card */
     // set up the buffer
@@ -79,10 +265,12 @@ static int bcm_2708_power_off() {
 
     // send the message
     msg.data = (uint32_t)mailbuffer;
+    dcache_clean_invalidate_range(mailbuffer, sizeof(mailbuffer));
     mailbox_send(msg, PROPERTY_CHANNEL);
 
     // read the response
     mailbox_read(PROPERTY_CHANNEL);
+    dcache_invalidate_range(mailbuffer, sizeof(mailbuffer));
 
     if(mailbuffer[1] != MBOX_SUCCESS)
     {
@@ -109,7 +297,7 @@ static int bcm_2708_power_off() {
 
 static int bcm_2708_power_on() {
     mail_message_t msg;
-    uint32_t mailbuffer[8];
+    uint32_t mailbuffer[8] __attribute__((aligned(CACHE_LINE_SIZE)));
 
     /* Power on the SD card */
     // set up the buffer
@@ -128,10 +316,12 @@ static int bcm_2708_power_on() {
 
     // send the message
     msg.data = (uint32_t)mailbuffer;
+    dcache_clean_invalidate_range(mailbuffer, sizeof(mailbuffer));
     mailbox_send(msg, PROPERTY_CHANNEL);
 
     // read the response
     mailbox_send(msg, PROPERTY_CHANNEL);
+    dcache_invalidate_range(mailbuffer, sizeof(mailbuffer));
 
     if(mailbuffer[1] != MBOX_SUCCESS)
     {
@@ -161,7 +351,7 @@ static int bcm_2708_power_cycle()
     if(bcm_2708_power_off() < 0)
         return -1;
 
-    udelay(5000);
+    ksleep_us(5000);
 
     return bcm_2708_power_on();
 }
@@ -256,6 +446,7 @@ static int sd_switch_clock_rate(uint32_t base_clock, uint32_t target_rate) {
     control1 |= (1 << 2);
     mmio_write(EMMC_BASE + EMMC_CONTROL1, control1);
     udelay(2000);
+    sd_set_write_delay(target_rate);
 
 #ifdef EMMC_DEBUG
     uart_printf("EMMC: successfully set clock rate to %i Hz\n", target_rate);
@@ -289,14 +480,101 @@ static int sd_reset_dat() {
     return 0;
 }
 
-static void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg, uint32_t argument, useconds_t timeout) {
+// Stops the controller signalling, the waiting thread reads and clears INTERRUPT itself
+static void sd_irq_clearer(void) {
+    mmio_write(EMMC_BASE + EMMC_IRPT_EN, 0);
+}
+
+static void sd_irq_handler(void) {
+    event_set(&sd_irq_event, 1);
+}
+
+/**
+ * Waits until one of the mask bits is set in INTERRUPT. In a thread with the EMMC interrupt registered the thread
+ * sleeps and the interrupt wakes it, otherwise it polls. Bit 15 includes all error bits
+ */
+static void sd_wait_interrupt(uint32_t mask, useconds_t timeout) {
+    uint32_t deadline, now;
+
+    if(!sd_irq_registered || current_process == NULL || !INTERRUPTS_ENABLED()) {
+        TIMEOUT_WAIT(mmio_read(EMMC_BASE + EMMC_INTERRUPT) & mask, timeout);
+        return;
+    }
+
+    deadline = uuptime() + timeout;
+    while((mmio_read(EMMC_BASE + EMMC_INTERRUPT) & mask) == 0) {
+        now = uuptime();
+        if((int32_t)(deadline - now) <= 0)
+            break;
+        event_clear(&sd_irq_event, 1);
+        // If a bit got set in the meantime the interrupt fires right away
+        mmio_write(EMMC_BASE + EMMC_IRPT_EN, (mask & 0xffff) | ((mask & 0x8000) ? 0xffff0000 : 0));
+        event_wait(&sd_irq_event, 1, EVENT_WAIT_ANY | EVENT_CLEAR, deadline - now);
+    }
+    mmio_write(EMMC_BASE + EMMC_IRPT_EN, 0);
+}
+
+/**
+ * Builds the control block chain moving the data of the current command between EMMC_DATA and dev->sg, or dev->buf
+ * if there is no scatter-gather list, and does the cache maintenance before the transfer.
+ * The DMA engine is paced by the DREQ of the controller, so the chain can be started before the command is sent
+ * @return The number of control blocks
+ */
+static uint32_t sd_dma_prepare(struct emmc_block_dev *dev, int is_write) {
+    struct block_sg single;
+    const struct block_sg *sg = dev->sg;
+    uint32_t entries = dev->sg_entries, i;
+    uint32_t data = DMA_PERIPHERAL_BUS_ADDRESS(EMMC_BASE + EMMC_DATA);
+
+    if(sg == NULL) {
+        single.buf = dev->buf;
+        single.len = dev->block_size * dev->blocks_to_transfer;
+        sg = &single;
+        entries = 1;
+    }
+
+    for(i = 0; i < entries; i++) {
+        dma_cb_t *cb = &sd_dma_cbs[i];
+        if(is_write) {
+            dcache_clean_range(sg[i].buf, sg[i].len);
+            cb->ti = DMA_TI_PERMAP(DMA_PERMAP_EMMC) | DMA_TI_DEST_DREQ | DMA_TI_SRC_INC | DMA_TI_WAIT_RESP;
+            cb->source_ad = DMA_BUS_ADDRESS(sg[i].buf);
+            cb->dest_ad = data;
+        } else {
+            // Write back anything dirty now so an eviction cannot overwrite the data the DMA stores
+            dcache_clean_invalidate_range(sg[i].buf, sg[i].len);
+            cb->ti = DMA_TI_PERMAP(DMA_PERMAP_EMMC) | DMA_TI_SRC_DREQ | DMA_TI_DEST_INC | DMA_TI_WAIT_RESP;
+            cb->source_ad = data;
+            cb->dest_ad = DMA_BUS_ADDRESS(sg[i].buf);
+        }
+        cb->txfr_len = sg[i].len;
+        cb->stride = 0;
+    }
+    return entries;
+}
+
+// Drops lines the CPU may have fetched while the DMA was writing to the buffers of a read
+static void sd_dma_finish_read(struct emmc_block_dev *dev) {
+    uint32_t i;
+
+    if(dev->sg == NULL)
+        dcache_invalidate_range(dev->buf, dev->block_size * dev->blocks_to_transfer);
+    else
+        for(i = 0; i < dev->sg_entries; i++)
+            dcache_invalidate_range(dev->sg[i].buf, dev->sg[i].len);
+}
+
+static void sd_issue_command_wait(struct emmc_block_dev *dev, uint32_t cmd_reg, uint32_t argument, useconds_t timeout) {
     dev->last_cmd_reg = cmd_reg;
     dev->last_cmd_success = 0;
 
     // This is as per HCSS 3.7.1.1/3.7.2.2
     // Check Command Inhibit
-    while(mmio_read(EMMC_BASE + EMMC_STATUS) & 0x1)
-        udelay(1000);
+    TIMEOUT_WAIT((mmio_read(EMMC_BASE + EMMC_STATUS) & 0x1) == 0, timeout);
+    if(mmio_read(EMMC_BASE + EMMC_STATUS) & 0x1) {
+        uart_printf("SD: command inhibit (CMD) did not clear\n");
+        return;
+    }
 
     // Is the command with busy?
     if((cmd_reg & SD_CMD_RSPNS_TYPE_MASK) == SD_CMD_RSPNS_TYPE_48B) {
@@ -305,43 +583,41 @@ static void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg, u
         if((cmd_reg & SD_CMD_TYPE_MASK) != SD_CMD_TYPE_ABORT) {
             // Not an abort command
             // Wait for the data line to be free
-            while(mmio_read(EMMC_BASE + EMMC_STATUS) & 0x2)
-                udelay(1000);
+            TIMEOUT_WAIT((mmio_read(EMMC_BASE + EMMC_STATUS) & 0x2) == 0, timeout);
+            if(mmio_read(EMMC_BASE + EMMC_STATUS) & 0x2) {
+                uart_printf("SD: command inhibit (DAT) did not clear\n");
+                return;
+            }
         }
     }
 
     // Is this a DMA transfer?
-    int is_sdma = 0;
-    if((cmd_reg & SD_CMD_ISDATA) && (dev->use_sdma)) {
+    int is_dma = 0;
+    if((cmd_reg & SD_CMD_ISDATA) && (dev->use_dma)) {
 #ifdef EMMC_DEBUG
-        uart_printf("SD: performing SDMA transfer, current INTERRUPT: %08x\n", mmio_read(EMMC_BASE + EMMC_INTERRUPT));
+        uart_printf("SD: performing DMA transfer, current INTERRUPT: %08x\n", mmio_read(EMMC_BASE + EMMC_INTERRUPT));
 #endif
-        is_sdma = 1;
+        is_dma = 1;
     }
 
     // Set block size and block count
-    // For now, block size = 512 bytes, block count = 1,
-    //  host SDMA buffer boundary = 4 kiB
     if(dev->blocks_to_transfer > 0xffff) {
         uart_printf("SD: blocks_to_transfer too great (%i)\n", dev->blocks_to_transfer);
         dev->last_cmd_success = 0;
         return;
     }
     uint32_t blksizecnt = dev->block_size | (dev->blocks_to_transfer << 16);
-    mmio_write(EMMC_BASE + EMMC_BLKSIZECNT, blksizecnt);
+    sd_reg_write(EMMC_BLKSIZECNT, blksizecnt);
 
     // Set argument 1 reg
-    mmio_write(EMMC_BASE + EMMC_ARG1, argument);
+    sd_reg_write(EMMC_ARG1, argument);
 
-    if(is_sdma) {
-        // Set Transfer mode register
-        cmd_reg |= SD_CMD_DMA;
-    }
+    // The controller's own DMA does not work on the BCM2835, the system DMA engine empties the FIFO instead
+    if(is_dma)
+        dma_start(DMA_CHANNEL_EMMC, sd_dma_cbs, sd_dma_prepare(dev, !(cmd_reg & SD_CMD_DAT_DIR_CH)));
 
     // Set command reg
-    mmio_write(EMMC_BASE + EMMC_CMDTM, cmd_reg);
-
-    udelay(2000);
+    sd_reg_write(EMMC_CMDTM, cmd_reg);
 
     // Wait for command complete interrupt
     TIMEOUT_WAIT(mmio_read(EMMC_BASE + EMMC_INTERRUPT) & 0x8001, timeout);
@@ -355,13 +631,13 @@ static void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg, u
 #ifdef EMMC_DEBUG
         uart_printf("SD: error occured whilst waiting for command complete interrupt\n");
 #endif
+        if(is_dma)
+            dma_abort(DMA_CHANNEL_EMMC);
         dev->last_error = irpts & 0xffff0000;
         dev->last_interrupt = irpts;
         return;
     }
 
-    udelay(2000);
-
     // Get response data
     switch(cmd_reg & SD_CMD_RSPNS_TYPE_MASK) {
         case SD_CMD_RSPNS_TYPE_48:
@@ -378,7 +654,7 @@ static void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg, u
     }
 
     // If with data, wait for the appropriate interrupt
-    if((cmd_reg & SD_CMD_ISDATA) && (is_sdma == 0)) {
+    if((cmd_reg & SD_CMD_ISDATA) && (is_dma == 0)) {
         uint32_t wr_irpt;
         int is_write = 0;
         if(cmd_reg & SD_CMD_DAT_DIR_CH)
@@ -395,7 +671,7 @@ static void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg, u
             if(dev->blocks_to_transfer > 1)
 				uart_printf("SD: multi block transfer, awaiting block %i ready\n", cur_block);
 #endif
-            TIMEOUT_WAIT(mmio_read(EMMC_BASE + EMMC_INTERRUPT) & (wr_irpt | 0x8000), timeout);
+            sd_wait_interrupt(wr_irpt | 0x8000, timeout);
             irpts = mmio_read(EMMC_BASE + EMMC_INTERRUPT);
             mmio_write(EMMC_BASE + EMMC_INTERRUPT, 0xffff0000 | wr_irpt);
 
@@ -429,13 +705,13 @@ static void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg, u
     }
 
     // Wait for transfer complete (set if read/write transfer or with busy)
-    if((((cmd_reg & SD_CMD_RSPNS_TYPE_MASK) == SD_CMD_RSPNS_TYPE_48B) ||
-        (cmd_reg & SD_CMD_ISDATA)) && (is_sdma == 0)) {
+    if(((cmd_reg & SD_CMD_RSPNS_TYPE_MASK) == SD_CMD_RSPNS_TYPE_48B) ||
+        (cmd_reg & SD_CMD_ISDATA)) {
         // First check command inhibit (DAT) is not already 0
         if((mmio_read(EMMC_BASE + EMMC_STATUS) & 0x2) == 0)
             mmio_write(EMMC_BASE + EMMC_INTERRUPT, 0xffff0002);
         else {
-            TIMEOUT_WAIT(mmio_read(EMMC_BASE + EMMC_INTERRUPT) & 0x8002, timeout);
+            sd_wait_interrupt(0x8002, timeout);
             irpts = mmio_read(EMMC_BASE + EMMC_INTERRUPT);
             mmio_write(EMMC_BASE + EMMC_INTERRUPT, 0xffff0002);
 
@@ -445,86 +721,70 @@ static void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg, u
 #ifdef EMMC_DEBUG
                 uart_printf("SD: error occured whilst waiting for transfer complete interrupt\n");
 #endif
+                if(is_dma)
+                    dma_abort(DMA_CHANNEL_EMMC);
                 dev->last_error = irpts & 0xffff0000;
                 dev->last_interrupt = irpts;
                 return;
             }
             mmio_write(EMMC_BASE + EMMC_INTERRUPT, 0xffff0002);
         }
-    } else if (is_sdma) {
-        // For SDMA transfers, we have to wait for either transfer complete,
-        //  DMA int or an error
-
-        // First check command inhibit (DAT) is not already 0
-        if((mmio_read(EMMC_BASE + EMMC_STATUS) & 0x2) == 0)
-            mmio_write(EMMC_BASE + EMMC_INTERRUPT, 0xffff000a);
-        else {
-            TIMEOUT_WAIT(mmio_read(EMMC_BASE + EMMC_INTERRUPT) & 0x800a, timeout);
-            irpts = mmio_read(EMMC_BASE + EMMC_INTERRUPT);
-            mmio_write(EMMC_BASE + EMMC_INTERRUPT, 0xffff000a);
+    }
 
-            // Detect errors
-            if((irpts & 0x8000) && ((irpts & 0x2) != 0x2)) {
+    // The DMA engine moved the data as the controller requested it, so it is done or about to finish its last writes
+    if(is_dma) {
+        if(dma_wait(DMA_CHANNEL_EMMC, timeout) != 0) {
 #ifdef EMMC_DEBUG
-                uart_printf("SD: error occured whilst waiting for transfer complete interrupt\n");
+            uart_printf("SD: DMA transfer failed\n");
 #endif
-                dev->last_error = irpts & 0xffff0000;
-                dev->last_interrupt = irpts;
-                return;
-            }
+            dev->last_error = irpts & 0xffff0000;
+            dev->last_interrupt = irpts;
+            return;
+        }
+        // The read/write ready flags were raised for every block but nobody polled them
+        mmio_write(EMMC_BASE + EMMC_INTERRUPT, 0x30);
+        if(cmd_reg & SD_CMD_DAT_DIR_CH)
+            sd_dma_finish_read(dev);
+    }
 
-            // Detect DMA interrupt without transfer complete
-            // Currently not supported - all block sizes should fit in the
-            //  buffer
-            if((irpts & 0x8) && ((irpts & 0x2) != 0x2)) {
-#ifdef EMMC_DEBUG
-                uart_printf("SD: error: DMA interrupt occured without transfer complete\n");
-#endif
-                dev->last_error = irpts & 0xffff0000;
-                dev->last_interrupt = irpts;
-                return;
-            }
+    // Return success
+    dev->last_cmd_success = 1;
+}
 
-            // Detect transfer complete
-            if(irpts & 0x2) {
-#ifdef EMMC_DEBUG
-                uart_printf("SD: SDMA transfer complete");
-#endif
-                // Transfer the data to the user buffer
-                memcpy(dev->buf, (const void *)SDMA_BUFFER, dev->block_size);
-            } else {
-                // Unknown error
-#ifdef EMMC_DEBUG
-                if(irpts == 0)
-                    uart_printf("SD: timeout waiting for SDMA transfer to complete\n");
-                else
-                    uart_printf("SD: unknown SDMA transfer error\n");
+/**
+ * Issues a command and waits for it by polling the interrupt and status bits, recording its latency
+ */
+static void sd_issue_command_int(struct emmc_block_dev *dev, uint32_t cmd_reg, uint32_t argument, useconds_t timeout) {
+    uint32_t start = uuptime(), elapsed;
 
-                uart_printf("SD: INTERRUPT: %08x, STATUS %08x\n", irpts, mmio_read(EMMC_BASE + EMMC_STATUS));
-#endif
+    trace_event(TRACE_SD_COMMAND, cmd_reg, argument);
+    sd_issue_command_wait(dev, cmd_reg, argument, timeout);
 
-                if((irpts == 0) && ((mmio_read(EMMC_BASE + EMMC_STATUS) & 0x3) == 0x2)) {
-                    // The data transfer is ongoing, we should attempt to stop
-                    //  it
-#ifdef EMMC_DEBUG
-                    uart_printf("SD: aborting transfer\n");
-#endif
-                    mmio_write(EMMC_BASE + EMMC_CMDTM, sd_commands[STOP_TRANSMISSION]);
+    elapsed = uuptime() - start;
+    sd_latency_hist[elapsed == 0 ? 0 : MIN(32 - __builtin_clz(elapsed), SD_LATENCY_BUCKETS - 1)]++;
+    if(elapsed > sd_latency_max)
+        sd_latency_max = elapsed;
+}
 
-#ifdef EMMC_DEBUG
-                    // pause to let us read the screen
-                    udelay(2000000);
-#endif
-                }
-                dev->last_error = irpts & 0xffff0000;
-                dev->last_interrupt = irpts;
-                return;
-            }
-        }
+/**
+ * Prints the command latency histogram
+ */
+void sd_latency_report(void) {
+    uint32_t total = 0;
+    int i;
+
+    for(i = 0; i < SD_LATENCY_BUCKETS; i++)
+        total += sd_latency_hist[i];
+    uart_printf("SD: %u commands, max %u us\n", total, sd_latency_max);
+    for(i = 0; i < SD_LATENCY_BUCKETS; i++) {
+        if(sd_latency_hist[i] != 0)
+            uart_printf("SD: < %8u us: %u\n", 1u << i, sd_latency_hist[i]);
     }
+}
 
-    // Return success
-    dev->last_cmd_success = 1;
+void sd_latency_reset(void) {
+    bzero(sd_latency_hist, sizeof(sd_latency_hist));
+    sd_latency_max = 0;
 }
 
 // Handle a card interrupt
@@ -729,7 +989,7 @@ int sd_card_init(struct block_device **dev) {
     uint32_t vendor = ver >> 24;
     uint32_t sdversion = (ver >> 16) & 0xff;
     uint32_t slot_status = ver & 0xff;
-    uart_printf("EMMC: vendor %x, sdversion %x, slot_status %x\n", vendor, sdversion, slot_status);
+    uart_printf("EMMC: vendor %#x, sdversion %#x, slot_status %#x\n", vendor, sdversion, slot_status);
     hci_ver = sdversion;
 
     if(hci_ver < 2) {
@@ -805,6 +1065,7 @@ int sd_card_init(struct block_device **dev) {
         return 3;
     }
     control1 |= f_id;
+    sd_set_write_delay(SD_CLOCK_ID);
 
     control1 |= (7 << 16);		// data timeout = TMCLK * 2^10
     mmio_write(EMMC_BASE + EMMC_CONTROL1, control1);
@@ -823,11 +1084,11 @@ int sd_card_init(struct block_device **dev) {
 #ifdef EMMC_DEBUG
     uart_printf("EMMC: enabling SD clock\n");
 #endif
-    udelay(2000);
+    ksleep_us(2000);
     control1 = mmio_read(EMMC_BASE + EMMC_CONTROL1);
     control1 |= 4;
     mmio_write(EMMC_BASE + EMMC_CONTROL1, control1);
-    udelay(2000);
+    ksleep_us(2000);
 #ifdef EMMC_DEBUG
     uart_printf("EMMC: SD clock enabled\n");
 #endif
@@ -842,7 +1103,7 @@ int sd_card_init(struct block_device **dev) {
 #ifdef EMMC_DEBUG
     uart_printf("EMMC: interrupts disabled\n");
 #endif
-    udelay(2000);
+    ksleep_us(2000);
 
     // Prepare the device structure
     struct emmc_block_dev *ret;
@@ -856,12 +1117,18 @@ int sd_card_init(struct block_device **dev) {
         return 2;
     }
 
+    // A device initialised again after an error keeps its request queue and block cache
+    struct block_queue *queue = (*dev == 0x0) ? NULL : ret->bd.queue;
+    struct block_cache *cache = (*dev == 0x0) ? NULL : ret->bd.cache;
     memset(ret, 0, sizeof(struct emmc_block_dev));
+    ret->bd.queue = queue;
+    ret->bd.cache = cache;
     ret->bd.driver_name = driver_name;
     ret->bd.device_name = device_name;
     ret->bd.block_size = 512;
     ret->bd.read = sd_read;
     ret->bd.write = sd_write;
+    ret->bd.read_sg = sd_read_sg;
     ret->bd.supports_multiple_block_read = 1;
     ret->bd.supports_multiple_block_write = 1;
     ret->base_clock = base_clock;
@@ -973,7 +1240,7 @@ int sd_card_init(struct block_device **dev) {
 #ifdef EMMC_DEBUG
             uart_printf("SD: card is busy, retrying\n");
 #endif
-            udelay(500000);
+            ksleep_us(500000);
         }
     }
 
@@ -987,7 +1254,7 @@ int sd_card_init(struct block_device **dev) {
     sd_switch_clock_rate(base_clock, SD_CLOCK_NORMAL);
 
     // A small wait before the voltage switch
-    udelay(5000);
+    ksleep_us(5000);
 
     // Switch to 1.8V mode if possible
     if(ret->card_supports_18v) {
@@ -1030,7 +1297,7 @@ int sd_card_init(struct block_device **dev) {
         mmio_write(EMMC_BASE + EMMC_CONTROL0, control0);
 
         // Wait 5 ms
-        udelay(5000);
+        ksleep_us(5000);
 
         // Check the 1.8V signal enable is set
         control0 = mmio_read(EMMC_BASE + EMMC_CONTROL0);
@@ -1049,7 +1316,7 @@ int sd_card_init(struct block_device **dev) {
         mmio_write(EMMC_BASE + EMMC_CONTROL1, control1);
 
         // Wait 1 ms
-        udelay(10000);
+        ksleep_us(10000);
 
         // Check DAT[3:0]
         status_reg = mmio_read(EMMC_BASE + EMMC_STATUS);
@@ -1257,6 +1524,12 @@ int sd_card_init(struct block_device **dev) {
     // Reset interrupt register
     mmio_write(EMMC_BASE + EMMC_INTERRUPT, 0xffffffff);
 
+    if(!sd_irq_registered) {
+        event_init(&sd_irq_event);
+        register_irq_handler(EMMC_IRQ, sd_irq_handler, sd_irq_clearer);
+        sd_irq_registered = 1;
+    }
+
     *dev = (struct block_device *)ret;
 
     return 0;
@@ -1343,6 +1616,29 @@ static int sd_ensure_data_mode(struct emmc_block_dev *edev)
     return 0;
 }
 
+/**
+ * DMA is only used for buffers covering whole cache lines, the invalidation after a read would otherwise throw away
+ * writes to data sharing the first or last line
+ */
+static int sd_dma_usable(const struct block_sg *sg, uint32_t entries) {
+    uint32_t i;
+
+    if(!sd_dma_enabled || entries > SD_DMA_MAX_SEGMENTS)
+        return 0;
+    for(i = 0; i < entries; i++)
+        if((((uint32_t)sg[i].buf | sg[i].len) & (CACHE_LINE_SIZE - 1)) != 0)
+            return 0;
+    return 1;
+}
+
+/**
+ * Selects how data commands move their data
+ * @param enabled 0 to read and write EMMC_DATA from the CPU, 1 to use the DMA engine where the buffers allow it
+ */
+void sd_set_dma(int enabled) {
+    sd_dma_enabled = enabled;
+}
+
 static int sd_do_data_command(struct emmc_block_dev *edev, int is_write, uint8_t *buf, uint64_t buf_size, uint32_t block_no) {
     // PLSS table 4.20 - SDSC cards use byte addresses rather than block addresses
     if(!edev->card_supports_sdhc)
@@ -1363,6 +1659,11 @@ static int sd_do_data_command(struct emmc_block_dev *edev, int is_write, uint8_t
         return -1;
     }
     edev->buf = buf;
+    if(edev->sg == NULL) {
+        struct block_sg single = { buf, buf_size };
+        edev->use_dma = sd_dma_usable(&single, 1);
+    } else
+        edev->use_dma = 1;
 
     // Decide on the command to use
     int command;
@@ -1381,7 +1682,6 @@ static int sd_do_data_command(struct emmc_block_dev *edev, int is_write, uint8_t
     int retry_count = 0;
     int max_retries = 3;
     while(retry_count < max_retries) {
-        edev->use_sdma = 0;
         sd_issue_command(edev, command, block_no, 5000000);
 
         if(SUCCESS(edev))
@@ -1389,6 +1689,12 @@ static int sd_do_data_command(struct emmc_block_dev *edev, int is_write, uint8_t
         else {
             uart_printf("SD: error sending CMD%d, ", command);
             uart_printf("error = %08x.  ", edev->last_error);
+            // A multi block transfer that failed part way leaves the card sending or receiving, stop it before retrying
+            if(edev->blocks_to_transfer > 1) {
+                sd_reset_cmd();
+                sd_reset_dat();
+                sd_issue_command(edev, STOP_TRANSMISSION, 0, 500000);
+            }
             retry_count++;
             if(retry_count < max_retries)
                 uart_printf("Retrying...\n");
@@ -1396,6 +1702,8 @@ static int sd_do_data_command(struct emmc_block_dev *edev, int is_write, uint8_t
                 uart_printf("Giving up.\n");
         }
     }
+    // Commands issued outside of here, like SEND_SCR, always use PIO
+    edev->use_dma = 0;
     if(retry_count >= max_retries) {
         edev->card_rca = 0;
         return -1;
@@ -1413,6 +1721,7 @@ int sd_read(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t
     uart_printf("SD: read() card ready, reading from block %u\n", block_no);
 #endif
 
+    edev->sg = NULL;
     if(sd_do_data_command(edev, 0, buf, buf_size, block_no) < 0)
         return 1;
 
@@ -1433,6 +1742,7 @@ int sd_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t
     uart_printf("SD: write() card ready, reading from block %u\n", block_no);
 #endif
 
+    edev->sg = NULL;
     if(sd_do_data_command(edev, 1, buf, buf_size, block_no) < 0)
         return -1;
 
@@ -1443,3 +1753,34 @@ int sd_write(struct block_device *dev, uint8_t *buf, uint64_t buf_size, uint32_t
     return 0;
 }
 
+/**
+ * Reads consecutive blocks into several buffers with a single multi block command, one DMA control block per buffer.
+ * Falls back to a read per buffer if they are not suitable for DMA
+ */
+int sd_read_sg(struct block_device *dev, const struct block_sg *sg, uint32_t entries, uint32_t block_no) {
+    struct emmc_block_dev *edev = (struct emmc_block_dev *)dev;
+    uint64_t total = 0;
+    uint32_t i;
+    int ret;
+
+    if(!sd_dma_usable(sg, entries)) {
+        for(i = 0; i < entries; i++) {
+            if((ret = sd_read(dev, sg[i].buf, sg[i].len, block_no)) != 0)
+                return ret;
+            block_no += div(sg[i].len, dev->block_size);
+        }
+        return 0;
+    }
+
+    if(sd_ensure_data_mode(edev) != 0)
+        return 2;
+
+    for(i = 0; i < entries; i++)
+        total += sg[i].len;
+    edev->sg = sg;
+    edev->sg_entries = entries;
+    ret = sd_do_data_command(edev, 0, NULL, total, block_no);
+    edev->sg = NULL;
+    return ret < 0 ? 1 : 0;
+}
+
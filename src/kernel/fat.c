@@ -36,6 +36,7 @@ struct fat_fs {
     uint32_t total_sectors;
     uint32_t sectors_per_cluster;
     uint32_t bytes_per_sector;
+    div_const_t bytes_per_sector_div;
     char *vol_label;
     uint32_t first_fat_sector;
     uint32_t first_data_sector;
@@ -174,7 +175,7 @@ int fat_init(struct block_device *parent, struct fs **fs) {
 #ifdef FAT_DEBUG
     int j = 0;
 	for(int i = 0; i < 90; i++) {
-		uart_printf("%x ", block_0[i]);
+		uart_printf("%#x ", block_0[i]);
 		j++;
 		if(j == 8) {
 			j = 0;
@@ -187,7 +188,7 @@ int fat_init(struct block_device *parent, struct fs **fs) {
 
     struct fat_BS *bs = (struct fat_BS *)block_0;
     if(bs->bootjmp[0] != 0xeb) {
-        uart_printf("FAT: not a valid FAT filesystem on %s (%x)\n", parent->device_name, bs->bootjmp[0]);
+        uart_printf("FAT: not a valid FAT filesystem on %s (%#x)\n", parent->device_name, bs->bootjmp[0]);
         return -1;
     }
 
@@ -206,6 +207,7 @@ int fat_init(struct block_device *parent, struct fs **fs) {
     ret->total_sectors = total_sectors;
 
     ret->bytes_per_sector = (uint32_t)bs->bytes_per_sector;
+    div_const_init(&ret->bytes_per_sector_div, ret->bytes_per_sector);
     ret->root_dir_entries = bs->root_entry_count;
     // The + bytes_per_sector - 1 rounds up the sector no
     ret->root_dir_sectors = div((ret->root_dir_entries * 32 + ret->bytes_per_sector - 1), ret->bytes_per_sector);
@@ -269,6 +271,7 @@ int fat_init(struct block_device *parent, struct fs **fs) {
     }
 
     ret->b.block_size = ret->bytes_per_sector * ret->sectors_per_cluster;
+    div_const_init(&ret->b.block_size_div, ret->b.block_size);
     *fs = (struct fs *)ret;
     kfree(block_0);
 
@@ -290,14 +293,15 @@ static uint32_t get_next_fat_entry(struct fat_fs *fs, uint32_t current_cluster)
     switch(fs->fat_type) {
         case FAT16: {
             uint32_t fat_offset = current_cluster << 1; // *2
-            uint32_t fat_sector = fs->first_fat_sector + div(fat_offset, fs->bytes_per_sector);
+            divmod_t fat_pos = divmod_const(fat_offset, &fs->bytes_per_sector_div);
+            uint32_t fat_sector = fs->first_fat_sector + fat_pos.div;
             uint8_t *buf = (uint8_t *)kmalloc(512);
             int br_ret = block_read(fs->b.parent, buf, 512, fat_sector);
             if(br_ret < 0) {
-                uart_printf("FAT: block_read returned %i\n");
+                uart_printf("FAT: block_read returned %i\n", br_ret);
                 return 0x0ffffff7;
             }
-            uint32_t fat_index = divmod(fat_offset, fs->bytes_per_sector).mod;
+            uint32_t fat_index = fat_pos.mod;
             uint32_t next_cluster = (uint32_t)*(uint16_t *)&buf[fat_index];
             kfree(buf);
             if(next_cluster >= 0xfff7)
@@ -307,14 +311,15 @@ static uint32_t get_next_fat_entry(struct fat_fs *fs, uint32_t current_cluster)
 
         case FAT32: {
             uint32_t fat_offset = current_cluster << 2; // *4
-            uint32_t fat_sector = fs->first_fat_sector + div(fat_offset, fs->bytes_per_sector);
+            divmod_t fat_pos = divmod_const(fat_offset, &fs->bytes_per_sector_div);
+            uint32_t fat_sector = fs->first_fat_sector + fat_pos.div;
             uint8_t *buf = (uint8_t *)kmalloc(512);
             int br_ret = block_read(fs->b.parent, buf, 512, fat_sector);
             if(br_ret < 0) {
-                uart_printf("FAT: block_read returned %i\n");
+                uart_printf("FAT: block_read returned %i\n", br_ret);
                 return 0x0ffffff7;
             }
-            uint32_t fat_index = divmod(fat_offset, fs->bytes_per_sector).mod;
+            uint32_t fat_index = fat_pos.mod;
             uint32_t next_cluster = *(uint32_t *)&buf[fat_index];
             kfree(buf);
             return next_cluster & 0x0fffffff; // FAT32 is actually FAT28
@@ -491,7 +496,7 @@ struct dirent *fat_read_dir(struct fat_fs *fs, struct dirent *d) {
         } else cur_cluster = get_next_fat_entry(fat, cur_cluster);
 
 #ifdef FAT_DEBUG
-        uart_printf("FAT: read dir: next cluster %x\n", cur_cluster);
+        uart_printf("FAT: read dir: next cluster %#x\n", cur_cluster);
 #endif
     } while(cur_cluster < 0x0ffffff7);
 
@@ -2,6 +2,7 @@
 #include <kernel/gpu.h>
 #include <kernel/mem.h>
 #include <kernel/mailbox.h>
+#include <kernel/mmu.h>
 #include <common/main.h>
 
 typedef struct {
@@ -15,9 +16,9 @@ typedef struct {
     uint32_t ignorey;
     void * pointer;
     uint32_t size;
-} fb_init_t;
+} __attribute__((aligned(CACHE_LINE_SIZE))) fb_init_t;
 
-fb_init_t fbinit __attribute__((aligned(16)));
+fb_init_t fbinit __attribute__((aligned(CACHE_LINE_SIZE)));
 
 int framebuffer_init(void) {
     mail_message_t msg;
@@ -30,8 +31,11 @@ int framebuffer_init(void) {
 
     msg.data = ((uint32_t)&fbinit + 0x40000000) >> 4;
 
+    // The GPU reads and writes the request behind the data cache
+    dcache_clean_invalidate_range(&fbinit, sizeof(fb_init_t));
     mailbox_send(msg, FRAMEBUFFER_CHANNEL);
     msg = mailbox_read(FRAMEBUFFER_CHANNEL);
+    dcache_invalidate_range(&fbinit, sizeof(fb_init_t));
 
     if (!msg.data)
         return -1;
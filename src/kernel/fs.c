@@ -23,6 +23,7 @@
 #include <kernel/block.h>
 #include <kernel/vfs.h>
 #include <kernel/mem.h>
+#include <kernel/prof.h>
 #include <common/stdlib.h>
 
 // Features
@@ -30,7 +31,9 @@
 #define ENABLE_FAT 1
 
 // Space for 32 x 512 byte cache areas
+#ifndef BLOCK_CACHE_SIZE
 #define BLOCK_CACHE_SIZE	0x4000
+#endif
 
 #ifdef ENABLE_SD
 int sd_card_init(struct block_device **dev);
@@ -44,7 +47,10 @@ int fat_init(struct block_device *, struct fs **);
 
 struct block_device * libfs_init() {
     struct block_device *sd_dev = NULL;
-	sd_card_init(&sd_dev);
+	if(sd_card_init(&sd_dev) == 0) {
+        block_queue_start(sd_dev);
+        block_cache_init(sd_dev, BLOCK_CACHE_SIZE);
+    }
     return sd_dev;
 }
 
@@ -105,16 +111,20 @@ int fs_interpret_mode(const char *mode) {
  * fs_fread fills in as many of the parameters of get_next_block_num as it can
  */
 
-uint64_t fs_fread(uint32_t (*get_next_bdev_block_num)(uint32_t f_block_idx, FILE *s, void *opaque, int add_blocks),
+PROF_DEFINE(fs_fread_probe, "fs_fread");
+
+static uint64_t fs_fread_blocks(uint32_t (*get_next_bdev_block_num)(uint32_t f_block_idx, FILE *s, void *opaque, int add_blocks),
                 struct fs *fs, void *ptr, uint64_t byte_size, FILE *stream, void *opaque) {
     uint32_t fs_block_size = fs->block_size;
 
     // Determine first and last block indices within file
-    uint32_t first_f_block_idx = div(stream->pos, fs_block_size);
-    uint32_t first_f_block_offset = divmod(stream->pos, fs_block_size).mod;
+    divmod_t first_f_block = divmod_const(stream->pos, &fs->block_size_div);
+    uint32_t first_f_block_idx = first_f_block.div;
+    uint32_t first_f_block_offset = first_f_block.mod;
     uint32_t last_pos = stream->pos + byte_size;
-    uint32_t last_f_block_idx = div(last_pos, fs_block_size);
-    uint32_t last_f_block_offset = divmod(last_pos, fs_block_size).mod;
+    divmod_t last_f_block = divmod_const(last_pos, &fs->block_size_div);
+    uint32_t last_f_block_idx = last_f_block.div;
+    uint32_t last_f_block_offset = last_f_block.mod;
 
     // Now iterate through the blocks
     uint32_t cur_block = first_f_block_idx;
@@ -176,6 +186,15 @@ uint64_t fs_fread(uint32_t (*get_next_bdev_block_num)(uint32_t f_block_idx, FILE
     return total_bytes_read;
 }
 
+uint64_t fs_fread(uint32_t (*get_next_bdev_block_num)(uint32_t f_block_idx, FILE *s, void *opaque, int add_blocks),
+                struct fs *fs, void *ptr, uint64_t byte_size, FILE *stream, void *opaque) {
+    uint64_t ret;
+    PROF_BEGIN(fs_fread_probe);
+    ret = fs_fread_blocks(get_next_bdev_block_num, fs, ptr, byte_size, stream, opaque);
+    PROF_END(fs_fread_probe);
+    return ret;
+}
+
 uint64_t fs_fwrite(uint32_t (*get_next_bdev_block_num)(uint32_t f_block_idx, FILE *s, void *opaque, int add_blocks),
                  struct fs *fs, void *ptr, uint64_t byte_size, FILE *stream, void *opaque) {
     uint32_t fs_block_size = fs->block_size;
@@ -185,16 +204,20 @@ uint64_t fs_fwrite(uint32_t (*get_next_bdev_block_num)(uint32_t f_block_idx, FIL
         stream->pos = stream->len;
 
     // Determine first and last block indices within file
-    uint32_t first_f_block_idx = div(stream->pos, fs_block_size);
-    uint32_t first_f_block_offset = divmod(stream->pos, fs_block_size).mod;
+    divmod_t first_f_block = divmod_const(stream->pos, &fs->block_size_div);
+    uint32_t first_f_block_idx = first_f_block.div;
+    uint32_t first_f_block_offset = first_f_block.mod;
     uint32_t last_pos = stream->pos + byte_size;
-    uint32_t last_f_block_idx = div(last_pos, fs_block_size);
-    uint32_t last_f_block_offset = divmod(last_pos, fs_block_size).mod;
+    divmod_t last_f_block = divmod_const(last_pos, &fs->block_size_div);
+    uint32_t last_f_block_idx = last_f_block.div;
+    uint32_t last_f_block_offset = last_f_block.mod;
 
     // Now iterate through the blocks
     uint32_t cur_block = first_f_block_idx;
     uint8_t *save_buf = (uint8_t *)ptr;
     int total_bytes_written = 0;
+    uint32_t bdev_blocks_per_f_block = div(fs_block_size, fs->parent->block_size);
+    uint32_t next_bdev_block = 0xffffffff;
 
     while(cur_block <= last_f_block_idx) {
         uint32_t start_block_offset = 0;
@@ -209,22 +232,36 @@ uint64_t fs_fwrite(uint32_t (*get_next_bdev_block_num)(uint32_t f_block_idx, FIL
 
         uint32_t block_segment_length = last_block_offset - start_block_offset;
 
-        // Get the filesystem block number
-        uint32_t cur_bdev_block = get_next_bdev_block_num(cur_block, stream, opaque, 1);
+        // Get the filesystem block number, it may have been looked up already while collecting a run
+        uint32_t cur_bdev_block = next_bdev_block;
+        next_bdev_block = 0xffffffff;
+        if(cur_bdev_block == 0xffffffff)
+            cur_bdev_block = get_next_bdev_block_num(cur_block, stream, opaque, 1);
         if(cur_bdev_block == 0xffffffff)
             return total_bytes_written;
 
         // If we can save an entire block, save it directly, else we have
         //  to load to a buffer somewhere, edit, and save
         if((start_block_offset == 0) && (block_segment_length == fs_block_size)) {
-            uint64_t bytes_written = block_write(fs->parent, save_buf, fs_block_size, cur_bdev_block);
+            // The following whole blocks go with the same multi block write while they are contiguous on the device
+            uint32_t run = 1;
+            while((cur_block + run < last_f_block_idx) && ((run + 1) * fs_block_size <= BLOCK_MERGE_MAX)) {
+                next_bdev_block = get_next_bdev_block_num(cur_block + run, stream, opaque, 1);
+                if(next_bdev_block != cur_bdev_block + run * bdev_blocks_per_f_block)
+                    break;
+                next_bdev_block = 0xffffffff;
+                run++;
+            }
+
+            uint64_t bytes_written = block_write(fs->parent, save_buf, run * fs_block_size, cur_bdev_block);
+            if(bytes_written != run * fs_block_size)
+                return total_bytes_written;
             total_bytes_written += bytes_written;
             stream->pos += bytes_written;
             if(stream->pos > stream->len)
                 stream->len = stream->pos;
             save_buf += bytes_written;
-            if(bytes_written != fs_block_size)
-                return total_bytes_written;
+            cur_block += run - 1;
         } else {
             // We have to load to a temporary buffer
             uint8_t *temp_buf = (uint8_t *)kmalloc(fs_block_size);
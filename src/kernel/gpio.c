@@ -7,6 +7,8 @@
 #include <kernel/timer.h>
 #include <kernel/mutex.h>
 #include <kernel/rand.h>
+#include <kernel/trace.h>
+#include <kernel/workqueue.h>
 #include <common/stdlib.h>
 
 uint8_t numGPIOInterrupts = 0;
@@ -14,7 +16,7 @@ uint32_t interruptsReceived = 0;
 uint32_t launchThreads = 0x00000000;
 gpio_handler gpioHandler[GPIO_NUM_HANDLERS];
 uint32_t pwm_ctl = 0;
-mutex_t * gpioMutex[GPIO_NUM_HANDLERS];
+mutex_t gpioMutex[GPIO_NUM_HANDLERS];
 
 #define CLK_BASE 0x5a000000
 
@@ -22,7 +24,7 @@ void init_gpio() {
     // First interrupt binding to -1
     for (uint8_t i = 0; i < GPIO_NUM_HANDLERS; i++) {
         gpioHandler[i] = 0;
-        mutex_init(gpioMutex[i]);
+        mutex_init(&gpioMutex[i]);
     }
     *(volatile uint32_t*)CM_PWMCTL = CLK_BASE | ~0x10; // Turn off enable flag.
     while(*(volatile uint32_t*)CM_PWMCTL & 0x80); // Wait for busy flag to turn off.
@@ -110,20 +112,25 @@ void gpio_set_pull(uint8_t gpio, uint8_t v) {
 }
 
 /**
- * The handler for all GPIO Events
+ * Runs the callback of a GPIO on a work queue thread. The mutex keeps two edges of one pin from running its
+ * callback on two workers at once
+ * @param gpio The GPIO number
+ */
+static void gpio_work(uint32_t gpio) {
+    mutex_lock(&gpioMutex[gpio]);
+    gpioHandler[gpio]();
+    mutex_unlock(&gpioMutex[gpio]);
+}
+
+/**
+ * The handler for all GPIO Events. Callbacks are deferred to the work queue threads
  */
 static void gpio_irq_handler(void) {
+    trace_event(TRACE_GPIO_IRQ, interruptsReceived, 0);
     for (uint8_t gpio = 0; gpio < GPIO_NUM_HANDLERS; ++gpio) {
         if (interruptsReceived & (1 << gpio)) {
-            if (gpioHandler[gpio]) {
-                mutex_lock(gpioMutex[gpio]);
-                //char * gpioName = "GPIO***";
-                //divmod_t div = divmod(prandChar(), 1000);
-                //memcpy((gpioName + 4), itoa(div.mod, 10), 3);
-                //create_kernel_thread(gpioHandler[gpio], gpioName, strlen(gpioName));
-                gpioHandler[gpio]();
-                mutex_unlock(gpioMutex[gpio]);
-            }
+            if (gpioHandler[gpio] && work_queue(gpio_work, gpio) != 0)
+                uart_puts("GPIO: work queue full, edge dropped\n");
             interruptsReceived &= ~(1 << gpio);
         }
     }
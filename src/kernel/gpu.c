@@ -4,6 +4,7 @@
 #include <kernel/kerio.h>
 #include <kernel/mailbox.h>
 #include <kernel/chars_pixels.h>
+#include <kernel/prof.h>
 #include <common/stdlib.h>
 
 
@@ -13,6 +14,8 @@ void write_pixel(uint32_t x, uint32_t y, const pixel_t * pix) {
     memcpy(location, (void *)pix, BYTES_PER_PIXEL);
 }
 
+PROF_DEFINE(gpu_putc_probe, "gpu_putc");
+
 void gpu_putc(char c) {
     static const pixel_t WHITE = {0xff, 0xff, 0xff};
     static const pixel_t BLACK = {0x00, 0x00, 0x00};
@@ -20,6 +23,7 @@ void gpu_putc(char c) {
     uint8_t mask;
     const uint8_t * bmp = font(c);
     uint32_t i, num_rows = fbinfo.height/CHAR_HEIGHT;
+    PROF_BEGIN(gpu_putc_probe);
 
     // shift everything up one row
     if (fbinfo.chars_y >= num_rows) {
@@ -34,6 +38,7 @@ void gpu_putc(char c) {
     if (c == '\n') {
         fbinfo.chars_x = 0;
         fbinfo.chars_y++;
+        PROF_END(gpu_putc_probe);
         return;
     }
 
@@ -52,6 +57,18 @@ void gpu_putc(char c) {
         fbinfo.chars_x = 0;
         fbinfo.chars_y++;
     }
+    PROF_END(gpu_putc_probe);
+}
+
+/**
+ * Draws a buffer of characters
+ * @param buf The characters to draw
+ * @param len Number of characters
+ */
+void gpu_write(const char * buf, uint32_t len) {
+    uint32_t i;
+    for (i = 0; i < len; i++)
+        gpu_putc(buf[i]);
 }
 
 void gpu_init(void) {
@@ -1,69 +1,201 @@
 #include <kernel/interrupts.h>
 #include <kernel/kerio.h>
 #include <kernel/uart.h>
+#include <kernel/trace.h>
+#include <kernel/sampler.h>
+#include <kernel/pmu.h>
+#include <kernel/mmu.h>
 #include <common/stdlib.h>
 
 static interrupt_registers_t * interrupt_regs;
 
 static interrupt_handler_f handlers[NUM_IRQS];
 static interrupt_clearer_f clearers[NUM_IRQS];
+static irq_stats_t irq_stat_table[NUM_IRQS];
+// Sources with a handler: GPU pending 1, GPU pending 2 and basic pending bits
+static uint32_t registered[3];
+static uint32_t spurious = 0;
+
+// Sources serviced per interrupt entry, more stay pending and raise the interrupt again
+#define IRQ_BATCH_MAX 16
 
 extern void move_exception_vector(void);
+extern void fiq_setup(const uint32_t * banked, void * stack_top);
 extern uint32_t exception_vector;
 
+// move_exception_vector copies the vector together with the handler addresses it loads, the FIQ one is last
+#define FIQ_VECTOR_SLOT ((volatile uint32_t *)0x38)
+
+static uint8_t fiq_stack[FIQ_STACK_SIZE] __attribute__ ((aligned (8)));
+
 void interrupts_init(void) {
     interrupt_regs = (interrupt_registers_t *)INTERRUPTS_PENDING;
 	bzero(handlers, sizeof(interrupt_handler_f) * NUM_IRQS);
 	bzero(clearers, sizeof(interrupt_clearer_f) * NUM_IRQS);
+	bzero(irq_stat_table, sizeof(irq_stat_table));
+	bzero(registered, sizeof(registered));
 	interrupt_regs->irq_basic_disable = 0xffffffff; // disable all interrupts
 	interrupt_regs->irq_gpu_disable1 = 0xffffffff;
 	interrupt_regs->irq_gpu_disable2 = 0xffffffff;
     move_exception_vector();
+    // The caches are already on, the vector has to reach memory before instructions are fetched from it
+    dcache_clean_range((void *)0, 0x40);
+    icache_invalidate();
+    // No source is routed to FIQ yet, unmasking it now lets every thread inherit an unmasked FIQ
+    interrupt_regs->fiq_control = 0;
+    fiq_setup(NULL, fiq_stack + FIQ_STACK_SIZE);
+    __asm__ __volatile__("cpsie f");
     ENABLE_INTERRUPTS();
 }
 
 /**
- * this function is going to be called by the processor.  Needs to check pending interrupts and execute handlers if one is registered
+ * this function is going to be called by the processor. Reads the three pending registers once and services
+ * every pending source with a handler in one go: first all clearers with interrupts disabled, then the handlers
+ * with interrupts enabled. Sources go from the highest IRQ number down, so the scheduler tick, whose handler
+ * may switch threads, comes after the others
+ * @param interrupted_pc The address execution continues at after the interrupt
  */
-void irq_handler(void) {
-    int j; 
-	for (j = 0; j < NUM_IRQS; j++) {
-        // If the interrupt is pending and there is a handler, run the handler
-        if (IRQ_IS_PENDING(interrupt_regs, j)  && (handlers[j] != 0)) {
-			clearers[j]();
-			ENABLE_INTERRUPTS();
-			handlers[j]();
-			DISABLE_INTERRUPTS();
-			return;
+void irq_handler(uint32_t interrupted_pc) {
+    uint32_t pending[3], bits, elapsed;
+    int word, j, count = 0;
+    uint8_t irqs[IRQ_BATCH_MAX];
+    uint32_t starts[IRQ_BATCH_MAX];
+
+    pending[2] = interrupt_regs->irq_basic_pending & IRQ_BASIC_MASK;
+    pending[1] = interrupt_regs->irq_gpu_pending2;
+    pending[0] = interrupt_regs->irq_gpu_pending1;
+
+    // Counted once per entry, however many sources without a handler are pending
+    if ((pending[0] & ~registered[0]) | (pending[1] & ~registered[1]) | (pending[2] & ~registered[2]))
+        spurious++;
+
+    for (word = 2; word >= 0; word--) {
+        bits = pending[word] & registered[word];
+        while (bits && count < IRQ_BATCH_MAX) {
+            j = 31 - __builtin_clz(bits);
+            bits &= ~(1u << j);
+            j += word << 5;
+
+            trace_event(TRACE_IRQ, j, 0);
+            if (j == SYSTEM_TIMER_1)
+                sampler_record(interrupted_pc);
+            starts[count] = pmu_cycles();
+            clearers[j]();
+            irqs[count++] = j;
         }
     }
+    if (count == 0)
+        return;
+
+    ENABLE_INTERRUPTS();
+    for (j = 0; j < count; j++) {
+        // An earlier handler may have unregistered it
+        if (handlers[irqs[j]] != 0)
+            handlers[irqs[j]]();
+        elapsed = pmu_cycles() - starts[j];
+        irq_stat_table[irqs[j]].count++;
+        irq_stat_table[irqs[j]].total_cycles += elapsed;
+        if (elapsed > irq_stat_table[irqs[j]].max_cycles)
+            irq_stat_table[irqs[j]].max_cycles = elapsed;
+    }
+    DISABLE_INTERRUPTS();
+}
+
+/**
+ * @param irq_num The IRQ
+ * @param stats Receives how often the IRQ was serviced and how long that took
+ */
+void irq_stats(irq_number_t irq_num, irq_stats_t * stats) {
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    *stats = irq_stat_table[irq_num];
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * @return Number of interrupt entries that found a pending IRQ without a handler
+ */
+uint32_t irq_spurious_count(void) {
+    return spurious;
+}
+
+/**
+ * Prints count, average and maximum cycles of every IRQ that was serviced
+ */
+void irq_report(void) {
+    irq_stats_t stat;
+    int j;
+
+    for (j = 0; j < NUM_IRQS; j++) {
+        irq_stats(j, &stat);
+        if (stat.count == 0)
+            continue;
+        uart_printf("IRQ %d: %u times, avg %u max %u cycles\n", j, stat.count,
+                (uint32_t)divmod64(stat.total_cycles, stat.count).div, stat.max_cycles);
+    }
+    uart_printf("IRQ spurious: %u\n", spurious);
 }
 
 void __attribute__ ((interrupt ("ABORT"))) reset_handler(void) {
+    uart_panic_mode();
     uart_printf("RESET HANDLER\n");
     while(1);
 }
 void __attribute__ ((interrupt ("ABORT"))) prefetch_abort_handler(void) {
+    uart_panic_mode();
     uart_printf("PREFETCH ABORT HANDLER\n");
     while(1);
 }
 void __attribute__ ((interrupt ("ABORT"))) data_abort_handler(void) {
+    uart_panic_mode();
     uart_printf("DATA ABORT HANDLER\n");
     while(1);
 }
 void __attribute__ ((interrupt ("UNDEF"))) undefined_instruction_handler(void) {
+    uart_panic_mode();
     uart_printf("UNDEFINED INSTRUCTION HANDLER\n");
     while(1);
 }
 void __attribute__ ((interrupt ("SWI"))) software_interrupt_handler(void) {
+    uart_panic_mode();
     uart_printf("SWI HANDLER\n");
     while(1);
 }
 void __attribute__ ((interrupt ("FIQ"))) fast_irq_handler(void) {
+    uart_panic_mode();
     uart_printf("FIQ HANDLER\n");
     while(1);
 }
 
+/**
+ * Routes one interrupt source to FIQ and enters handler directly from the vector.
+ * The FIQ is not masked by DISABLE_INTERRUPTS, so the handler must not touch anything the kernel protects that way.
+ * The source must not be registered as an IRQ at the same time
+ * @param irq_num The source, one of the IRQ numbers
+ * @param handler Entered in FIQ mode, see fiq_handler_f
+ * @param banked Initial values of the FIQ mode registers r8 to r12, or NULL
+ */
+void register_fiq_handler(irq_number_t irq_num, fiq_handler_f handler, const uint32_t * banked) {
+    if (irq_num >= NUM_IRQS) {
+        uart_printf("ERROR: CANNOT REGISTER FIQ HANDLER: INVALID IRQ NUMBER: %d\n", irq_num);
+        return;
+    }
+    interrupt_regs->fiq_control = 0;
+    fiq_setup(banked, fiq_stack + FIQ_STACK_SIZE);
+    *FIQ_VECTOR_SLOT = (uint32_t)handler;
+    interrupt_regs->fiq_control = FIQ_CONTROL_ENABLE | irq_num;
+}
+
+/**
+ * Stops routing the source to FIQ and puts the default handler back
+ */
+void unregister_fiq_handler(void) {
+    interrupt_regs->fiq_control = 0;
+    *FIQ_VECTOR_SLOT = (uint32_t)fast_irq_handler;
+}
+
 
 
 
@@ -74,18 +206,24 @@ void register_irq_handler(irq_number_t irq_num, interrupt_handler_f handler, int
         handlers[irq_num] = handler;
 		clearers[irq_num] = clearer;
         interrupt_regs->irq_basic_enable |= (1 << irq_pos);
+        if (handler != 0)
+            registered[2] |= 1 << irq_pos;
     }
     else if (IRQ_IS_GPU2(irq_num)) {
         irq_pos = irq_num - 32;
         handlers[irq_num] = handler;
 		clearers[irq_num] = clearer;
         interrupt_regs->irq_gpu_enable2 |= (1 << irq_pos);
+        if (handler != 0)
+            registered[1] |= 1 << irq_pos;
     }
     else if (IRQ_IS_GPU1(irq_num)) {
         irq_pos = irq_num;
         handlers[irq_num] = handler;
 		clearers[irq_num] = clearer;
         interrupt_regs->irq_gpu_enable1 |= (1 << irq_pos);
+        if (handler != 0)
+            registered[0] |= 1 << irq_pos;
     }
     else {
         uart_printf("ERROR: CANNOT REGISTER IRQ HANDLER: INVALID IRQ NUMBER: %d\n", irq_num);
@@ -98,18 +236,21 @@ void unregister_irq_handler(irq_number_t irq_num) {
         handlers[irq_num] = 0;
         clearers[irq_num] = 0;
         // Setting the disable bit clears the enabled bit
+        registered[2] &= ~(1 << irq_pos);
         interrupt_regs->irq_basic_disable |= (1 << irq_pos);
     }
     else if (IRQ_IS_GPU2(irq_num)) {
         irq_pos = irq_num - 32;
         handlers[irq_num] = 0;
         clearers[irq_num] = 0;
+        registered[1] &= ~(1 << irq_pos);
         interrupt_regs->irq_gpu_disable2 |= (1 << irq_pos);
     }
     else if (IRQ_IS_GPU1(irq_num)) {
         irq_pos = irq_num;
         handlers[irq_num] = 0;
         clearers[irq_num] = 0;
+        registered[0] &= ~(1 << irq_pos);
         interrupt_regs->irq_gpu_disable1 |= (1 << irq_pos);
     }
     else {
@@ -1,6 +1,7 @@
 #include <kernel/uart.h>
 #include <kernel/kerio.h>
 #include <kernel/gpu.h>
+#include <kernel/mem.h>
 #include <common/stdlib.h>
 #include <stdarg.h>
 
@@ -13,9 +14,7 @@ void putc(char c) {
 }
 
 void puts(const char * str) {
-    int i;
-    for (i = 0; str[i] != '\0'; i ++)
-        putc(str[i]);
+    gpu_write(str, strlen(str));
 }
 
 void gets(char * buf, int buflen) {
@@ -37,26 +36,8 @@ void gets(char * buf, int buflen) {
 
 void printf(const char * fmt, ...) {
     va_list args;
-    va_start(args, fmt);
-
-    for (; *fmt != '\0'; fmt++) {
-        if (*fmt == '%') {
-            switch (*(++fmt)) {
-                case '%':
-                    putc('%');
-                    break;
-                case 'd':
-                    puts(itoa(va_arg(args, int), 10));
-                    break;
-                case 'x':
-                    puts(itoa(va_arg(args, int), 16));
-                    break;
-                case 's':
-                    puts(va_arg(args, char *));
-                    break;
-            }
-        } else putc(*fmt);
-    }
 
+    va_start(args, fmt);
+    vprintf_to(gpu_write, fmt, args);
     va_end(args);
 }
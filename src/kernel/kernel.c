@@ -2,15 +2,21 @@
 #include <stdint.h>
 #include <kernel/uart.h>
 #include <kernel/mem.h>
+#include <kernel/mmu.h>
+#include <kernel/pmu.h>
 #include <kernel/atag.h>
 #include <kernel/kerio.h>
 #include <kernel/gpu.h>
 #include <kernel/interrupts.h>
 #include <kernel/timer.h>
 #include <kernel/process.h>
+#include <kernel/workqueue.h>
 #include <kernel/mutex.h>
 #include <kernel/uart.h>
 #include <common/stdlib.h>
+#ifdef KERNEL_BENCH
+#include <kernel/bench.h>
+#endif
 #include <common/main.h>
 
 
@@ -33,18 +39,29 @@ void kernel_main(uint32_t r0, uint32_t r1, uint32_t atags) {
     (void) r1;
     (void) atags;
 
+    mmu_init();
+    pmu_init(PMU_EVENT_DCACHE_MISS, PMU_EVENT_BRANCH_MISPREDICT);
     mem_init((atag_t *)atags);
     gpu_init();
     uart_puts("GPU INITIALIZED . ");
+#ifdef KERNEL_BENCH
+    bench_caches();
+#endif
 
     uart_puts("INTERRUPTS");
     interrupts_init();
     uart_puts(". ");
+    uart_puts("UART ");
+    uart_irq_init(UART_TX_BUFFER_SIZE, UART_RX_BUFFER_SIZE, UART_FIFO_1_4, UART_FIFO_1_2);
+    uart_puts(". ");
     uart_puts("TIMER ");
     timer_init();
     uart_puts(". ");
     uart_puts("SCHEDULER ");
     process_init();
+    uart_puts(". ");
+    uart_puts("WORKQUEUE ");
+    workqueue_init();
     uart_puts(".\n");
 
     uart_puts("Running setup...");
@@ -53,6 +70,6 @@ void kernel_main(uint32_t r0, uint32_t r1, uint32_t atags) {
     uart_printf("Kernel booted in %dms\n", uuptime() / 1000);
 
     main_loop();
-    //create_kernel_thread(main_loop, "MAIN", 4);
-    //create_kernel_thread(rt_loop, "RTLOOP", 6);
+    //create_kernel_thread(main_loop, "MAIN", 4, PRIORITY_DEFAULT);
+    //create_kernel_thread(rt_loop, "RTLOOP", 6, PRIORITY_HIGHEST);
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include <kernel/latency.h>
+#include <kernel/interrupts.h>
+#include <common/stdlib.h>
+
+/**
+ * Samples come from threads and IRQ handlers alike, so updates and copies run with interrupts disabled
+ */
+
+void latency_init(latency_stats_t * stats) {
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    stats->total = 0;
+    stats->count = 0;
+    stats->min = 0xffffffff;
+    stats->max = 0;
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+void latency_record(latency_stats_t * stats, uint32_t sample) {
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    stats->total += sample;
+    stats->count++;
+    if (sample < stats->min)
+        stats->min = sample;
+    if (sample > stats->max)
+        stats->max = sample;
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Copies statistics that may be recorded into meanwhile, all fields from the same moment.
+ * The FIQ is masked too, the motor FIQ handler records its own
+ */
+void latency_get(const latency_stats_t * stats, latency_stats_t * copy) {
+    uint32_t cpsr = DISABLE_IRQ_FIQ();
+
+    *copy = *stats;
+    RESTORE_IRQ_FIQ(cpsr);
+}
+
+/**
+ * @return The average sample, 0 without samples
+ */
+uint32_t latency_avg(const latency_stats_t * stats) {
+    return stats->count ? (uint32_t)divmod64(stats->total, stats->count).div : 0;
+}
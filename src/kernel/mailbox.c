@@ -1,5 +1,6 @@
 #include <kernel/mailbox.h>
 #include <kernel/mem.h>
+#include <kernel/mmu.h>
 #include <common/stdlib.h>
 mail_message_t mailbox_read(int channel) {
     mail_status_t stat;
@@ -92,8 +93,11 @@ int send_messages(property_message_tag_t * tags) {
     // Send the message
     mail.data = ((uint32_t)msg) >>4;
     
+    // The GPU reads and writes the buffer behind the data cache
+    dcache_clean_invalidate_range(msg, bufsize);
     mailbox_send(mail, PROPERTY_CHANNEL);
     mail = mailbox_read(PROPERTY_CHANNEL);
+    dcache_invalidate_range(msg, bufsize);
 
 
     if (msg->req_res_code == REQUEST) {
@@ -1,5 +1,8 @@
 #include <kernel/mem.h>
 #include <kernel/atag.h>
+#include <kernel/trace.h>
+#include <kernel/prof.h>
+#include <kernel/interrupts.h>
 #include <common/stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -8,6 +11,7 @@
  * Heap Stuff
  */
 static void heap_init(uint32_t heap_start);
+static void * heap_alloc(uint32_t bytes);
 /**
  * implement kmalloc as a linked list of allocated segments.
  * Segments should be 4 byte aligned.
@@ -25,19 +29,100 @@ static heap_segment_t * heap_segment_list_head;
  * End Heap Stuff
  */
 
+/**
+ * Slab Stuff
+ */
+/**
+ * Small allocations are served from power-of-two size classes (16 .. 2048 bytes).
+ * Each class keeps a free list of objects carved out of whole pages taken from alloc_page,
+ * so allocating and freeing is a list pop/push instead of a scan over the heap segments.
+ * Pages backing a class are tagged in their page metadata, which is how kfree tells slab
+ * objects apart from heap segments.
+ */
+#define SLAB_MIN_SHIFT 4
+#define SLAB_NUM_CLASSES 8
+#define SLAB_MAX_SIZE (1 << (SLAB_MIN_SHIFT + SLAB_NUM_CLASSES - 1))
+
+typedef struct slab_object {
+    struct slab_object * next;
+} slab_object_t;
+
+typedef struct {
+    slab_object_t * free_list;
+    uint32_t object_size;
+} slab_cache_t;
+static slab_cache_t slab_caches[SLAB_NUM_CLASSES];
+
+static void slab_init(void);
+static void * slab_alloc(uint32_t bytes);
+static void slab_free(page_t * page, void * ptr);
+
+/**
+ * End Slab Stuff
+ */
+
 
 extern uint8_t __end;
 static uint32_t num_pages;
 
-IMPLEMENT_LIST(page);
-
 static page_t * all_pages_array;
-page_list_t free_pages;
 
+/**
+ * Buddy Stuff
+ */
+/**
+ * Free pages are kept in blocks of 2^order pages, one free list per order.
+ * A block of order n always starts at a page index that is a multiple of 2^n, so the buddy of a
+ * block is found by flipping bit n of its index. Only the first page of a free block is linked into
+ * a free list and carries the buddy_head flag and the order of the block.
+ */
+static page_t * free_areas[PAGE_MAX_ORDER + 1];
+static uint32_t free_area_sizes[PAGE_MAX_ORDER + 1];
+
+static void free_area_push(uint32_t order, page_t * page) {
+    page->flags.buddy_head = 1;
+    page->flags.order = order;
+    page->prevpage = NULL;
+    page->nextpage = free_areas[order];
+    if (free_areas[order] != NULL)
+        free_areas[order]->prevpage = page;
+    free_areas[order] = page;
+    free_area_sizes[order]++;
+}
+
+static void free_area_remove(uint32_t order, page_t * page) {
+    if (page->prevpage != NULL)
+        page->prevpage->nextpage = page->nextpage;
+    else
+        free_areas[order] = page->nextpage;
+    if (page->nextpage != NULL)
+        page->nextpage->prevpage = page->prevpage;
+    page->flags.buddy_head = 0;
+    free_area_sizes[order]--;
+}
+
+/**
+ * End Buddy Stuff
+ */
+
+/**
+ * Zero Pool Stuff
+ */
+/**
+ * alloc_page hands out zeroed pages. Zeroing is done ahead of time by zero_pool_refill, which the scheduler runs
+ * when the CPU has nothing better to do. The pool is a stack of allocated pages linked through their metadata.
+ * If it is empty, the page is zeroed on demand.
+ */
+static page_t * zero_pool;
+static zero_pool_stats_t zero_pool_counters;
+
+/**
+ * End Zero Pool Stuff
+ */
 
 
 void mem_init(atag_t * atags) {
-    uint32_t mem_size, page_array_len, kernel_pages, page_array_end, i;
+    uint32_t mem_size, page_array_len, kernel_pages, page_array_end, i, order;
 
     // Get the total number of pages
     mem_size = get_mem_size(atags);
@@ -47,7 +132,10 @@ void mem_init(atag_t * atags) {
     page_array_len = sizeof(page_t) * num_pages;
     all_pages_array = (page_t *)((uint32_t)&__end + KERNEL_STACK_SIZE);
     bzero(all_pages_array, page_array_len);
-    INITIALIZE_LIST(free_pages);
+    bzero(free_areas, sizeof(free_areas));
+    bzero(free_area_sizes, sizeof(free_area_sizes));
+    zero_pool = NULL;
+    bzero(&zero_pool_counters, sizeof(zero_pool_stats_t));
     
     // Find where the page metadata ends and round up to the nearest page
     page_array_end = (uint32_t)all_pages_array + page_array_len;
@@ -67,50 +155,249 @@ void mem_init(atag_t * atags) {
         all_pages_array[i].flags.allocated = 1;
         all_pages_array[i].flags.kernel_heap_page = 1;
     }
-    // Map the rest of the pages as unallocated, and add them to the free list
-    for(; i < num_pages; i++){
-        all_pages_array[i].flags.allocated = 0;
-        append_page_list(&free_pages, &all_pages_array[i]);
+    // Map the rest of the pages as unallocated, and add them to the free lists in the largest aligned blocks possible
+    while (i < num_pages) {
+        order = PAGE_MAX_ORDER;
+        while ((i & ((1 << order) - 1)) || i + (1 << order) > num_pages)
+            order--;
+        free_area_push(order, &all_pages_array[i]);
+        i += 1 << order;
     }
 
     // Initialize the heap
     heap_init(page_array_end);
+    slab_init();
 
 }
 
-void * alloc_page(void) {
+/**
+ * The allocators are used from threads of any priority and from the scheduler, so their lists are only
+ * changed with interrupts disabled
+ */
+static void * buddy_alloc(uint32_t order) {
     page_t * page;
-    void * page_mem;
+    uint32_t current, i;
 
+    if (order > PAGE_MAX_ORDER)
+        return 0;
+
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
 
-    if (size_page_list(&free_pages) == 0)
+    // Find the smallest free block that is large enough
+    for (current = order; current <= PAGE_MAX_ORDER && free_areas[current] == NULL; current++);
+    if (current > PAGE_MAX_ORDER) {
+        if (enabled)
+            ENABLE_INTERRUPTS();
         return 0;
+    }
 
-    // Get a free page
-    page = pop_page_list(&free_pages);
-    page->flags.kernel_page = 1;
-    page->flags.allocated = 1;
+    page = free_areas[current];
+    free_area_remove(current, page);
+
+    // Split the block until it has the requested size, handing the upper halves back
+    while (current > order) {
+        current--;
+        free_area_push(current, page + (1 << current));
+    }
+
+    for (i = 0; i < (1u << order); i++) {
+        page[i].flags.kernel_page = 1;
+        page[i].flags.allocated = 1;
+    }
+    if (enabled)
+        ENABLE_INTERRUPTS();
 
     // Get the address the physical page metadata refers to
-    page_mem = (void *)((page - all_pages_array) * PAGE_SIZE);
+    return (void *)((page - all_pages_array) * PAGE_SIZE);
+}
+
+/**
+ * Takes a page from the zero pool
+ * @return The page, or NULL if the pool is empty
+ */
+static void * zero_pool_pop(void) {
+    page_t * page;
+    int enabled = INTERRUPTS_ENABLED();
 
-    // Zero out the page, big security flaw to not do this :)
-    bzero(page_mem, PAGE_SIZE);
+    DISABLE_INTERRUPTS();
+    page = zero_pool;
+    if (page != NULL) {
+        zero_pool = page->nextpage;
+        zero_pool_counters.size--;
+    }
+    if (enabled)
+        ENABLE_INTERRUPTS();
+    return page != NULL ? (void *)((page - all_pages_array) * PAGE_SIZE) : NULL;
+}
+
+/**
+ * buddy_alloc that counts the pages in the zero pool as free memory: a single page is taken from the pool,
+ * for larger blocks the pool goes back to the buddy lists so its pages can merge again
+ */
+static void * pages_alloc(uint32_t order) {
+    void * page_mem = buddy_alloc(order);
+
+    if (page_mem != NULL || zero_pool == NULL)
+        return page_mem;
+    if (order == 0)
+        return zero_pool_pop();
+    while ((page_mem = zero_pool_pop()) != NULL)
+        free_pages(page_mem, 0);
+    return buddy_alloc(order);
+}
+
+void * alloc_pages(uint32_t order) {
+    void * page_mem = pages_alloc(order);
+
+    // Zero out the pages, big security flaw to not do this :)
+    if (page_mem != NULL)
+        bzero(page_mem, PAGE_SIZE << order);
 
     return page_mem;
 }
 
-void free_page(void * ptr) {
+void free_pages(void * ptr, uint32_t order) {
+    page_t * buddy;
+    uint32_t index, buddy_index, i;
+
+    // Get page metadata index from the physical address
+    index = (uint32_t)ptr / PAGE_SIZE;
+
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+
+    // Mark the pages as free
+    for (i = 0; i < (1u << order); i++)
+        all_pages_array[index + i].flags.allocated = 0;
+
+    // Merge with the buddy as long as it is a free block of the same size
+    while (order < PAGE_MAX_ORDER) {
+        buddy_index = index ^ (1 << order);
+        if (buddy_index + (1 << order) > num_pages)
+            break;
+        buddy = &all_pages_array[buddy_index];
+        if (buddy->flags.allocated || !buddy->flags.buddy_head || buddy->flags.order != order)
+            break;
+        free_area_remove(order, buddy);
+        index &= ~(1 << order);
+        order++;
+    }
+
+    free_area_push(order, &all_pages_array[index]);
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+void * alloc_page(void) {
+    void * page_mem;
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    page_mem = zero_pool_pop();
+    if (page_mem == NULL)
+        zero_pool_counters.misses++;
+    else
+        zero_pool_counters.hits++;
+    if (enabled)
+        ENABLE_INTERRUPTS();
+
+    // Take an already zeroed page if there is one, otherwise zero it now
+    return page_mem != NULL ? page_mem : alloc_pages(0);
+}
+
+void * alloc_page_nozero(void) {
+    return pages_alloc(0);
+}
+
+/**
+ * Zeroes up to max_pages pages into the pool
+ * @return The number of pages added
+ */
+uint32_t zero_pool_refill(uint32_t max_pages) {
     page_t * page;
+    void * page_mem;
+    uint32_t added = 0;
+
+    while (max_pages-- && zero_pool_counters.size < ZERO_POOL_SIZE) {
+        page_mem = buddy_alloc(0);
+        if (page_mem == NULL)
+            break;
+        bzero(page_mem, PAGE_SIZE);
+
+        page = all_pages_array + ((uint32_t)page_mem / PAGE_SIZE);
+        int enabled = INTERRUPTS_ENABLED();
+        DISABLE_INTERRUPTS();
+        page->nextpage = zero_pool;
+        zero_pool = page;
+        zero_pool_counters.size++;
+        if (enabled)
+            ENABLE_INTERRUPTS();
+        added++;
+    }
+    return added;
+}
 
-    // Get page metadata from the physical address
-    page = all_pages_array + ((uint32_t)ptr / PAGE_SIZE);
+void zero_pool_stats(zero_pool_stats_t * stats) {
+    *stats = zero_pool_counters;
+}
+
+void free_page(void * ptr) {
+    free_pages(ptr, 0);
+}
+
+void page_stats(uint32_t free_blocks[PAGE_MAX_ORDER + 1]) {
+    uint32_t order;
+    for (order = 0; order <= PAGE_MAX_ORDER; order++)
+        free_blocks[order] = free_area_sizes[order];
+}
+
+static void slab_init(void) {
+    uint32_t i;
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab_caches[i].free_list = NULL;
+        slab_caches[i].object_size = 1 << (SLAB_MIN_SHIFT + i);
+    }
+}
+
+static void * slab_alloc(uint32_t bytes) {
+    slab_cache_t * cache;
+    slab_object_t * obj;
+    page_t * page;
+    uint8_t * page_mem;
+    uint32_t class, offset;
+
+    // Find the smallest class that fits: ceil(log2(bytes)) - SLAB_MIN_SHIFT
+    class = bytes <= (1 << SLAB_MIN_SHIFT) ? 0 : 32 - __builtin_clz(bytes - 1) - SLAB_MIN_SHIFT;
+    cache = &slab_caches[class];
+
+    // Refill the class with a fresh page if it ran dry
+    if (cache->free_list == NULL) {
+        page_mem = alloc_page_nozero();
+        if (page_mem == NULL)
+            return NULL;
+        page = all_pages_array + ((uint32_t)page_mem / PAGE_SIZE);
+        page->flags.slab_page = 1;
+        page->flags.slab_class = class;
+        for (offset = 0; offset < PAGE_SIZE; offset += cache->object_size) {
+            obj = (slab_object_t *)(page_mem + offset);
+            obj->next = cache->free_list;
+            cache->free_list = obj;
+        }
+    }
 
-    // Mark the page as free
-    page->flags.allocated = 0;
-    append_page_list(&free_pages, page);
+    obj = cache->free_list;
+    cache->free_list = obj->next;
+    return obj;
 }
 
+static void slab_free(page_t * page, void * ptr) {
+    slab_cache_t * cache = &slab_caches[page->flags.slab_class];
+    slab_object_t * obj = ptr;
+
+    obj->next = cache->free_list;
+    cache->free_list = obj;
+}
 
 static void heap_init(uint32_t heap_start) {
    heap_segment_list_head = (heap_segment_t *) heap_start;
@@ -119,7 +406,7 @@ static void heap_init(uint32_t heap_start) {
 }
 
 
-void * kmalloc(uint32_t bytes) {
+static void * heap_alloc(uint32_t bytes) {
     heap_segment_t * curr, *best = NULL;
     int diff, best_diff = 0x7fffffff; // Max signed int
 
@@ -158,12 +445,46 @@ void * kmalloc(uint32_t bytes) {
     return best + 1;
 }
 
+PROF_DEFINE(kmalloc_probe, "kmalloc");
+
+void * kmalloc(uint32_t bytes) {
+    void * obj = NULL;
+    PROF_BEGIN(kmalloc_probe);
+
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+    // Small requests are served by the size classes. Only fall back to the heap if no page is left
+    if (bytes <= SLAB_MAX_SIZE)
+        obj = slab_alloc(bytes);
+    if (obj == NULL)
+        obj = heap_alloc(bytes);
+    if (enabled)
+        ENABLE_INTERRUPTS();
+
+    PROF_END(kmalloc_probe);
+    trace_event(TRACE_KMALLOC, bytes, (uint32_t)obj);
+    return obj;
+}
+
 void kfree(void *ptr) {
     heap_segment_t * seg;
+    page_t * page;
 
     if (!ptr)
         return;
 
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+
+    // Objects living in a slab page go back to their size class
+    page = all_pages_array + ((uint32_t)ptr / PAGE_SIZE);
+    if (page->flags.slab_page) {
+        slab_free(page, ptr);
+        if (enabled)
+            ENABLE_INTERRUPTS();
+        return;
+    }
+
     seg = ptr - sizeof(heap_segment_t);
     seg->is_allocated = 0;
 
@@ -181,4 +502,6 @@ void kfree(void *ptr) {
         seg->segment_size += seg->next->segment_size;
         seg = seg->next;
     }
+    if (enabled)
+        ENABLE_INTERRUPTS();
 }
@@ -0,0 +1,103 @@
+#include <kernel/mmu.h>
+#include <kernel/atomic.h>
+#include <kernel/peripheral.h>
+#include <stdint.h>
+
+/**
+ * The kernel runs identity mapped with 1 MB sections:
+ * RAM below the peripherals is normal write-back cacheable memory, the peripheral window is device memory and
+ * everything above (e.g. the GPU bus aliases handed out for the framebuffer) stays uncached, like before the
+ * MMU was enabled.
+ */
+static uint32_t page_table[MMU_NUM_SECTIONS] __attribute__((aligned(16384)));
+
+static uint32_t read_control_register(void) {
+    uint32_t reg;
+    __asm__ __volatile__("mrc p15, 0, %[reg], c1, c0, 0" : [reg] "=r" (reg));
+    return reg;
+}
+
+// The ISB makes the instructions after it run with the new MMU and cache settings
+static void write_control_register(uint32_t reg) {
+    __asm__ __volatile__("mcr p15, 0, %[reg], c1, c0, 0" :: [reg] "r" (reg) : "memory");
+    isb();
+}
+
+static void invalidate_caches(void) {
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c7, 0" :: [zero] "r" (0) : "memory"); // I and D cache
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c5, 6" :: [zero] "r" (0) : "memory"); // branch target cache
+}
+
+static void clean_invalidate_dcache(void) {
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c14, 0" :: [zero] "r" (0) : "memory");
+    dsb();
+}
+
+void mmu_init(void) {
+    uint32_t section;
+
+    for (section = 0; section < MMU_NUM_SECTIONS; section++) {
+        if (section < PERIPHERAL_BASE / MMU_SECTION_SIZE)
+            page_table[section] = (section * MMU_SECTION_SIZE) | MMU_NORMAL_CACHED;
+        else if (section < (PERIPHERAL_BASE + PERIPHERAL_LENGTH) / MMU_SECTION_SIZE)
+            page_table[section] = (section * MMU_SECTION_SIZE) | MMU_DEVICE;
+        else
+            page_table[section] = (section * MMU_SECTION_SIZE) | MMU_NORMAL_UNCACHED;
+    }
+
+    invalidate_caches();
+    __asm__ __volatile__("mcr p15, 0, %[zero], c8, c7, 0" :: [zero] "r" (0) : "memory");  // Invalidate TLBs
+    dsb();
+
+    __asm__ __volatile__("mcr p15, 0, %[zero], c2, c0, 2" :: [zero] "r" (0));             // Only use TTBR0
+    __asm__ __volatile__("mcr p15, 0, %[ttb], c2, c0, 0" :: [ttb] "r" (page_table));      // Translation table base
+    __asm__ __volatile__("mcr p15, 0, %[dacr], c3, c0, 0" :: [dacr] "r" (1));             // Domain 0: client
+
+    write_control_register(read_control_register() | SCTLR_XP | SCTLR_MMU);
+    caches_enable();
+}
+
+void caches_enable(void) {
+    invalidate_caches();
+    write_control_register(read_control_register() | SCTLR_DCACHE | SCTLR_ICACHE | SCTLR_BRANCH_PREDICT);
+}
+
+void caches_disable(void) {
+    // Write back everything before the data cache stops being looked at
+    clean_invalidate_dcache();
+    write_control_register(read_control_register() & ~(SCTLR_DCACHE | SCTLR_ICACHE | SCTLR_BRANCH_PREDICT));
+    invalidate_caches();
+}
+
+void dcache_clean_range(const void * start, uint32_t len) {
+    uint32_t addr = (uint32_t)start & ~(CACHE_LINE_SIZE - 1);
+    uint32_t end = (uint32_t)start + len;
+
+    for (; addr < end; addr += CACHE_LINE_SIZE)
+        __asm__ __volatile__("mcr p15, 0, %[mva], c7, c10, 1" :: [mva] "r" (addr) : "memory");
+    dsb();
+}
+
+void dcache_invalidate_range(const void * start, uint32_t len) {
+    uint32_t addr = (uint32_t)start & ~(CACHE_LINE_SIZE - 1);
+    uint32_t end = (uint32_t)start + len;
+
+    for (; addr < end; addr += CACHE_LINE_SIZE)
+        __asm__ __volatile__("mcr p15, 0, %[mva], c7, c6, 1" :: [mva] "r" (addr) : "memory");
+    dsb();
+}
+
+void dcache_clean_invalidate_range(const void * start, uint32_t len) {
+    uint32_t addr = (uint32_t)start & ~(CACHE_LINE_SIZE - 1);
+    uint32_t end = (uint32_t)start + len;
+
+    for (; addr < end; addr += CACHE_LINE_SIZE)
+        __asm__ __volatile__("mcr p15, 0, %[mva], c7, c14, 1" :: [mva] "r" (addr) : "memory");
+    dsb();
+}
+
+void icache_invalidate(void) {
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c5, 0" :: [zero] "r" (0) : "memory"); // I cache
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c5, 6" :: [zero] "r" (0) : "memory"); // branch target cache
+    isb();
+}
@@ -0,0 +1,173 @@
+#include <kernel/msgqueue.h>
+#include <kernel/interrupts.h>
+#include <kernel/atomic.h>
+#include <kernel/mem.h>
+#include <kernel/timer.h>
+#include <common/stdlib.h>
+
+/**
+ * Every slot starts with a header. A producer claims the next sequence number with atomic_cas, fills in
+ * the slot and publishes it by storing sequence + 1 into the header. The consumer only reads the slot of
+ * its tail once that value appears, so a thread that was interrupted between reserve and commit holds up
+ * the messages an IRQ handler queued behind it, but they are never read half written.
+ */
+
+typedef struct {
+    volatile uint32_t published;    // Sequence number + 1 once the message may be read
+    uint32_t seq;                   // Sequence number the slot was reserved with
+} msgq_header_t;
+
+static inline msgq_header_t * msgq_slot(msgqueue_t * queue, uint32_t seq) {
+    return (msgq_header_t *)(queue->slots + ((seq & queue->mask) << queue->slot_shift));
+}
+
+/**
+ * Allocates the slots of a queue
+ * @param msg_size Bytes per message
+ * @param capacity Number of messages, rounded up to a power of two
+ * @return 0 on success, -1 if the slots cannot be allocated
+ */
+int msgq_init(msgqueue_t * queue, uint32_t msg_size, uint32_t capacity) {
+    uint32_t slot_size = sizeof(msgq_header_t) + msg_size, i;
+
+    queue->slot_shift = slot_size <= 1 ? 0 : 32 - __builtin_clz(slot_size - 1);
+    capacity = capacity <= 1 ? 1 : 1u << (32 - __builtin_clz(capacity - 1));
+    queue->slots = kmalloc(capacity << queue->slot_shift);
+    if (queue->slots == NULL)
+        return -1;
+    queue->mask = capacity - 1;
+    queue->msg_size = msg_size;
+    queue->reserved = queue->tail = 0;
+    queue->dropped = 0;
+    INITIALIZE_LIST(queue->wait_queue);
+    // No slot may look published for the first round
+    for (i = 0; i < capacity; i++)
+        msgq_slot(queue, i)->published = 0xffffffff;
+    return 0;
+}
+
+/**
+ * Claims the next slot for writing a message in place. Safe from IRQ handlers
+ * @return Where to write the message, or NULL if the queue is full
+ */
+void * msgq_reserve(msgqueue_t * queue) {
+    msgq_header_t * header;
+    uint32_t seq;
+
+    do {
+        seq = queue->reserved;
+        if (seq - queue->tail > queue->mask) {
+            atomic_fetch_add(&queue->dropped, 1);
+            return NULL;
+        }
+    } while (atomic_cas(&queue->reserved, seq, seq + 1) != seq);
+
+    header = msgq_slot(queue, seq);
+    header->seq = seq;
+    return header + 1;
+}
+
+/**
+ * Publishes a message written into a slot from msgq_reserve and wakes the consumer if it waits
+ * @param msg The pointer msgq_reserve returned
+ */
+void msgq_commit(msgqueue_t * queue, void * msg) {
+    msgq_header_t * header = (msgq_header_t *)msg - 1;
+    process_control_block_t * consumer;
+    int enabled;
+
+    atomic_store(&header->published, header->seq + 1);
+
+    if (queue->wait_queue.head == NULL)
+        return;
+    enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+    consumer = wait_queue_pop(&queue->wait_queue);
+    if (consumer != NULL)
+        wake_thread(consumer);
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Copies a message into the queue. Safe from IRQ handlers
+ * @return 0 on success, -1 if the queue is full
+ */
+int msgq_send(msgqueue_t * queue, const void * msg) {
+    void * slot = msgq_reserve(queue);
+    if (slot == NULL)
+        return -1;
+    memcpy(slot, msg, queue->msg_size);
+    msgq_commit(queue, slot);
+    return 0;
+}
+
+static inline int msgq_ready(msgqueue_t * queue) {
+    return msgq_slot(queue, queue->tail)->published == queue->tail + 1;
+}
+
+/**
+ * Waits for the next message and returns it in place. It stays in the queue until msgq_release.
+ * Only the consumer thread may call this
+ * @param timeout_us Microseconds to wait, 0 not to wait or WAIT_FOREVER
+ * @return The message or NULL on timeout
+ */
+void * msgq_receive(msgqueue_t * queue, uint32_t timeout_us) {
+    uint32_t deadline, remaining = WAIT_FOREVER;
+    int enabled;
+
+    if (!msgq_ready(queue)) {
+        if (timeout_us == 0)
+            return NULL;
+        // A wakeup without a message waits again, only for what is left of the timeout
+        deadline = uuptime() + timeout_us;
+        enabled = INTERRUPTS_ENABLED();
+        DISABLE_INTERRUPTS();
+        // Checked again with interrupts off, a commit in between would find no waiter to wake
+        while (!msgq_ready(queue)) {
+            if (timeout_us != WAIT_FOREVER) {
+                remaining = deadline - uuptime();
+                if ((int32_t)remaining <= 0) {
+                    if (enabled)
+                        ENABLE_INTERRUPTS();
+                    return NULL;
+                }
+            }
+            wait_queue_add(&queue->wait_queue, remaining);
+            wait_queue_block();
+            DISABLE_INTERRUPTS();
+        }
+        if (enabled)
+            ENABLE_INTERRUPTS();
+    }
+    dmb();
+    return msgq_slot(queue, queue->tail) + 1;
+}
+
+/**
+ * Frees the slot of the message msgq_receive returned
+ */
+void msgq_release(msgqueue_t * queue) {
+    atomic_store(&queue->tail, queue->tail + 1);
+}
+
+/**
+ * Copies the next message out of the queue
+ * @param timeout_us Microseconds to wait, 0 not to wait or WAIT_FOREVER
+ * @return 0 on success, -1 on timeout
+ */
+int msgq_recv(msgqueue_t * queue, void * msg, uint32_t timeout_us) {
+    void * slot = msgq_receive(queue, timeout_us);
+    if (slot == NULL)
+        return -1;
+    memcpy(msg, slot, queue->msg_size);
+    msgq_release(queue);
+    return 0;
+}
+
+/**
+ * @return Number of messages reserved but not yet released, including those still being written
+ */
+uint32_t msgq_count(msgqueue_t * queue) {
+    return queue->reserved - queue->tail;
+}
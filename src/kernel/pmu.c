@@ -0,0 +1,69 @@
+#include <kernel/pmu.h>
+
+/**
+ * The ARM1176 performance monitor: a 32 bit cycle counter (CCNT) and two 32 bit counters
+ * (PMN0, PMN1) that count a selectable event. All of them run at the core clock, so at 700MHz
+ * the cycle counter wraps after about 6 seconds. Differences of readings are still correct
+ * across one wrap.
+ */
+
+static pmu_event_t selected_event0 = PMU_EVENT_DCACHE_MISS;
+static pmu_event_t selected_event1 = PMU_EVENT_BRANCH_MISPREDICT;
+
+static void pmnc_write(uint32_t pmnc) {
+    __asm__ __volatile__("mcr p15, 0, %[pmnc], c15, c12, 0" :: [pmnc] "r" (pmnc));
+}
+
+/**
+ * Starts all counters from 0
+ * @param event0 What PMN0 counts
+ * @param event1 What PMN1 counts
+ */
+void pmu_init(pmu_event_t event0, pmu_event_t event1) {
+    selected_event0 = event0;
+    selected_event1 = event1;
+    pmu_reset();
+}
+
+/**
+ * Changes the events the configurable counters count and resets them.
+ * The cycle counter keeps running
+ */
+void pmu_select(pmu_event_t event0, pmu_event_t event1) {
+    selected_event0 = event0;
+    selected_event1 = event1;
+    pmnc_write(PMNC_ENABLE | PMNC_RESET_COUNTERS | PMNC_OVERFLOW_FLAGS | PMNC_EVENT0(event0) | PMNC_EVENT1(event1));
+}
+
+/**
+ * Resets all counters and keeps them running
+ */
+void pmu_reset(void) {
+    pmnc_write(PMNC_ENABLE | PMNC_RESET_COUNTERS | PMNC_RESET_CCNT | PMNC_OVERFLOW_FLAGS |
+            PMNC_EVENT0(selected_event0) | PMNC_EVENT1(selected_event1));
+}
+
+pmu_event_t pmu_event0(void) {
+    return selected_event0;
+}
+
+pmu_event_t pmu_event1(void) {
+    return selected_event1;
+}
+
+const char * pmu_event_name(pmu_event_t event) {
+    switch (event) {
+        case PMU_EVENT_ICACHE_MISS: return "icache miss";
+        case PMU_EVENT_ITLB_MISS: return "itlb miss";
+        case PMU_EVENT_DTLB_MISS: return "dtlb miss";
+        case PMU_EVENT_BRANCH: return "branch";
+        case PMU_EVENT_BRANCH_MISPREDICT: return "mispredict";
+        case PMU_EVENT_INSTRUCTION: return "instruction";
+        case PMU_EVENT_DCACHE_ACCESS: return "dcache access";
+        case PMU_EVENT_DCACHE_MISS: return "dcache miss";
+        case PMU_EVENT_DCACHE_WRITEBACK: return "dcache writeback";
+        case PMU_EVENT_MAIN_TLB_MISS: return "tlb miss";
+        case PMU_EVENT_CYCLES: return "cycles";
+    }
+    return "event";
+}
@@ -4,7 +4,10 @@
 #include <kernel/timer.h>
 #include <kernel/spinlock.h>
 #include <kernel/mutex.h>
+#include <kernel/atomic.h>
 #include <kernel/uart.h>
+#include <kernel/trace.h>
+#include <kernel/prof.h>
 #include <common/stdlib.h>
 
 static uint32_t next_proc_num = 1;
@@ -16,93 +19,405 @@ extern int try_lock(int * lock_var);
 
 IMPLEMENT_LIST(pcb);
 
-pcb_list_t run_queue;
-pcb_list_t all_proc_list;
+/**
+ * One run queue per priority plus a bitmap of the non-empty ones, so the next thread is found with a
+ * single CLZ no matter how many threads exist. The running thread is in none of the queues.
+ */
+static pcb_list_t run_queues[PRIORITY_LEVELS];
+static uint32_t ready_bitmap = 0;
+static process_control_block_t * all_procs;
+// Threads that ended, chained through next_proc. Freed once nothing runs on their stack or saves into their pcb
+static process_control_block_t * zombies;
+
+// Sleeping threads sorted by wake_time, the earliest first
+static process_control_block_t * sleep_queue = NULL;
 
 process_control_block_t * current_process;
 
-void schedule(void) {
-    DISABLE_INTERRUPTS();
-    process_control_block_t * new_thread, * old_thread;
+/**
+ * A context switch starts in the old thread and ends in whichever thread is resumed, so the scope
+ * lives here instead of on a stack. Switches into a thread that runs for the first time are not counted
+ */
+PROF_DEFINE(switch_probe, "switch_to_thread");
+static prof_scope_t switch_probe_scope;
+
+/**
+ * Tickless operation: the timer only fires at the next preemption point, which exists while another thread of
+ * the running thread's priority is ready or while someone asked for a periodic tick, or when the first sleeper is due.
+ */
+static int quantum_armed = 0;
+static uint32_t quantum_deadline;
+static uint32_t tick_requests = 0;
+
+// Statistics for scheduler_report
+static uint32_t idle_us = 0;
+static uint32_t context_switches = 0;
+static scheduler_stats_t last_report;
+
+static void ready_enqueue(process_control_block_t * pcb) {
+    pcb->state = THREAD_READY;
+    append_pcb_list(&run_queues[pcb->priority], pcb);
+    ready_bitmap |= 1 << pcb->priority;
+}
 
-    // If nothing on the run queue, the current process should just continue
-    if (size_pcb_list(&run_queue) == 0) {
-        timer_set(10000);
+static void ready_remove(process_control_block_t * pcb) {
+    remove_pcb(&run_queues[pcb->priority], pcb);
+    if (size_pcb_list(&run_queues[pcb->priority]) == 0)
+        ready_bitmap &= ~(1 << pcb->priority);
+}
+
+static uint32_t highest_ready_priority(void) {
+    return 31 - __builtin_clz(ready_bitmap);
+}
+
+/**
+ * Programs the timer for the earlier of the next preemption point and the first sleeper, or switches it off.
+ * Interrupts must be disabled
+ */
+static void scheduler_arm_timer(void) {
+    process_control_block_t * cur = current_process;
+    uint32_t now = uuptime();
+    int need_tick = tick_requests > 0 || (cur->state == THREAD_RUNNING && (ready_bitmap >> cur->priority) != 0);
+
+    // A quantum that is used up starts over
+    if (quantum_armed && (int32_t)(quantum_deadline - now) <= 0)
+        quantum_armed = 0;
+
+    if (!need_tick) {
+        quantum_armed = 0;
+    } else if (!quantum_armed) {
+        quantum_deadline = now + SCHEDULER_QUANTUM;
+        quantum_armed = 1;
+    }
+
+    if (sleep_queue != NULL && (!quantum_armed || (int32_t)(sleep_queue->wake_time - quantum_deadline) < 0))
+        timer_set_deadline(sleep_queue->wake_time);
+    else if (quantum_armed)
+        timer_set_deadline(quantum_deadline);
+    else
+        timer_cancel();
+}
+
+/**
+ * Adds a thread to the sleep queue. Sleepers with the same deadline wake up in the order they went to sleep.
+ * Interrupts must be disabled
+ */
+static void sleep_queue_insert(process_control_block_t * pcb, uint32_t deadline) {
+    process_control_block_t ** link;
+
+    pcb->wake_time = deadline;
+    for (link = &sleep_queue; *link != NULL && (int32_t)((*link)->wake_time - deadline) <= 0; link = &(*link)->next_sleeper);
+    pcb->next_sleeper = *link;
+    *link = pcb;
+    pcb->sleeping = 1;
+}
+
+/**
+ * Takes a thread out of the sleep queue if it is in there. Interrupts must be disabled
+ */
+static void sleep_queue_remove(process_control_block_t * pcb) {
+    process_control_block_t ** link;
+
+    if (!pcb->sleeping)
+        return;
+    for (link = &sleep_queue; *link != pcb; link = &(*link)->next_sleeper);
+    *link = pcb->next_sleeper;
+    pcb->sleeping = 0;
+}
+
+/**
+ * Makes every sleeper whose wake_time has come ready, ending its wait if it was waiting with a timeout.
+ * Interrupts must be disabled
+ */
+static void wake_sleepers(void) {
+    process_control_block_t * pcb;
+    uint32_t now = uuptime();
+
+    while (sleep_queue != NULL && (int32_t)(sleep_queue->wake_time - now) <= 0) {
+        pcb = sleep_queue;
+        sleep_queue = pcb->next_sleeper;
+        pcb->sleeping = 0;
+        if (pcb->waiting_on != NULL) {
+            remove_pcb(pcb->waiting_on, pcb);
+            pcb->waiting_on = NULL;
+            pcb->timed_out = 1;
+        }
+        if (pcb->state != THREAD_BLOCKED)
+            continue;
+        // The running thread is a sleeper if it is idling in block_current_thread
+        if (pcb == current_process)
+            pcb->state = THREAD_RUNNING;
+        else
+            ready_enqueue(pcb);
+    }
+}
+
+/**
+ * Sleeps until the next interrupt, or zeroes a page for alloc_page if the pool is not full.
+ * Interrupts must be disabled; pending interrupts are taken before returning
+ */
+static void cpu_idle(void) {
+    uint32_t start;
+
+    // Zero a page ahead of time instead of sleeping, then take whatever interrupt came in meanwhile
+    if (zero_pool_refill(1) != 0) {
         ENABLE_INTERRUPTS();
+        DISABLE_INTERRUPTS();
         return;
     }
 
-    //uart_printf("Size: %d, ", size_pcb_list(&run_queue));
+    start = uuptime();
+    // Wait for interrupt, wakes up even though interrupts are masked
+    __asm__ __volatile__("mcr p15, 0, %[zero], c7, c0, 4" :: [zero] "r" (0) : "memory");
+    idle_us += uuptime() - start;
+    ENABLE_INTERRUPTS();
+    DISABLE_INTERRUPTS();
+}
+
+/**
+ * Takes the first thread of the highest non-empty priority off its run queue
+ * @return The thread or NULL if no thread is ready
+ */
+static process_control_block_t * ready_dequeue(void) {
+    process_control_block_t * pcb;
+    uint32_t priority;
+
+    if (ready_bitmap == 0)
+        return NULL;
+    priority = highest_ready_priority();
+    pcb = pop_pcb_list(&run_queues[priority]);
+    if (size_pcb_list(&run_queues[priority]) == 0)
+        ready_bitmap &= ~(1 << priority);
+    return pcb;
+}
 
-    // Get the next thread to run.  For now we are using round-robin
-    // uart_printf("(%d, %d)", size_pcb_list(&run_queue), size_pcb_list(&all_proc_list));
-    new_thread = pop_pcb_list(&run_queue);
-    //uart_printf("starting: %s, ", new_thread->proc_name);
-    old_thread = current_process;
+/**
+ * Hands the CPU to new_thread. Returns once old_thread is switched back to. Interrupts must be disabled
+ */
+static void context_switch(process_control_block_t * old_thread, process_control_block_t * new_thread) {
     current_process = new_thread;
+    new_thread->state = THREAD_RUNNING;
+    trace_event(TRACE_SCHEDULE, old_thread->pid, new_thread->pid);
+    context_switches++;
 
-    // Put the current thread back in the run queue
-    append_pcb_list(&run_queue, old_thread);
+    // The new thread gets a full quantum
+    quantum_armed = 0;
+    scheduler_arm_timer();
 
-    // Context Switch
+    prof_begin(&switch_probe_scope);
     switch_to_thread(old_thread, new_thread);
+    PROF_END(switch_probe);
+}
+
+/**
+ * Switches to the most important ready thread unless the running thread is more important.
+ * Interrupts must be disabled
+ */
+static void reschedule(void) {
+    process_control_block_t * new_thread, * old_thread = current_process;
+
+    wake_sleepers();
+
+    // Keep running if nothing of at least the same priority is ready
+    if (ready_bitmap == 0 || (old_thread->state == THREAD_RUNNING && highest_ready_priority() < old_thread->priority)) {
+        scheduler_arm_timer();
+        return;
+    }
+
+    new_thread = ready_dequeue();
+    // A blocked thread waits for wake_thread instead of a run queue
+    if (old_thread->state == THREAD_RUNNING)
+        ready_enqueue(old_thread);
+    context_switch(old_thread, new_thread);
+}
+
+void schedule(void) {
+    DISABLE_INTERRUPTS();
+    reschedule();
     ENABLE_INTERRUPTS();
 }
 
+/**
+ * Takes the running thread off the CPU until wake_thread is called for it.
+ * If no other thread is ready, the CPU sleeps until an interrupt makes one ready
+ */
+void block_current_thread(void) {
+    process_control_block_t * self, * new_thread;
+
+    DISABLE_INTERRUPTS();
+    self = current_process;
+    self->state = THREAD_BLOCKED;
+    while (self->state == THREAD_BLOCKED) {
+        new_thread = ready_dequeue();
+        if (new_thread != NULL) {
+            context_switch(self, new_thread);
+        } else {
+            scheduler_arm_timer();
+            cpu_idle();
+        }
+    }
+    ENABLE_INTERRUPTS();
+}
+
+/**
+ * Makes a blocked thread ready again. It runs right away if it is more important than the running thread
+ * @param pcb The thread to wake
+ */
+void wake_thread(process_control_block_t * pcb) {
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    if (pcb->state == THREAD_BLOCKED) {
+        if (pcb == current_process) {
+            // Woken by an interrupt while waiting for another thread to become ready
+            pcb->state = THREAD_RUNNING;
+        } else {
+            ready_enqueue(pcb);
+            if (current_process->state != THREAD_RUNNING || pcb->priority > current_process->priority)
+                reschedule();
+            else
+                scheduler_arm_timer();
+        }
+    }
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Changes the priority of a thread, which may cause a switch to another thread
+ * @param pcb The thread
+ * @param priority The new priority, clamped to PRIORITY_HIGHEST
+ */
+void set_thread_priority(process_control_block_t * pcb, uint32_t priority) {
+    int enabled = INTERRUPTS_ENABLED();
+
+    if (priority > PRIORITY_HIGHEST)
+        priority = PRIORITY_HIGHEST;
+
+    DISABLE_INTERRUPTS();
+    if (pcb->state == THREAD_READY) {
+        ready_remove(pcb);
+        pcb->priority = priority;
+        ready_enqueue(pcb);
+    } else {
+        pcb->priority = priority;
+    }
+    // Either a ready thread now beats the running one or the running one was lowered
+    if (current_process->state == THREAD_RUNNING && ready_bitmap != 0 && highest_ready_priority() > current_process->priority)
+        reschedule();
+    else
+        scheduler_arm_timer();
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
 void process_init(void) {
     process_control_block_t * main_pcb;
-    INITIALIZE_LIST(run_queue);
-    INITIALIZE_LIST(all_proc_list);
+    uint32_t i;
+
+    for (i = 0; i < PRIORITY_LEVELS; i++) {
+        INITIALIZE_LIST(run_queues[i]);
+    }
 
     // Allocate and initailize the block
     main_pcb = kmalloc(sizeof(process_control_block_t));
     main_pcb->stack_page = (void *)&__end;
     main_pcb->pid = NEW_PID;
+    main_pcb->priority = PRIORITY_DEFAULT;
+    main_pcb->state = THREAD_RUNNING;
+    main_pcb->sleeping = 0;
+    main_pcb->waiting_on = NULL;
     memcpy(main_pcb->proc_name, "Init", 5);
 
     // Add self to all process list.  It is already running, so dont add it to the run queue
-    append_pcb_list(&all_proc_list, main_pcb);
+    main_pcb->next_proc = NULL;
+    all_procs = main_pcb;
 
     current_process = main_pcb;
 
-    // Set the timer to go off after 10 ms
-    timer_set(10000);
+    // Only Init exists, so there is nothing to preempt it for
+    DISABLE_INTERRUPTS();
+    scheduler_arm_timer();
+    ENABLE_INTERRUPTS();
+}
+
+/**
+ * Frees the pcbs and stacks of ended threads. Must not run in interrupt context, the allocator is used
+ */
+static void free_zombies(void) {
+    process_control_block_t * zombie;
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    while ((zombie = zombies) != NULL) {
+        zombies = zombie->next_proc;
+        free_page(zombie->stack_page);
+        kfree(zombie);
+    }
+    if (enabled)
+        ENABLE_INTERRUPTS();
 }
 
 static void reap(void) {
+    process_control_block_t * new_thread, * old_thread, ** link;
+
+    // Earlier threads are fully switched away from by now
+    free_zombies();
     DISABLE_INTERRUPTS();
-    process_control_block_t * new_thread, * old_thread;
 
-    // If nothing on the run queue, there is nothing to do now. just loop
-    if (size_pcb_list(&run_queue) == 0) return;
+    // If nothing is ready, wait for an interrupt to make a thread ready
+    while ((new_thread = ready_dequeue()) == NULL) {
+        scheduler_arm_timer();
+        cpu_idle();
+    }
 
-    // Get the next thread to run.  For now we are using round-robin
-    new_thread = pop_pcb_list(&run_queue);
     old_thread = current_process;
-    uart_printf("[Reaping %s]", old_thread->proc_name);
-    // Of only the main thread is left, use that one
+    trace_event(TRACE_THREAD_EXIT, old_thread->pid, new_thread->pid);
     current_process = new_thread;
+    new_thread->state = THREAD_RUNNING;
+    context_switches++;
+    quantum_armed = 0;
+    scheduler_arm_timer();
 
     // remove from all threads list
-    remove_pcb(&all_proc_list, old_thread);
+    for (link = &all_procs; *link != NULL; link = &(*link)->next_proc) {
+        if (*link == old_thread) {
+            *link = old_thread->next_proc;
+            break;
+        }
+    }
 
-    // Free the resources used by the old process. Technically, we are using dangling pointers here,
-    // but since interrupts are disabled and we only have one core, it should still be fine
-    free_page(old_thread->stack_page);
-    kfree(old_thread);
+    // switch_to_thread still saves into the pcb and we run on the stack, the next reap or thread creation frees them
+    old_thread->next_proc = zombies;
+    zombies = old_thread;
 
-    // Context Switch
+    // Context Switch. The resumed thread ends the probe scope, it must not use the start of an older switch
+    prof_begin(&switch_probe_scope);
     switch_to_thread(old_thread, new_thread);
 }
 
-void create_kernel_thread(kthread_function_f thread_func, char * name, int name_len) {
+/**
+ * Starts a kernel thread
+ * @param thread_func The function the thread runs, returning from it ends the thread
+ * @param name The name of the thread, cut to 19 characters
+ * @param name_len Length of the name
+ * @param priority PRIORITY_LOWEST to PRIORITY_HIGHEST. A thread more important than the caller starts right away
+ * @return The new thread
+ */
+process_control_block_t * create_kernel_thread(kthread_function_f thread_func, char * name, int name_len, uint32_t priority) {
     process_control_block_t * pcb;
     proc_saved_state_t * new_proc_state;
+    int enabled;
+
+    free_zombies();
 
     // Allocate and initialize the pcb
     pcb = kmalloc(sizeof(process_control_block_t));
     pcb->stack_page = alloc_page();
     pcb->pid = NEW_PID;
+    pcb->priority = MIN(priority, PRIORITY_HIGHEST);
+    pcb->sleeping = 0;
+    pcb->waiting_on = NULL;
     memcpy(pcb->proc_name, name, MIN(name_len,19));
     pcb->proc_name[MIN(name_len,19)] = 0;
 
@@ -116,11 +431,105 @@ void create_kernel_thread(kthread_function_f thread_func, char * name, int name_
     new_proc_state->sp = (uint32_t)reap;            // When the thread function returns, this reaper routine will clean it up
     new_proc_state->cpsr = 0x13 | (8 << 1);         // Sets the thread up to run in supervisor mode with irqs only
 
-    uart_printf("{%s|%x}", name, (uint32_t)pcb);
+    trace_event(TRACE_THREAD_CREATE, pcb->pid, (uint32_t)pcb);
 
     // add the thread to the lists
-    append_pcb_list(&all_proc_list, pcb);
-    append_pcb_list(&run_queue, pcb);
+    enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+    pcb->next_proc = all_procs;
+    all_procs = pcb;
+    ready_enqueue(pcb);
+    if (pcb->priority > current_process->priority)
+        reschedule();
+    else
+        scheduler_arm_timer();
+    if (enabled)
+        ENABLE_INTERRUPTS();
+
+    return pcb;
+}
+
+/**
+ * Puts the running thread to sleep until the timer reaches deadline, letting other threads run meanwhile.
+ * Before the scheduler runs or with interrupts disabled this busy waits instead
+ * @param deadline Timer value as returned by uuptime
+ */
+void ksleep_until(uint32_t deadline) {
+    if (current_process == NULL || !INTERRUPTS_ENABLED()) {
+        while ((int32_t)(deadline - uuptime()) > 0);
+        return;
+    }
+
+    DISABLE_INTERRUPTS();
+    if ((int32_t)(deadline - uuptime()) <= 0) {
+        ENABLE_INTERRUPTS();
+        return;
+    }
+
+    sleep_queue_insert(current_process, deadline);
+    // A wake_thread meant for something else does not cut the sleep short
+    while (current_process->sleeping) {
+        block_current_thread();
+        DISABLE_INTERRUPTS();
+    }
+    ENABLE_INTERRUPTS();
+}
+
+/**
+ * Puts the running thread to sleep for at least usecs microseconds, see ksleep_until
+ * @param usecs Time to sleep
+ */
+void ksleep_us(uint32_t usecs) {
+    ksleep_until(uuptime() + usecs);
+}
+
+/**
+ * Keeps the timer interrupt coming every quantum even when no thread needs to be preempted,
+ * e.g. for the sampling profiler. Calls nest
+ * @param enable 1 to request the tick, 0 to drop the request
+ */
+void scheduler_require_tick(int enable) {
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+    if (enable)
+        tick_requests++;
+    else if (tick_requests > 0)
+        tick_requests--;
+    scheduler_arm_timer();
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Copies the counters since boot
+ */
+void scheduler_stats(scheduler_stats_t * stats) {
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+    stats->uptime_us = uuptime();
+    stats->idle_us = idle_us;
+    stats->timer_irqs = timer_irq_count();
+    stats->context_switches = context_switches;
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Prints idle percentage, timer interrupts and context switches per second since the last report
+ */
+void scheduler_report(void) {
+    scheduler_stats_t now;
+    uint32_t elapsed;
+
+    scheduler_stats(&now);
+    elapsed = now.uptime_us - last_report.uptime_us;
+    if (elapsed == 0)
+        return;
+    uart_printf("SCHED: idle %u%%, %u timer irqs/s, %u switches/s\n",
+            (uint32_t)divmod64((uint64_t)(now.idle_us - last_report.idle_us) * 100, elapsed).div,
+            (uint32_t)divmod64((uint64_t)(now.timer_irqs - last_report.timer_irqs) * 1000000, elapsed).div,
+            (uint32_t)divmod64((uint64_t)(now.context_switches - last_report.context_switches) * 1000000, elapsed).div);
+    last_report = now;
 }
 
 void spin_init(spin_lock_t * lock) {
@@ -132,43 +541,113 @@ void spin_lock(spin_lock_t * lock) {
 }
 
 void spin_unlock(spin_lock_t * lock) {
-    *lock = 1;
+    // Everything done while holding the lock is visible before it is released
+    atomic_store((volatile uint32_t *)lock, 1);
+}
+
+/**
+ * Puts the running thread into a wait queue, behind all waiters of at least its priority.
+ * The thread keeps running until wait_queue_block, so whatever the wait is for can be released in between
+ * without losing a wakeup. Interrupts must be disabled
+ * @param queue The wait queue
+ * @param timeout_us Time after which the wait ends by itself, or WAIT_FOREVER
+ */
+void wait_queue_add(pcb_list_t * queue, uint32_t timeout_us) {
+    process_control_block_t * self = current_process, * before = peek_pcb_list(queue);
+
+    while (before != NULL && before->priority >= self->priority)
+        before = next_pcb_list(before);
+    insert_pcb_list(queue, self, before);
+    self->waiting_on = queue;
+    self->timed_out = 0;
+    if (timeout_us != WAIT_FOREVER)
+        sleep_queue_insert(self, uuptime() + timeout_us);
+}
+
+/**
+ * Blocks the running thread until wait_queue_pop or wait_queue_remove takes it out of its wait queue or its
+ * timeout passes. Interrupts must be disabled and are enabled on return
+ * @return 1 if the thread was woken, 0 if the wait timed out
+ */
+int wait_queue_block(void) {
+    process_control_block_t * self = current_process;
+
+    while (self->waiting_on != NULL) {
+        block_current_thread();
+        DISABLE_INTERRUPTS();
+    }
+    ENABLE_INTERRUPTS();
+    return !self->timed_out;
+}
+
+/**
+ * Ends the wait of a thread. The caller decides whether to wake_thread it. Interrupts must be disabled
+ * @param queue The wait queue the thread is in
+ * @param pcb The thread
+ */
+void wait_queue_remove(pcb_list_t * queue, process_control_block_t * pcb) {
+    remove_pcb(queue, pcb);
+    pcb->waiting_on = NULL;
+    sleep_queue_remove(pcb);
+}
+
+/**
+ * Ends the wait of the most important waiter. Interrupts must be disabled
+ * @return The waiter, which still has to be woken with wake_thread, or NULL if the queue is empty
+ */
+process_control_block_t * wait_queue_pop(pcb_list_t * queue) {
+    process_control_block_t * pcb = peek_pcb_list(queue);
+
+    if (pcb != NULL)
+        wait_queue_remove(queue, pcb);
+    return pcb;
 }
 
 void mutex_init(mutex_t * lock) {
     lock->lock = 1;
-    lock->locker = 0;
+    lock->owner = NULL;
     INITIALIZE_LIST(lock->wait_queue);
 }
 
-void mutex_lock(mutex_t * lock) {
-    process_control_block_t * new_thread, * old_thread;
-    // If you don't get the lock, take self off run queue and put on to mutex wait queue
-    while (!try_lock(&lock->lock)) {
-
-        // Get the next thread to run.  For now we are using round-robin
-        DISABLE_INTERRUPTS();
-        new_thread = pop_pcb_list(&run_queue);
-        old_thread = current_process;
-        current_process = new_thread;
+/**
+ * Takes the mutex if it is free
+ * @return 1 if the mutex is now held by the calling thread, 0 otherwise
+ */
+int mutex_try_lock(mutex_t * lock) {
+    if (!try_lock(&lock->lock))
+        return 0;
+    lock->owner = current_process;
+    return 1;
+}
 
-        // Put the current thread back of this mutex's wait queue, not on the run queue
-        append_pcb_list(&lock->wait_queue, old_thread);
+void mutex_lock(mutex_t * lock) {
+    int enabled = INTERRUPTS_ENABLED();
 
-        // Context Switch
-        switch_to_thread(old_thread, new_thread);
-        ENABLE_INTERRUPTS();
+    // Interrupts stay off between the attempt and blocking so an unlock cannot slip in between
+    DISABLE_INTERRUPTS();
+    if (!mutex_try_lock(lock)) {
+        // mutex_unlock makes this thread the owner before waking it
+        wait_queue_add(&lock->wait_queue, WAIT_FOREVER);
+        wait_queue_block();
     }
-    lock->locker = current_process;
+    if (enabled)
+        ENABLE_INTERRUPTS();
 }
+
 void mutex_unlock(mutex_t * lock) {
     process_control_block_t * thread;
-    lock->lock = 1;
-    lock->locker = 0;
+    int enabled = INTERRUPTS_ENABLED();
 
-    // If there is anyone waiting on this, put them back in the run queue
-    if (size_pcb_list(&lock->wait_queue)) {
-        thread = pop_pcb_list(&lock->wait_queue);  
-        push_pcb_list(&run_queue, thread);
+    DISABLE_INTERRUPTS();
+    thread = wait_queue_pop(&lock->wait_queue);
+    if (thread != NULL) {
+        // Hand over without releasing, the lock variable stays taken
+        lock->owner = thread;
+        wake_thread(thread);
+    } else {
+        lock->owner = NULL;
+        atomic_store((volatile uint32_t *)&lock->lock, 1);
     }
+    if (enabled)
+        ENABLE_INTERRUPTS();
 }
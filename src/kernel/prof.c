@@ -0,0 +1,81 @@
+#include <kernel/prof.h>
+#include <kernel/interrupts.h>
+#include <kernel/uart.h>
+#include <common/stdlib.h>
+
+static prof_probe_t * probes = 0;
+
+/**
+ * Closes a scope opened with prof_begin and accounts it to the probe.
+ * Probes are shared between threads and IRQs, so the update runs with interrupts disabled
+ */
+void prof_end(prof_probe_t * probe, const prof_scope_t * scope) {
+    uint32_t cycles = pmu_cycles() - scope->cycles;
+    uint32_t event0 = pmu_counter0() - scope->event0;
+    uint32_t event1 = pmu_counter1() - scope->event1;
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    if (!probe->registered) {
+        probe->registered = 1;
+        probe->next = probes;
+        probes = probe;
+    }
+    probe->count++;
+    probe->total_cycles += cycles;
+    probe->total_event0 += event0;
+    probe->total_event1 += event1;
+    if (cycles < probe->min_cycles)
+        probe->min_cycles = cycles;
+    if (cycles > probe->max_cycles)
+        probe->max_cycles = cycles;
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Clears the statistics of all probes
+ */
+void prof_reset(void) {
+    prof_probe_t * probe;
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    for (probe = probes; probe != 0; probe = probe->next) {
+        probe->count = 0;
+        probe->min_cycles = 0xffffffff;
+        probe->max_cycles = 0;
+        probe->total_cycles = 0;
+        probe->total_event0 = 0;
+        probe->total_event1 = 0;
+    }
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Prints one line per probe to UART: calls, min/avg/max cycles and the average of both PMU events per call
+ */
+void prof_report(void) {
+    prof_probe_t * probe, snapshot;
+    int enabled;
+
+    uart_printf("%-16s %8s %8s %8s %8s %12s %12s\n", "probe", "calls", "min", "avg", "max",
+            pmu_event_name(pmu_event0()), pmu_event_name(pmu_event1()));
+    for (probe = probes; probe != 0; probe = probe->next) {
+        enabled = INTERRUPTS_ENABLED();
+        DISABLE_INTERRUPTS();
+        snapshot = *probe;
+        if (enabled)
+            ENABLE_INTERRUPTS();
+
+        if (snapshot.count == 0)
+            continue;
+        uart_printf("%-16s %8u %8u %8u %8u %12u %12u\n", snapshot.name, snapshot.count,
+                snapshot.min_cycles,
+                (uint32_t)divmod64(snapshot.total_cycles, snapshot.count).div,
+                snapshot.max_cycles,
+                (uint32_t)divmod64(snapshot.total_event0, snapshot.count).div,
+                (uint32_t)divmod64(snapshot.total_event1, snapshot.count).div);
+    }
+}
@@ -10,7 +10,7 @@ uint64_t rand(uint64_t min, uint64_t max) {
         *RNG_CTRL |= 1;                // enable the generator
         while( !((*RNG_STATUS)>>24) ); // wait until it's entropy good enough
     }
-    return divmod(((uint64_t)(*RNG_DATA) << 32) | *RNG_DATA, max - min).mod + min;
+    return divmod64(((uint64_t)(*RNG_DATA) << 32) | *RNG_DATA, max - min).mod + min;
 }
 
 uint32_t state = 77247;
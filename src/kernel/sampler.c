@@ -0,0 +1,101 @@
+#include <kernel/sampler.h>
+#include <kernel/process.h>
+#include <kernel/uart.h>
+#include <common/stdlib.h>
+
+/**
+ * Statistical profiler.
+ * Every system timer interrupt records the interrupted PC together with the running thread in a
+ * hash table of counters. sampler_dump prints the most frequent addresses, which
+ * ./do.sh symbolize <capture> resolves against kernel.elf.
+ */
+
+static sampler_bucket_t buckets[SAMPLER_BUCKETS];
+static volatile int sampler_on = 0;
+static uint32_t total_samples = 0;
+static uint32_t dropped_samples = 0;
+
+static uint32_t sampler_hash(uint32_t pc, uint32_t pid) {
+    // Instructions are word aligned, Knuth's multiplicative hash spreads the rest
+    return (((pc >> 2) ^ (pid << 24)) * 2654435761u) >> (32 - SAMPLER_BUCKET_BITS);
+}
+
+// The scheduler is tickless, so the timer is kept running while sampling
+void sampler_start(void) {
+    if (!sampler_on)
+        scheduler_require_tick(1);
+    sampler_on = 1;
+}
+
+void sampler_stop(void) {
+    if (sampler_on)
+        scheduler_require_tick(0);
+    sampler_on = 0;
+}
+
+void sampler_reset(void) {
+    int enabled = sampler_on;
+    sampler_on = 0;
+    bzero(buckets, sizeof(buckets));
+    total_samples = 0;
+    dropped_samples = 0;
+    sampler_on = enabled;
+}
+
+/**
+ * Counts one sample. Called by irq_handler with interrupts disabled
+ * @param pc The address the timer interrupt returns to
+ */
+void sampler_record(uint32_t pc) {
+    uint32_t pid, index, probe;
+    sampler_bucket_t * bucket;
+
+    if (!sampler_on)
+        return;
+
+    pid = current_process ? current_process->pid : 0;
+    index = sampler_hash(pc, pid);
+    total_samples++;
+    for (probe = 0; probe < SAMPLER_MAX_PROBES; probe++) {
+        bucket = &buckets[(index + probe) & (SAMPLER_BUCKETS - 1)];
+        if (bucket->count == 0) {
+            bucket->pc = pc;
+            bucket->pid = pid;
+        }
+        if (bucket->pc == pc && bucket->pid == pid) {
+            bucket->count++;
+            return;
+        }
+    }
+    dropped_samples++;
+}
+
+/**
+ * Prints the most frequent samples to UART, one "SAMPLE <pc> <pid> <count>" line each,
+ * between "SAMPLES BEGIN <total> <dropped>" and "SAMPLES END". Sampling is paused meanwhile
+ * @param top_n Maximum number of lines
+ */
+void sampler_dump(uint32_t top_n) {
+    int enabled = sampler_on;
+    uint32_t i, n, best, limit = 0xffffffff, last = SAMPLER_BUCKETS;
+
+    sampler_on = 0;
+    uart_printf("SAMPLES BEGIN %u %u\n", total_samples, dropped_samples);
+    // Selection by count, ties are broken by bucket index so every bucket is printed at most once
+    for (n = 0; n < top_n; n++) {
+        best = SAMPLER_BUCKETS;
+        for (i = 0; i < SAMPLER_BUCKETS; i++) {
+            if (buckets[i].count == 0 || buckets[i].count > limit || (buckets[i].count == limit && i <= last))
+                continue;
+            if (best == SAMPLER_BUCKETS || buckets[i].count > buckets[best].count)
+                best = i;
+        }
+        if (best == SAMPLER_BUCKETS)
+            break;
+        uart_printf("SAMPLE %#010x %u %u\n", buckets[best].pc, buckets[best].pid, buckets[best].count);
+        limit = buckets[best].count;
+        last = best;
+    }
+    uart_printf("SAMPLES END\n");
+    sampler_on = enabled;
+}
@@ -0,0 +1,207 @@
+#include <kernel/sync.h>
+#include <kernel/interrupts.h>
+
+/**
+ * All operations run with interrupts disabled, which is what makes them safe against IRQ handlers on a
+ * single core. Wakeups hand over directly: sem_post gives its unit to the first waiter instead of
+ * incrementing the count, and event_set passes the matching flags to each waiter it releases.
+ */
+
+void sem_init(semaphore_t * sem, uint32_t count) {
+    sem->count = count;
+    INITIALIZE_LIST(sem->wait_queue);
+}
+
+/**
+ * Takes a unit from the semaphore, waiting at most timeout_us for one
+ * @param timeout_us Microseconds to wait, 0 not to wait or WAIT_FOREVER
+ * @return 1 if a unit was taken, 0 on timeout
+ */
+int sem_wait_timeout(semaphore_t * sem, uint32_t timeout_us) {
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    if (sem->count > 0) {
+        sem->count--;
+        if (enabled)
+            ENABLE_INTERRUPTS();
+        return 1;
+    }
+    if (timeout_us == 0) {
+        if (enabled)
+            ENABLE_INTERRUPTS();
+        return 0;
+    }
+    wait_queue_add(&sem->wait_queue, timeout_us);
+    return wait_queue_block();
+}
+
+void sem_wait(semaphore_t * sem) {
+    sem_wait_timeout(sem, WAIT_FOREVER);
+}
+
+int sem_try_wait(semaphore_t * sem) {
+    return sem_wait_timeout(sem, 0);
+}
+
+/**
+ * Returns a unit to the semaphore, waking the most important waiter if there is one
+ */
+void sem_post(semaphore_t * sem) {
+    process_control_block_t * thread;
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    thread = wait_queue_pop(&sem->wait_queue);
+    if (thread != NULL)
+        wake_thread(thread);
+    else
+        sem->count++;
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+void cond_init(cond_t * cond) {
+    INITIALIZE_LIST(cond->wait_queue);
+}
+
+/**
+ * Releases mutex and waits for a signal, then takes mutex again. As with any condition variable the
+ * caller rechecks its condition after waking
+ * @param timeout_us Microseconds to wait or WAIT_FOREVER
+ * @return 1 if signalled, 0 on timeout. The mutex is held again either way
+ */
+int cond_wait_timeout(cond_t * cond, mutex_t * mutex, uint32_t timeout_us) {
+    int signalled;
+
+    // Queued before the mutex is released, a signal right after the unlock is not lost
+    DISABLE_INTERRUPTS();
+    wait_queue_add(&cond->wait_queue, timeout_us);
+    mutex_unlock(mutex);
+    signalled = wait_queue_block();
+    mutex_lock(mutex);
+    return signalled;
+}
+
+void cond_wait(cond_t * cond, mutex_t * mutex) {
+    cond_wait_timeout(cond, mutex, WAIT_FOREVER);
+}
+
+/**
+ * Wakes the most important waiter
+ */
+void cond_signal(cond_t * cond) {
+    process_control_block_t * thread;
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    thread = wait_queue_pop(&cond->wait_queue);
+    if (thread != NULL)
+        wake_thread(thread);
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Wakes all waiters
+ */
+void cond_broadcast(cond_t * cond) {
+    process_control_block_t * thread;
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    while ((thread = wait_queue_pop(&cond->wait_queue)) != NULL)
+        wake_thread(thread);
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+void event_init(event_flags_t * event) {
+    event->flags = 0;
+    INITIALIZE_LIST(event->wait_queue);
+}
+
+/**
+ * Checks the flags against what a waiter asked for
+ * @return The requested flags that are set if that ends the wait, otherwise 0
+ */
+static uint32_t event_match(uint32_t flags, uint32_t mask, uint32_t options) {
+    uint32_t match = flags & mask;
+    if (options & EVENT_WAIT_ALL)
+        return match == mask ? match : 0;
+    return match;
+}
+
+/**
+ * Waits until any or all of the flags in mask are set
+ * @param mask The flags to wait for, not 0
+ * @param options EVENT_WAIT_ANY or EVENT_WAIT_ALL, optionally or'ed with EVENT_CLEAR
+ * @param timeout_us Microseconds to wait, 0 not to wait or WAIT_FOREVER
+ * @return The requested flags that were set when the wait ended, 0 on timeout or if mask is 0
+ */
+uint32_t event_wait(event_flags_t * event, uint32_t mask, uint32_t options, uint32_t timeout_us) {
+    process_control_block_t * self = current_process;
+    uint32_t match;
+    int enabled = INTERRUPTS_ENABLED();
+
+    // No flag could end the wait, event_set would never release it
+    if (mask == 0)
+        return 0;
+
+    DISABLE_INTERRUPTS();
+    match = event_match(event->flags, mask, options);
+    if (match != 0 || timeout_us == 0) {
+        if (match != 0 && (options & EVENT_CLEAR))
+            event->flags &= ~match;
+        if (enabled)
+            ENABLE_INTERRUPTS();
+        return match;
+    }
+
+    self->wait_mask = mask;
+    self->wait_options = options;
+    wait_queue_add(&event->wait_queue, timeout_us);
+    if (!wait_queue_block())
+        return 0;
+    // event_set left the matching flags here
+    return self->wait_mask;
+}
+
+/**
+ * Sets flags and releases every waiter they satisfy, in priority order
+ */
+void event_set(event_flags_t * event, uint32_t flags) {
+    process_control_block_t * thread;
+    uint32_t match;
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    event->flags |= flags;
+    thread = event->wait_queue.head;
+    while (thread != NULL) {
+        match = event_match(event->flags, thread->wait_mask, thread->wait_options);
+        if (match == 0) {
+            thread = thread->nextpcb;
+            continue;
+        }
+        // A consumed flag is not seen by less important waiters
+        if (thread->wait_options & EVENT_CLEAR)
+            event->flags &= ~match;
+        thread->wait_mask = match;
+        wait_queue_remove(&event->wait_queue, thread);
+        // wake_thread may switch to the thread, so the queue can look different afterwards
+        wake_thread(thread);
+        thread = event->wait_queue.head;
+    }
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+void event_clear(event_flags_t * event, uint32_t flags) {
+    int enabled = INTERRUPTS_ENABLED();
+
+    DISABLE_INTERRUPTS();
+    event->flags &= ~flags;
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
@@ -4,13 +4,16 @@
 #include <kernel/kerio.h>
 
 static timer_registers_t * timer_regs;
+static volatile uint32_t timer_irqs = 0;
 
 static void timer_irq_handler(void) {
     schedule();
 }
 
 static void timer_irq_clearer(void) {
-    timer_regs->control.timer1_matched = 1;
+    timer_irqs++;
+    // Write one to clear: a read-modify-write of the bitfield would clear the other channels' pending matches too
+    mmio_write(SYSTEM_TIMER_BASE + TIMER_CS, 1 << 1);
 }
 
 void timer_init(void) {
@@ -22,6 +25,32 @@ void timer_set(useconds_t usecs) {
     timer_regs->timer1 = timer_regs->counter_low + usecs;
 }
 
+/**
+ * Programs the timer interrupt for an absolute point in time.
+ * The compare only matches on equality, so deadlines that are due or passed are moved just ahead of the counter
+ * @param deadline Value of the counter at which the interrupt should fire
+ */
+void timer_set_deadline(uint32_t deadline) {
+    uint32_t now = timer_regs->counter_low;
+    if ((int32_t)(deadline - now) < TIMER_MIN_DELAY)
+        deadline = now + TIMER_MIN_DELAY;
+    timer_regs->timer1 = deadline;
+}
+
+/**
+ * Pushes the next timer interrupt as far away as possible, one full counter wrap (about 71 minutes)
+ */
+void timer_cancel(void) {
+    timer_regs->timer1 = timer_regs->counter_low - 1;
+}
+
+/**
+ * @return Number of timer interrupts since boot
+ */
+uint32_t timer_irq_count(void) {
+    return timer_irqs;
+}
+
 __attribute__ ((optimize(0))) void udelay (useconds_t usecs) {
     volatile uint32_t curr = timer_regs->counter_low;
     volatile uint32_t x = timer_regs->counter_low - curr;
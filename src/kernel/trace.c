@@ -0,0 +1,84 @@
+#include <kernel/trace.h>
+#include <kernel/timer.h>
+#include <kernel/uart.h>
+#include <kernel/atomic.h>
+#include <common/stdlib.h>
+
+/**
+ * Binary tracepoints.
+ * Each event is one fixed size record in a static ring. Writers claim a slot by atomically
+ * incrementing the head with ldrex/strex and then fill it in, so tracing works from threads and
+ * IRQs alike without disabling interrupts. An IRQ that hits between the ldrex and strex of a
+ * thread makes that strex fail and the thread simply retries.
+ */
+
+static trace_record_t trace_buffer[TRACE_BUFFER_SIZE];
+static volatile uint32_t trace_head = 0;
+static volatile int trace_on = 1;
+
+/**
+ * Records an event
+ * @param event One of trace_event_t or TRACE_USER and above
+ * @param arg0 First event specific value
+ * @param arg1 Second event specific value
+ */
+void trace_event(uint16_t event, uint32_t arg0, uint32_t arg1) {
+    uint32_t index;
+    trace_record_t * rec;
+
+    if (!trace_on)
+        return;
+
+    index = atomic_fetch_add(&trace_head, 1);
+    rec = &trace_buffer[index & (TRACE_BUFFER_SIZE - 1)];
+    // Read the counter directly, tracepoints can fire before timer_init
+    rec->timestamp = mmio_read(SYSTEM_TIMER_BASE + TIMER_CLO);
+    rec->event = event;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    rec->seq = index;
+}
+
+/**
+ * Turns recording on or off, events while off are dropped
+ */
+void trace_enable(int enabled) {
+    trace_on = enabled;
+}
+
+/**
+ * Drops all recorded events
+ */
+void trace_reset(void) {
+    int enabled = trace_on;
+    trace_on = 0;
+    trace_head = 0;
+    bzero(trace_buffer, sizeof(trace_buffer));
+    trace_on = enabled;
+}
+
+/**
+ * Streams the recorded events over UART, oldest first, in one burst:
+ * A line "TRACEDUMP <count>" followed by count raw trace_record_t and a newline.
+ * Recording is paused meanwhile. Decode a capture with ./do.sh trace <file>
+ */
+void trace_dump(void) {
+    int enabled = trace_on;
+    uint32_t head, count, first;
+
+    trace_on = 0;
+    head = trace_head;
+    count = MIN(head, TRACE_BUFFER_SIZE);
+    first = (head - count) & (TRACE_BUFFER_SIZE - 1);
+
+    uart_printf(TRACE_DUMP_MAGIC " %u\n", count);
+    if (first + count > TRACE_BUFFER_SIZE) {
+        uart_putn((const char *)&trace_buffer[first], (TRACE_BUFFER_SIZE - first) * sizeof(trace_record_t));
+        uart_putn((const char *)&trace_buffer[0], (first + count - TRACE_BUFFER_SIZE) * sizeof(trace_record_t));
+    } else {
+        uart_putn((const char *)&trace_buffer[first], count * sizeof(trace_record_t));
+    }
+    uart_putc('\n');
+
+    trace_on = enabled;
+}
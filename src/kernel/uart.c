@@ -1,6 +1,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <kernel/uart.h>
+#include <kernel/interrupts.h>
+#include <kernel/mem.h>
 #include <common/stdlib.h>
 #include <stdarg.h>
 
@@ -9,8 +11,30 @@
  * Default baudrate is 115200
  * Sets up the UART interface UART0 for reading and UART1 for Writing.
  * The default setting works with a data rate of 115200 Baud
+ *
+ * Until uart_irq_init is called every byte is written and read by polling the FIFO flags.
+ * Afterwards output is queued in a TX ring buffer that the UART interrupt moves into the
+ * hardware FIFO, and input is collected in an RX ring buffer, so callers only wait when a
+ * ring is full or empty. The polled path stays available for panic output.
  */
 
+#define UART_LCRH_FEN (1 << 4)
+
+typedef struct uart_ring {
+    char * buf;
+    uint32_t mask;
+    volatile uint32_t head;     // Free running write counter, masked on access
+    volatile uint32_t tail;     // Free running read counter, masked on access
+} uart_ring_t;
+
+#define RING_USED(ring) ((ring)->head - (ring)->tail)
+#define RING_FREE(ring) ((ring)->mask + 1 - RING_USED(ring))
+
+static uart_ring_t tx_ring;
+static uart_ring_t rx_ring;
+static volatile int irq_mode = 0;
+static uart_stats_t uart_statistics;
+
 /**
  * Read UART status flags from register
  * @return uart_flags_t struct of the UART status flags
@@ -21,11 +45,224 @@ uart_flags_t read_flags(void) {
     return flags;
 }
 
+static int irq_save(void) {
+    int enabled = INTERRUPTS_ENABLED();
+    DISABLE_INTERRUPTS();
+    return enabled;
+}
+
+static void irq_restore(int enabled) {
+    if (enabled)
+        ENABLE_INTERRUPTS();
+}
+
+/**
+ * Copies bytes into a ring, which must have room for them
+ */
+static void ring_put(uart_ring_t * ring, const char * buf, uint32_t len) {
+    uint32_t pos = ring->head & ring->mask;
+    uint32_t first = ring->mask + 1 - pos;
+    if (first > len)
+        first = len;
+    memcpy(ring->buf + pos, buf, first);
+    memcpy(ring->buf, buf + first, len - first);
+    ring->head += len;
+}
+
+/**
+ * Copies bytes out of a ring, which must hold at least that many
+ */
+static void ring_get(uart_ring_t * ring, char * buf, uint32_t len) {
+    uint32_t pos = ring->tail & ring->mask;
+    uint32_t first = ring->mask + 1 - pos;
+    if (first > len)
+        first = len;
+    memcpy(buf, ring->buf + pos, first);
+    memcpy(buf + first, ring->buf, len - first);
+    ring->tail += len;
+}
+
+/**
+ * Moves queued bytes into the TX FIFO until it is full. Must run with interrupts disabled
+ */
+static void uart_tx_fill(void) {
+    while (RING_USED(&tx_ring) != 0 && !read_flags().transmit_queue_full) {
+        mmio_write(UART0_DR, tx_ring.buf[tx_ring.tail & tx_ring.mask]);
+        tx_ring.tail++;
+    }
+}
+
+/**
+ * Moves received bytes from the RX FIFO into the ring. Must run with interrupts disabled
+ */
+static void uart_rx_drain(void) {
+    uint32_t data;
+    while (!read_flags().recieve_queue_empty) {
+        data = mmio_read(UART0_DR);
+        if (data & UART_DR_OE)
+            uart_statistics.rx_overruns++;
+        if (RING_FREE(&rx_ring) == 0) {
+            uart_statistics.rx_overflows++;
+            continue;
+        }
+        rx_ring.buf[rx_ring.head & rx_ring.mask] = data & 0xff;
+        rx_ring.head++;
+    }
+}
+
+/**
+ * Servicing is done in the clearer, the interrupt line only drops once the FIFOs are handled
+ */
+static void uart_irq_handler(void) {
+}
+
+static void uart_irq_clearer(void) {
+    uint32_t status = mmio_read(UART0_MIS);
+    uart_statistics.interrupts++;
+    if (status & (UART_INT_RX | UART_INT_RT | UART_INT_OE))
+        uart_rx_drain();
+    if (status & UART_INT_TX)
+        uart_tx_fill();
+    mmio_write(UART0_ICR, status);
+}
+
+static uint32_t round_up_pow2(uint32_t size) {
+    if (size <= 1)
+        return 1;
+    return 1u << (32 - __builtin_clz(size - 1));
+}
+
+/**
+ * Switches UART0 to interrupt driven mode
+ * @param tx_size Size of the TX ring buffer, rounded up to a power of two
+ * @param rx_size Size of the RX ring buffer, rounded up to a power of two
+ * @param tx_level Refill the TX FIFO once it has drained to this level
+ * @param rx_level Drain the RX FIFO once it has filled to this level (or the line went idle)
+ */
+void uart_irq_init(uint32_t tx_size, uint32_t rx_size, uart_fifo_level_t tx_level, uart_fifo_level_t rx_level) {
+    uart_control_t control;
+    uint32_t lcrh;
+
+    if (irq_mode)
+        return;
+
+    tx_size = round_up_pow2(tx_size);
+    rx_size = round_up_pow2(rx_size);
+    tx_ring.buf = kmalloc(tx_size);
+    rx_ring.buf = kmalloc(rx_size);
+    if (tx_ring.buf == 0 || rx_ring.buf == 0) {
+        uart_polled_puts("ERROR: CANNOT ALLOCATE UART BUFFERS\n");
+        if (tx_ring.buf)
+            kfree(tx_ring.buf);
+        if (rx_ring.buf)
+            kfree(rx_ring.buf);
+        return;
+    }
+    tx_ring.mask = tx_size - 1;
+    rx_ring.mask = rx_size - 1;
+    tx_ring.head = tx_ring.tail = 0;
+    rx_ring.head = rx_ring.tail = 0;
+    bzero(&uart_statistics, sizeof(uart_stats_t));
+
+    mmio_write(UART0_IMSC, 0);
+    mmio_write(UART0_ICR, 0x7ff);
+
+    // The FIFOs may only be switched on while the UART is disabled and idle
+    lcrh = mmio_read(UART0_LCRH);
+    if (!(lcrh & UART_LCRH_FEN)) {
+        while (read_flags().busy);
+        control.as_int = mmio_read(UART0_CR);
+        mmio_write(UART0_CR, control.as_int & ~1);
+        mmio_write(UART0_LCRH, lcrh | UART_LCRH_FEN);
+        mmio_write(UART0_CR, control.as_int);
+    }
+    mmio_write(UART0_IFLS, (rx_level << 3) | tx_level);
+
+    register_irq_handler(UART_IRQ, uart_irq_handler, uart_irq_clearer);
+    irq_mode = 1;
+    mmio_write(UART0_IMSC, UART_INT_RX | UART_INT_TX | UART_INT_RT | UART_INT_OE);
+}
+
+/**
+ * Queues bytes for sending without waiting
+ * @param buf The bytes to send
+ * @param len Number of bytes
+ * @return Number of bytes queued, the rest is counted as TX overflow
+ */
+size_t uart_write(const char * buf, size_t len) {
+    size_t queued;
+    int enabled;
+
+    if (!irq_mode) {
+        for (queued = 0; queued < len; queued++)
+            uart_polled_putc(buf[queued]);
+        return len;
+    }
+
+    enabled = irq_save();
+    queued = RING_FREE(&tx_ring);
+    if (queued > len)
+        queued = len;
+    ring_put(&tx_ring, buf, queued);
+    uart_statistics.tx_overflows += len - queued;
+    uart_tx_fill();
+    irq_restore(enabled);
+    return queued;
+}
+
 /**
- * Prints a character to UART
+ * Reads received bytes without waiting
+ * @param buf Buffer to read into
+ * @param len Size of the buffer
+ * @return Number of bytes read, 0 if nothing was received
+ */
+size_t uart_read(char * buf, size_t len) {
+    size_t received;
+    int enabled;
+
+    if (!irq_mode) {
+        for (received = 0; received < len && !read_flags().recieve_queue_empty; received++)
+            buf[received] = mmio_read(UART0_DR);
+        return received;
+    }
+
+    enabled = irq_save();
+    received = RING_USED(&rx_ring);
+    if (received > len)
+        received = len;
+    ring_get(&rx_ring, buf, received);
+    irq_restore(enabled);
+    return received;
+}
+
+/**
+ * Waits until all queued output has left the UART
+ */
+void uart_flush(void) {
+    int enabled;
+    while (irq_mode && RING_USED(&tx_ring) != 0) {
+        enabled = irq_save();
+        uart_tx_fill();
+        irq_restore(enabled);
+    }
+    while (read_flags().busy);
+}
+
+/**
+ * Copies the UART counters
+ * @param stats Filled with the current counters
+ */
+void uart_stats(uart_stats_t * stats) {
+    int enabled = irq_save();
+    *stats = uart_statistics;
+    irq_restore(enabled);
+}
+
+/**
+ * Prints a character to UART by polling, regardless of the driver mode
  * @param c The character to send
  */
-void uart_putc(unsigned char c) {
+void uart_polled_putc(unsigned char c) {
     uart_flags_t flags;
     do {
         flags = read_flags();
@@ -34,13 +271,85 @@ void uart_putc(unsigned char c) {
 }
 
 /**
- * Print a string to UART
+ * Print a string to UART by polling, regardless of the driver mode
  * @param str The string to send
  */
-void uart_puts(const char * str) {
+void uart_polled_puts(const char * str) {
     int i;
     for (i = 0; str[i] != '\0'; i ++)
-        uart_putc(str[i]);
+        uart_polled_putc(str[i]);
+}
+
+/**
+ * Drains the queued output and switches back to polled mode for good.
+ * Meant for exception handlers that cannot rely on interrupts anymore
+ */
+void uart_panic_mode(void) {
+    DISABLE_INTERRUPTS();
+    if (!irq_mode)
+        return;
+    mmio_write(UART0_IMSC, 0);
+    while (RING_USED(&tx_ring) != 0)
+        uart_tx_fill();
+    irq_mode = 0;
+}
+
+/**
+ * Prints a character to UART.
+ * In interrupt driven mode this only waits if the TX ring is full
+ * @param c The character to send
+ */
+void uart_putc(unsigned char c) {
+    int enabled;
+
+    if (!irq_mode) {
+        uart_polled_putc(c);
+        return;
+    }
+
+    enabled = irq_save();
+    // Make room by pushing the oldest bytes out by hand
+    while (RING_FREE(&tx_ring) == 0)
+        uart_tx_fill();
+    tx_ring.buf[tx_ring.head & tx_ring.mask] = c;
+    tx_ring.head++;
+    uart_tx_fill();
+    irq_restore(enabled);
+}
+
+/**
+ * Sends a buffer to UART in one go.
+ * In interrupt driven mode this only waits while the TX ring is full
+ * @param buf The bytes to send
+ * @param len Number of bytes
+ */
+void uart_putn(const char * buf, size_t len) {
+    size_t queued;
+    int enabled;
+
+    if (!irq_mode) {
+        for (queued = 0; queued < len; queued++)
+            uart_polled_putc(buf[queued]);
+        return;
+    }
+
+    while (len > 0) {
+        enabled = irq_save();
+        queued = MIN(RING_FREE(&tx_ring), len);
+        ring_put(&tx_ring, buf, queued);
+        uart_tx_fill();
+        irq_restore(enabled);
+        buf += queued;
+        len -= queued;
+    }
+}
+
+/**
+ * Print a string to UART
+ * @param str The string to send
+ */
+void uart_puts(const char * str) {
+    uart_putn(str, strlen(str));
 }
 
 /**
@@ -48,8 +357,19 @@ void uart_puts(const char * str) {
  * @return single character
  */
 unsigned char uart_getc() {
-    // Wait for UART to have received something.
+    char c;
     uart_flags_t flags;
+
+    if (irq_mode) {
+        while (uart_read(&c, 1) == 0) {
+            // Nobody else will drain the FIFO
+            if (!INTERRUPTS_ENABLED())
+                uart_rx_drain();
+        }
+        return c;
+    }
+
+    // Wait for UART to have received something.
     do {
         flags = read_flags();
     }
@@ -68,31 +388,17 @@ void uart_println(const char * str) {
 
 /**
  * Print formatted string to UART
- * @param fmt currently only supports %%, %d, %f, %s without modifiers
+ * @param fmt see vsnprintf
  * @param ... values to be rendered
  */
+static void uart_printf_sink(const char * buf, uint32_t len) {
+    uart_putn(buf, len);
+}
+
 void uart_printf(const char * fmt, ...) {
     va_list args;
-    va_start(args, fmt);
-
-    for (; *fmt != '\0'; fmt++) {
-        if (*fmt == '%') {
-            switch (*(++fmt)) {
-                case '%':
-                    uart_putc('%');
-                    break;
-                case 'd':
-                    uart_puts(itoa(va_arg(args, int), 10));
-                    break;
-                case 'x':
-                    uart_puts(itoa(va_arg(args, int), 16));
-                    break;
-                case 's':
-                    uart_puts(va_arg(args, char *));
-                    break;
-            }
-        } else uart_putc(*fmt);
-    }
 
+    va_start(args, fmt);
+    vprintf_to(uart_printf_sink, fmt, args);
     va_end(args);
-}
\ No newline at end of file
+}
@@ -230,11 +230,11 @@ uint64_t fread(void *ptr, uint64_t size, uint64_t nmemb, FILE *stream) {
     uint64_t bytes_to_read = size * nmemb;
     if(bytes_to_read > (uint64_t)(stream->len - stream->pos))
         bytes_to_read = (uint64_t)(stream->len - stream->pos);
-    uint64_t nmemb_to_read = div(bytes_to_read, size);
+    uint64_t nmemb_to_read = divmod64(bytes_to_read, size).div;
     bytes_to_read = nmemb_to_read * size;
 
     bytes_to_read = stream->fs->fread(stream->fs, ptr, bytes_to_read, stream);
-    return div(bytes_to_read, size);
+    return divmod64(bytes_to_read, size).div;
 }
 
 uint64_t fwrite(void *ptr, uint64_t size, uint64_t nmemb, FILE *stream) {
@@ -249,7 +249,7 @@ uint64_t fwrite(void *ptr, uint64_t size, uint64_t nmemb, FILE *stream) {
         for(uint64_t i = 0; i < bytes_to_write; i++)
             uart_putc((char)c_buf[i]);
     } else {
-        uint64_t nmemb_to_write = div(bytes_to_write, size);
+        uint64_t nmemb_to_write = divmod64(bytes_to_write, size).div;
         bytes_to_write = nmemb_to_write * size;
         if(stream->fs->fwrite == NULL) {
             errno = EROFS;
@@ -257,7 +257,7 @@ uint64_t fwrite(void *ptr, uint64_t size, uint64_t nmemb, FILE *stream) {
         }
         bytes_to_write = stream->fs->fwrite(stream->fs, ptr, bytes_to_write, stream);
     }
-    return div(bytes_to_write, size);
+    return divmod64(bytes_to_write, size).div;
 }
 
 int fflush(FILE *fp) {
@@ -269,6 +269,11 @@ int fflush(FILE *fp) {
         fp->fflush_cb(fp);
     if(fp->fs->fflush)
         fp->fs->fflush(fp);
+    // Written blocks may still sit in the block cache
+    if(fp->fs->parent != NULL && block_sync(fp->fs->parent) != 0) {
+        errno = EIO;
+        return -1;
+    }
     return 0;
 }
 
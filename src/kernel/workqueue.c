@@ -0,0 +1,85 @@
+#include <kernel/workqueue.h>
+#include <kernel/msgqueue.h>
+#include <kernel/mutex.h>
+#include <kernel/atomic.h>
+#include <kernel/latency.h>
+#include <kernel/pmu.h>
+#include <kernel/uart.h>
+#include <common/stdlib.h>
+
+/**
+ * Work items travel through a msgqueue_t, so queuing from an IRQ handler takes neither a lock nor an
+ * allocation. A message queue has a single consumer, the workers take turns at it through a mutex and
+ * drop it before running the work.
+ */
+
+typedef struct {
+    work_func_f func;
+    uint32_t arg;
+    uint32_t queued_at;         // pmu_cycles when queued
+} work_item_t;
+
+static msgqueue_t work_items;
+static mutex_t consumer_lock;
+// The workers update both concurrently
+static volatile uint32_t executed = 0;
+static latency_stats_t latency = LATENCY_STATS_INIT;
+
+static void workqueue_thread(void) {
+    work_item_t item;
+
+    while (1) {
+        mutex_lock(&consumer_lock);
+        msgq_recv(&work_items, &item, WAIT_FOREVER);
+        mutex_unlock(&consumer_lock);
+
+        latency_record(&latency, pmu_cycles() - item.queued_at);
+        item.func(item.arg);
+        atomic_fetch_add(&executed, 1);
+    }
+}
+
+/**
+ * Creates the work queue and its threads. Needs the scheduler
+ */
+void workqueue_init(void) {
+    uint32_t i;
+
+    if (msgq_init(&work_items, sizeof(work_item_t), WORKQUEUE_CAPACITY) != 0) {
+        uart_puts("ERROR: CANNOT ALLOCATE WORK QUEUE\n");
+        return;
+    }
+    mutex_init(&consumer_lock);
+    for (i = 0; i < WORKQUEUE_THREADS; i++)
+        create_kernel_thread(workqueue_thread, "WORKER", 6, WORKQUEUE_PRIORITY);
+}
+
+/**
+ * Queues func(arg) to run on a worker thread. Safe from IRQ handlers
+ * @return 0 on success, -1 if the queue is full or not set up
+ */
+int work_queue(work_func_f func, uint32_t arg) {
+    work_item_t * item;
+
+    if (work_items.slots == NULL)
+        return -1;
+    item = msgq_reserve(&work_items);
+    if (item == NULL)
+        return -1;
+    item->func = func;
+    item->arg = arg;
+    item->queued_at = pmu_cycles();
+    msgq_commit(&work_items, item);
+    return 0;
+}
+
+void workqueue_stats(workqueue_stats_t * stats) {
+    latency_stats_t copy;
+
+    latency_get(&latency, &copy);
+    stats->executed = executed;
+    stats->dropped = work_items.dropped;
+    stats->queued = work_items.reserved;
+    stats->latency_max = copy.max;
+    stats->latency_avg = latency_avg(&copy);
+}
@@ -1,7 +1,11 @@
+#include <stddef.h>
 #include <kernel/mem.h>
 #include <kernel/gpio.h>
 #include <kernel/timer.h>
 #include <kernel/uart.h>
+#include <kernel/interrupts.h>
+#include <kernel/process.h>
+#include <kernel/pmu.h>
 #include <common/stdlib.h>
 #include <lib/a4988.h>
 
@@ -82,4 +86,159 @@ void motor_turn_steps_in_usec(motor_t *motor, uint64_t steps, uint32_t usec) {
         udelay(budget);
     }
     motor_pause(motor);
-}
\ No newline at end of file
+}
+/**
+ * Timer driven stepping. System timer channel 3 fires every half step and each match toggles the step pin,
+ * either from the FIQ through motor_fiq_handler or from a normal IRQ doing the same in C. The FIQ is neither
+ * delayed by other interrupt handlers nor by DISABLE_INTERRUPTS, so its step timing stays steady under load.
+ */
+extern void motor_fiq_handler(void);
+
+// The offsets motor_fiq_handler uses
+_Static_assert(offsetof(motor_timing_t, intervals.total) == 0, "a4988_fiq.S: intervals.total");
+_Static_assert(offsetof(motor_timing_t, intervals.count) == 8, "a4988_fiq.S: intervals.count");
+_Static_assert(offsetof(motor_timing_t, intervals.min) == 12, "a4988_fiq.S: intervals.min");
+_Static_assert(offsetof(motor_timing_t, intervals.max) == 16, "a4988_fiq.S: intervals.max");
+_Static_assert(offsetof(motor_timing_t, remaining) == 24, "a4988_fiq.S: remaining");
+_Static_assert(offsetof(motor_timing_t, last_edge) == 28, "a4988_fiq.S: last_edge");
+_Static_assert(offsetof(motor_timing_t, edges) == 32, "a4988_fiq.S: edges");
+
+static motor_timing_t timing;
+static motor_t * timed_motor = NULL;
+static int timed_mode;
+static uint32_t timed_half_period;
+
+static void motor_irq_clearer(void) {
+    uint32_t next, now;
+
+    mmio_write(SYSTEM_TIMER_BASE + TIMER_CS, 1 << 3);
+    if (timing.remaining == 0)
+        return;
+    gpio_write(timed_motor->pin_step, (timing.remaining & 1) ? LOW : HIGH);
+    if (--timing.remaining != 0) {
+        next = mmio_read(SYSTEM_TIMER_BASE + TIMER_C3) + timed_half_period;
+        now = mmio_read(SYSTEM_TIMER_BASE + TIMER_CLO);
+        if ((int32_t)(next - now) < 2)
+            next = now + 2;
+        mmio_write(SYSTEM_TIMER_BASE + TIMER_C3, next);
+    }
+
+    now = pmu_cycles();
+    if (timing.edges++ != 0)
+        latency_record(&timing.intervals, now - timing.last_edge);
+    timing.last_edge = now;
+}
+
+static void motor_irq_handler(void) {
+}
+
+/**
+ * Starts stepping in the background, timed by system timer channel 3
+ * @param steps Full steps, multiplied by the microstepping of the motor
+ * @param step_usec Microseconds per (micro)step, at least 4
+ * @param mode MOTOR_TIMED_FIQ or MOTOR_TIMED_IRQ
+ * @return 0 if started, -1 if a job is still running or step_usec is too short
+ */
+int motor_timed_steps(motor_t *motor, uint32_t steps, uint32_t step_usec, int mode) {
+    uint32_t banked[5];
+
+    if (motor_timed_busy() || step_usec < 4)
+        return -1;
+    if (timed_motor != NULL)
+        motor_timed_wait();
+
+    timed_motor = motor;
+    timed_mode = mode;
+    timed_half_period = step_usec >> 1;
+    timing.remaining = steps * motor->config->microstepping * 2;
+    timing.edges = 0;
+    latency_init(&timing.intervals);
+    gpio_write(motor->pin_step, LOW);
+    motor_unpause(motor);
+
+    if (mode == MOTOR_TIMED_FIQ) {
+        banked[0] = (uint32_t)&timing;
+        banked[1] = GPIO_BASE;
+        banked[2] = SYSTEM_TIMER_BASE;
+        banked[3] = 1 << motor->pin_step;
+        banked[4] = timed_half_period;
+        register_fiq_handler(SYSTEM_TIMER_3, motor_fiq_handler, banked);
+    } else {
+        register_irq_handler(SYSTEM_TIMER_3, motor_irq_handler, motor_irq_clearer);
+    }
+    mmio_write(SYSTEM_TIMER_BASE + TIMER_C3, uuptime() + timed_half_period);
+    return 0;
+}
+
+/**
+ * @return Whether a motor_timed_steps job is still generating steps
+ */
+int motor_timed_busy(void) {
+    return timing.remaining != 0;
+}
+
+/**
+ * Sleeps until the running job is done, then pauses the motor and releases the timer channel
+ */
+void motor_timed_wait(void) {
+    if (timed_motor == NULL)
+        return;
+    while (motor_timed_busy())
+        ksleep_us(1000);
+    if (timed_mode == MOTOR_TIMED_FIQ)
+        unregister_fiq_handler();
+    else
+        unregister_irq_handler(SYSTEM_TIMER_3);
+    motor_pause(timed_motor);
+    timed_motor = NULL;
+}
+
+/**
+ * @param result Receives the edge timing of the last job
+ */
+void motor_timed_timing(motor_timing_t *result) {
+    // The FIQ handler updates it, DISABLE_INTERRUPTS would not hold it off
+    uint32_t cpsr = DISABLE_IRQ_FIQ();
+
+    *result = timing;
+    RESTORE_IRQ_FIQ(cpsr);
+}
+
+/**
+ * Jitter harness: runs the same job with IRQ and FIQ timing while a load thread keeps interrupts disabled
+ * for stretches of MOTOR_BENCH_LOAD_US, like long kernel critical sections do, and prints the spread of the
+ * edge to edge intervals
+ */
+#define MOTOR_BENCH_STEPS 400
+#define MOTOR_BENCH_STEP_USEC 200
+#define MOTOR_BENCH_LOAD_US 50
+
+static volatile int bench_load_running;
+
+static void motor_bench_load(void) {
+    while (bench_load_running) {
+        DISABLE_INTERRUPTS();
+        udelay(MOTOR_BENCH_LOAD_US);
+        ENABLE_INTERRUPTS();
+        ksleep_us(MOTOR_BENCH_LOAD_US);
+    }
+}
+
+void motor_jitter_bench(motor_t *motor) {
+    const char * names[2] = { "IRQ", "FIQ" };
+    motor_timing_t result;
+    int mode;
+
+    bench_load_running = 1;
+    create_kernel_thread(motor_bench_load, "LOAD", 4, current_process->priority);
+    for (mode = MOTOR_TIMED_IRQ; mode <= MOTOR_TIMED_FIQ; mode++) {
+        if (motor_timed_steps(motor, MOTOR_BENCH_STEPS, MOTOR_BENCH_STEP_USEC, mode) != 0)
+            continue;
+        motor_timed_wait();
+        motor_timed_timing(&result);
+        uart_printf("motor_jitter_bench %s: %u edges, interval min %u avg %u max %u cycles, jitter %u cycles\n",
+                names[mode], result.edges, result.intervals.min, latency_avg(&result.intervals), result.intervals.max,
+                result.intervals.max - result.intervals.min);
+    }
+    bench_load_running = 0;
+}